@@ -1,6 +1,13 @@
+DROP TABLE IF EXISTS `transfers`;
+DROP TABLE IF EXISTS `unread_counters`;
 DROP TABLE IF EXISTS `unread_messages`;
+DROP TABLE IF EXISTS `message_recipients`;
 DROP TABLE IF EXISTS `messages`;
+DROP TABLE IF EXISTS `conversations`;
+DROP TABLE IF EXISTS `channel_members`;
+DROP TABLE IF EXISTS `channels`;
 DROP TABLE IF EXISTS `users_sessions`;
+DROP TABLE IF EXISTS `session_tokens`;
 DROP TABLE IF EXISTS `users`;
 
 CREATE TABLE `users` (
@@ -27,14 +34,67 @@ CREATE TABLE `active_sessions` (
 		ON UPDATE CASCADE
 );
 
+CREATE TABLE `session_tokens` (
+	`token_hash` CHAR(64) NOT NULL PRIMARY KEY,
+	`user_id` BIGINT NOT NULL,
+	`expires` TIMESTAMP NOT NULL,
+	INDEX `session_tokens_user` (`user_id`),
+	FOREIGN KEY (`user_id`)
+		REFERENCES `users`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE
+);
+
+CREATE TABLE `channels` (
+	`id` BIGINT NOT NULL AUTO_INCREMENT PRIMARY KEY,
+	`name` VARCHAR(200) NOT NULL,
+	`owner` BIGINT NOT NULL,
+	`created` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+	UNIQUE(`name`),
+	FOREIGN KEY (`owner`)
+		REFERENCES `users`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE
+);
+
+CREATE TABLE `channel_members` (
+	`channel_id` BIGINT NOT NULL,
+	`user_id` BIGINT NOT NULL,
+	`last_read_id` BIGINT NOT NULL DEFAULT -1,
+	PRIMARY KEY (`channel_id`, `user_id`),
+	INDEX `channel_members_user` (`user_id`),
+	FOREIGN KEY (`channel_id`)
+		REFERENCES `channels`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE,
+	FOREIGN KEY (`user_id`)
+		REFERENCES `users`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE
+);
+
+CREATE TABLE `conversations` (
+	`id` VARCHAR(255) NOT NULL PRIMARY KEY,
+	`last_seq` BIGINT UNSIGNED NOT NULL
+);
+
 CREATE TABLE `messages` (
 	`id` BIGINT NOT NULL PRIMARY KEY,
 	`type` VARCHAR(10),
+	`conversation` VARCHAR(255),
+	`seq` BIGINT UNSIGNED,
+	`client_id` VARCHAR(64),
 	`sender` BIGINT NOT NULL,
 	`receiver` BIGINT,
+	`channel` BIGINT,
 	`text` TEXT NOT NULL,
 	`sent` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
-	CHECK(`type` IN ('BROADCAST', 'PRIVATE')),
+	CHECK(`type` IN ('BROADCAST', 'PRIVATE', 'CHANNEL')),
+	INDEX `messages_type_id` (`type`, `id`),
+	INDEX `messages_conversation` (`sender`, `receiver`, `id`),
+	INDEX `messages_channel` (`channel`, `id`),
+	UNIQUE INDEX `messages_conversation_seq` (`conversation`, `seq`),
+	UNIQUE INDEX `messages_client_id` (`sender`, `client_id`),
 	FOREIGN KEY (`sender`)
 		REFERENCES `users`(`id`)
 		ON DELETE CASCADE
@@ -42,6 +102,25 @@ CREATE TABLE `messages` (
 	FOREIGN KEY (`receiver`)
 		REFERENCES `users`(`id`)
 		ON DELETE CASCADE
+		ON UPDATE CASCADE,
+	FOREIGN KEY (`channel`)
+		REFERENCES `channels`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE
+);
+
+CREATE TABLE `message_recipients` (
+	`message_id` BIGINT NOT NULL,
+	`user_id` BIGINT NOT NULL,
+	PRIMARY KEY (`message_id`, `user_id`),
+	INDEX `message_recipients_user` (`user_id`, `message_id`),
+	FOREIGN KEY (`user_id`)
+		REFERENCES `users`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE,
+	FOREIGN KEY (`message_id`)
+		REFERENCES `messages`(`id`)
+		ON DELETE CASCADE
 		ON UPDATE CASCADE
 );
 
@@ -59,4 +138,28 @@ CREATE TABLE `unread_messages` (
 		ON UPDATE CASCADE
 );
 
+-- unread messages of every user per conversation, kept up to date on send and acknowledgement
+CREATE TABLE `unread_counters` (
+	`user_id` BIGINT NOT NULL,
+	`conversation` VARCHAR(255) NOT NULL,
+	`count` INT NOT NULL DEFAULT 0,
+	PRIMARY KEY (`user_id`, `conversation`),
+	FOREIGN KEY (`user_id`)
+		REFERENCES `users`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE
+);
+
+CREATE TABLE `transfers` (
+	`message_id` BIGINT NOT NULL PRIMARY KEY,
+	`kind` VARCHAR(10) NOT NULL,
+	`name` VARCHAR(255) NOT NULL,
+	`size` BIGINT UNSIGNED NOT NULL,
+	`hash` CHAR(64),
+	CHECK(`kind` IN ('TEXT', 'FILE')),
+	FOREIGN KEY (`message_id`)
+		REFERENCES `messages`(`id`)
+		ON DELETE CASCADE
+		ON UPDATE CASCADE
+);
 
@@ -0,0 +1,40 @@
+#include "attachment_store.h"
+
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+AttachmentStore::AttachmentStore(const std::string &root) : root_{ root } {}
+
+bool AttachmentStore::isValidHash(const std::string &hash) {
+	if (hash.length() != 64) {
+		return false;
+	}
+	for (auto c: hash) {
+		if (!(c >= '0' && c <= '9') && !(c >= 'a' && c <= 'f')) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::string AttachmentStore::getPath(const std::string &hash) const {
+	// two levels of 256 directories keep directories small
+	return root_ + "/" + hash.substr(0, 2) + "/" + hash.substr(2, 2) + "/" + hash;
+}
+
+std::string AttachmentStore::getTemporaryPath(const unsigned long long uploadId) const {
+	return root_ + "/tmp/" + std::to_string(uploadId);
+}
+
+bool AttachmentStore::contains(const std::string &hash) const {
+	return fs::exists(getPath(hash));
+}
+
+void AttachmentStore::commit(const std::string &temporaryPath, const std::string &hash) const {
+	fs::path path{ getPath(hash) };
+	fs::create_directories(path.parent_path());
+	// rename is atomic, readers never see a partially written file in the store.
+	// Readers which have opened the temporary file keep reading the same inode
+	fs::rename(temporaryPath, path);
+}
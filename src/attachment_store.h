@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+// Files stored on disk by SHA256 of their content: <root>/ab/cd/abcd...
+// The same content is stored only once however many messages refer to it
+class AttachmentStore final {
+public:
+	explicit AttachmentStore(const std::string &root);
+
+	// 64 lower-case hex digits
+	static bool isValidHash(const std::string &hash);
+
+	std::string getPath(const std::string &hash) const;
+
+	// file for content being uploaded, moved to the store by commit()
+	std::string getTemporaryPath(unsigned long long uploadId) const;
+
+	bool contains(const std::string &hash) const;
+
+	// move completely uploaded file to its place in the store
+	void commit(const std::string &temporaryPath, const std::string &hash) const;
+
+private:
+	std::string root_;
+};
@@ -1,5 +1,6 @@
 #include "broadcast_message.h"
 #include "project_lib.h"
+#include "conversation.h"
 
 #include <iostream>
 #include <fstream>
@@ -12,38 +13,31 @@ BroadcastMessage::BroadcastMessage(
 	const std::string &sender,
 	const std::string &text,
 	const std::map<std::string, ChatUser> &user_list
-	) :
-	users_unread_{ user_list } {
+	) {
 	sender_ = sender;
 	text_ = text;
+	for (const auto &it: user_list) {
+		users_unread_.set(it.second.getUserId());
+	}
 }
 
 BroadcastMessage::BroadcastMessage(
 	const std::string &sender, 
 	const std::string &text,
-	const std::map<std::string, ChatUser> &user_list,
-	const std::string &user_list_str 
-	) {
+	const RecipientSet &users_unread
+	) :
+	users_unread_{ users_unread } {
 	sender_ = sender;
 	text_ = text;
-
-	auto users = Chat::split(user_list_str, ",");
-	for (const auto &s: users) {
-		auto it = user_list.find(s);
-		if (it != user_list.end()) {
-			users_unread_.emplace(it->first, it->second);
-		}
-	}
 }
 
 void BroadcastMessage::print() const {
 	std::cout << sender_ << ": " << text_ << std::endl;
 }
 
-void BroadcastMessage::printIfUnreadByUser(const std::string &user) {
-	if (users_unread_.find(user) != users_unread_.end()) {
-			users_unread_.erase(user);
-			print();
+void BroadcastMessage::printIfUnreadByUser(const ChatUser &user) {
+	if (users_unread_.clear(user.getUserId())) {
+		print();
 	}
 }
 
@@ -63,44 +57,46 @@ void BroadcastMessage::save(const std::string &filename) const {
 		throw std::runtime_error{ "Error: cannot open file" + filename + " for append" };
 	}
 	file << "BROADCAST\n"
-		<< sender_ << '\n';
-	auto size = users_unread_.size();
-	size_t i = 0;
-	for (auto it = users_unread_.begin(); it != users_unread_.end(); ++it) {
-		file << it->first;
-		if (i < size - 1) {
-			file << ',';
-		}
-		++i;
-	}
-	file << '\n' << text_ << std::endl;
+		<< sender_ << '\n'
+		<< users_unread_.serialize() << '\n'
+		<< text_ << std::endl;
 	file.close();
 }
 
-void BroadcastMessage::save(Mysql &mysql) const {
-	std::stringstream ss;
-	mysql.query("SELECT COALESCE(max(`id`), -1) FROM `messages`");
-	auto rows = mysql.fetchAll();
-	unsigned new_id = std::stoi(rows.front().at(0)) + 1;
-	ss << "INSERT INTO `messages` (`id`, `type`, `sender`, `text`) VALUES (" <<
-		new_id << ", 'BROADCAST', "
-		"(SELECT `id` FROM `users` WHERE `login` = '" << sender_ << "'), "
-		"'" << text_ << "')";
-	if (!mysql.query(ss.str())) {
-		std::cout << ss.str() << std::endl;
-		std::cout << mysql.getError() << std::endl;
+unsigned long long BroadcastMessage::save(Mysql &mysql) const {
+	auto new_id = insert(mysql, sender_, clientId_, Conversation::broadcast(), [&](unsigned long long id, unsigned long long seq) {
+		std::stringstream ss;
+		ss << "INSERT INTO `messages` (`id`, `type`, `conversation`, `seq`, `client_id`, `sender`, `text`) VALUES (" <<
+			id << ", 'BROADCAST', '" << Conversation::broadcast() << "', " << seq << ", " << getClientIdValue() << ", "
+			"(SELECT `id` FROM `users` WHERE `login` = '" << sender_ << "'), "
+			"'" << text_ << "')";
+		return ss.str();
+	});
+	if (new_id == DUPLICATE) {
+		return DUPLICATE;
 	}
-	
-	for (auto it: users_unread_) {
-		ss.str(std::string{});
-		ss << "INSERT INTO `unread_messages` (`message_id`, `user_id`) "
-			"VALUES (" << new_id << ", "
-			"(SELECT `id` FROM `users` WHERE `login` = '" << it.first << "'))";
-		if (!mysql.query(ss.str())) {
-			std::cout << ss.str() << std::endl;
-			std::cout << mysql.getError() << std::endl;
+
+	if (users_unread_.empty()) {
+		return new_id;
+	}
+	// all recipients are marked unread in one statement
+	std::stringstream ss;
+	ss << "INSERT INTO `unread_messages` (`message_id`, `user_id`) VALUES ";
+	bool first = true;
+	users_unread_.forEach([&](unsigned user_id) {
+		if (!first) {
+			ss << ", ";
 		}
+		ss << "(" << new_id << ", " << user_id << ")";
+		first = false;
+	});
+	if (!mysql.query(ss.str())) {
+		// counters are raised only for rows which have been stored
+		throw std::runtime_error{ mysql.getError() };
 	}
+	Conversation::addUnread(mysql, Conversation::broadcast(),
+		"SELECT `user_id` FROM `unread_messages` WHERE `message_id` = " + std::to_string(new_id));
+	return new_id;
 }
 
 std::string BroadcastMessage::createTransferString() const {
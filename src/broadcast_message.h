@@ -1,6 +1,7 @@
 #pragma once
 #include "chat_message.h"
 #include "chat_user.h"
+#include "recipient_set.h"
 
 #include <map>
 #include <string>
@@ -9,19 +10,19 @@
 class BroadcastMessage final : public ChatMessage {
 public:
 	BroadcastMessage(const std::string &, const std::string &, const std::map<std::string, ChatUser> &);
-	BroadcastMessage(const std::string &, const std::string &, const std::map<std::string, ChatUser> &, const std::string &);
+	BroadcastMessage(const std::string &, const std::string &, const RecipientSet &);
 
 	// print the message
 	void print() const override;
 
 	// print the message if it is unread by user
-	void printIfUnreadByUser(const std::string &) override;
+	void printIfUnreadByUser(const ChatUser &) override;
 
 	// check if message is read
 	bool isRead() const override;
   
-	// save message to database
-	void save(Mysql &mysql) const override;
+	// save message to database, returns id of the new message
+	unsigned long long save(Mysql &mysql) const override;
 	
 	// save message to file
 	void save(const std::string&) const override;
@@ -31,5 +32,5 @@ public:
 
 private:
 
-	std::map<std::string, ChatUser> users_unread_;
+	RecipientSet users_unread_;
 };
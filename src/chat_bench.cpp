@@ -0,0 +1,138 @@
+// Load generator for comparing I/O backends of the server (IoBackend = select or io_uring).
+// Every connection is a separate process: it connects and sends /ping frames, `pipeline` at a time,
+// waiting for all PONG answers before the next round. /ping needs no login and no database,
+// so the result shows the cost of accepting and socket I/O only.
+// Usage: chat_bench <address> <port> [connections] [requests per connection] [pipeline]
+#include "chat_connection.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+extern "C" {
+	#include <unistd.h>
+	#include <sys/socket.h>
+	#include <sys/wait.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <arpa/inet.h>
+}
+
+namespace {
+	struct Result {
+		long long connectMicroseconds;
+		long long workMicroseconds;
+		unsigned long long requests;
+		bool failed;
+	};
+
+	long long microsecondsSince(const std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	Result runConnection(const sockaddr_in &server, const unsigned requests, const unsigned pipeline) {
+		Result result{ 0, 0, 0, true };
+		auto start = std::chrono::steady_clock::now();
+		int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (fd == -1 || connect(fd, reinterpret_cast<const sockaddr *>(&server), sizeof(server)) == -1) {
+			return result;
+		}
+		// pipelined requests must not wait for each other in the client
+		int trueVal = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &trueVal, sizeof(trueVal));
+		ChatConnection connection{ fd };
+		std::string response;
+		// the first answer shows that the session process is ready
+		if (connection.send("/ping") == -1 || connection.receive(response) != 1) {
+			close(fd);
+			return result;
+		}
+		result.connectMicroseconds = microsecondsSince(start);
+
+		start = std::chrono::steady_clock::now();
+		while (result.requests < requests) {
+			unsigned round = 0;
+			for (; round < pipeline && result.requests + round < requests; ++round) {
+				if (connection.send("/ping") == -1) {
+					close(fd);
+					return result;
+				}
+			}
+			for (unsigned i = 0; i < round; ++i) {
+				if (connection.receive(response) != 1) {
+					close(fd);
+					return result;
+				}
+			}
+			result.requests += round;
+		}
+		result.workMicroseconds = microsecondsSince(start);
+		result.failed = false;
+		close(fd);
+		return result;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3) {
+		std::cerr << "Usage: " << argv[0] << " <address> <port> [connections] [requests per connection] [pipeline]" << std::endl;
+		return EXIT_FAILURE;
+	}
+	sockaddr_in server{};
+	server.sin_family = AF_INET;
+	server.sin_port = htons(std::stoi(argv[2]));
+	if (inet_pton(AF_INET, argv[1], &server.sin_addr) != 1) {
+		std::cerr << "Wrong address: " << argv[1] << std::endl;
+		return EXIT_FAILURE;
+	}
+	unsigned connections = argc > 3 ? std::stoul(argv[3]) : 50;
+	unsigned requests = argc > 4 ? std::stoul(argv[4]) : 10000;
+	unsigned pipeline = argc > 5 ? std::max(1ul, std::stoul(argv[5])) : 1;
+
+	int fds[2];
+	if (pipe(fds) == -1) {
+		std::cerr << "Can not create pipe" << std::endl;
+		return EXIT_FAILURE;
+	}
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < connections; ++i) {
+		if (fork() == 0) {
+			close(fds[0]);
+			auto result = runConnection(server, requests, pipeline);
+			// results are shorter than PIPE_BUF, so writes of the processes are not mixed
+			write(fds[1], &result, sizeof(result));
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	close(fds[1]);
+
+	Result result;
+	unsigned finished = 0, failed = 0;
+	unsigned long long total = 0;
+	long long connectTime = 0, workTime = 0;
+	while (read(fds[0], &result, sizeof(result)) == sizeof(result)) {
+		if (result.failed) {
+			++failed;
+			continue;
+		}
+		++finished;
+		total += result.requests;
+		connectTime += result.connectMicroseconds;
+		workTime += result.workMicroseconds;
+	}
+	while (wait(nullptr) > 0) {
+	}
+	auto elapsed = microsecondsSince(start);
+
+	std::cout << "Connections: " << finished << " finished, " << failed << " failed" << std::endl;
+	if (finished == 0) {
+		return EXIT_FAILURE;
+	}
+	std::cout << "Requests: " << total << " in " << elapsed / 1000 << " ms, "
+		<< (elapsed > 0 ? total * 1000000 / elapsed : 0) << " per second" << std::endl;
+	std::cout << "Average connect time: " << connectTime / finished << " us" << std::endl;
+	std::cout << "Average round trip: " << (total > 0 ? workTime * pipeline / static_cast<long long>(total) : 0)
+		<< " us for " << pipeline << " requests" << std::endl;
+	return EXIT_SUCCESS;
+}
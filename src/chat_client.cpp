@@ -6,8 +6,15 @@
 #include <filesystem>
 #include <stdexcept>
 #include <sstream>
+#include <iomanip>
+#include <random>
+#include <thread>
+#include <ctime>
 #if defined(__linux__)
 #include <sys/utsname.h>
+#include <sys/file.h>
+#include <sys/select.h>
+#include <fcntl.h>
 #elif defined(_WIN64) or defined(_WIN32)
 #pragma comment(lib, "ntdll")
 
@@ -43,13 +50,7 @@ ChatClient::ChatClient() {
 	server_.sin_port = htons(stoi(config_["ServerPort"]));
 	server_.sin_family = AF_INET;
 
-	sockFd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sockFd_ == -1) {
-		throw std::runtime_error{ "Error while creating socket" };
-	}
-
-	auto connection = connect(sockFd_, reinterpret_cast<sockaddr *>(&server_), sizeof(server_));
-	if (connection == -1) {
+	if (!connectToServer()) {
 		if(fs::exists(TEMP_DIR)) {
 			fs::remove_all(TEMP_DIR);
 		}
@@ -70,8 +71,21 @@ void ChatClient::displayHelp() const {
 		" /signin - authorization, only a registered user can authorize\n"
 		" /logout - user logout\n"
 		" /remove - delete registered user\n"
+		" /history [@login] [id] - show older messages of the conversation with login\n"
+		"   or of the broadcast channel; id is the message to scroll back from\n"
+		" /search <words> - find messages containing all the words\n"
+		" /unread [@login|#channel|*] - show next unread messages of the conversation,\n"
+		"   without arguments - number of unread messages in every conversation\n"
+		" /recent [@login|#channel] [n] - show messages stored on this computer, n is the message to scroll back from\n"
+		" /find <words> - find messages stored on this computer\n"
+		" /file [@login] <path> - send file to login or to all users\n"
+		" /join #channel - join channel, channel is created if it does not exist\n"
+		" /leave #channel - leave channel\n"
+		" /channels - list channels you are a member of\n"
 		" /exit - close the program\n"
-		" Start your message with @login if you want to send a private message,\n"
+		" Start your message with @login if you want to send a private message\n"
+		"   (@login1 @login2 ... to send it to several users),\n"
+		"   or with #channel to send it to members of the channel,\n"
 		"   otherwise your message will be broadcasted to all users.\n"
 		"User will receive new messages after login\n"
 		<< std::endl;
@@ -87,6 +101,181 @@ void ChatClient::cleanExit() const {
 	exit(EXIT_SUCCESS);
 }
 
+bool ChatClient::connectToServer() {
+	sockFd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sockFd_ == -1) {
+		throw std::runtime_error{ "Error while creating socket" };
+	}
+	if (connect(sockFd_, reinterpret_cast<sockaddr *>(&server_), sizeof(server_)) == -1) {
+		close(sockFd_);
+		sockFd_ = -1;
+		return false;
+	}
+	// new server session starts without compression
+	connection_.setCompression(ChatConnection::Compression::NONE);
+	connection_.setFd(sockFd_);
+	negotiateCompression();
+	return true;
+}
+
+void ChatClient::reconnect() {
+	connectionLost_ = 0;
+	if (pollerPid_ > 0) {
+		kill(pollerPid_, SIGTERM);
+		pollerPid_ = 0;
+	}
+	if (sockFd_ != -1) {
+		close(sockFd_);
+		sockFd_ = -1;
+	}
+	fs::remove(RESPONSE);
+	fs::remove(RESPONSE_LOCK);
+
+	auto attempts = std::stoul(config_.get("ReconnectAttempts", DEFAULT_RECONNECT_ATTEMPTS));
+	auto maxDelay = std::stoul(config_.get("ReconnectMaxDelay", DEFAULT_RECONNECT_MAX_DELAY));
+	unsigned delay{ 1 };
+	for (unsigned long attempt = 1; attempt <= attempts; ++attempt) {
+		clearPrompt();
+		std::cout << "Reconnecting to server (attempt " << attempt << " of " << attempts << ")..." << std::endl;
+		try {
+			if (connectToServer() && (loggedUser_.empty() || resumeSession())) {
+				std::cout << "Connection restored" << std::endl;
+				return;
+			}
+		}
+		catch (const std::invalid_argument &e) {
+			// connection was lost again during handshake
+		}
+		catch (const std::runtime_error &e) {
+			// e.g. socket() has failed, it is one more failed attempt
+			std::cout << e.what() << std::endl;
+		}
+		if (sockFd_ != -1) {
+			close(sockFd_);
+			sockFd_ = -1;
+		}
+		// exponential backoff
+		sleep(delay);
+		delay = std::min<unsigned long>(delay * 2, maxDelay);
+	}
+	std::cout << "Error: could not reconnect to server" << std::endl;
+	cleanExit();
+}
+
+bool ChatClient::resumeSession() {
+	connectionLost_ = 0;
+	if (sessionToken_.empty()) {
+		std::cout << "Session can not be resumed, please sign in again" << std::endl;
+		loggedUser_.clear();
+		return true;
+	}
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, ("/resume:" + loggedUser_ + ":" + sessionToken_).c_str());
+	sendRequest();
+	receiveResponse();
+	if (strncmp(message_, "/response:success", 17) != 0) {
+		std::cout << "Session has expired, please sign in again" << std::endl;
+		loggedUser_.clear();
+		sessionToken_.clear();
+		localHistory_.reset();
+		fs::remove(SEQUENCES);
+		return true;
+	}
+	startPoller();
+	syncMissedMessages();
+	retryRecentMessages();
+	return true;
+}
+
+std::string ChatClient::createMessageId() {
+	// unique for the sender across sessions: random instance id and counter
+	static const std::string instance = [] {
+		std::random_device random;
+		std::stringstream ss;
+		ss << std::hex << std::setfill('0') << std::setw(8) << random() << std::setw(8) << random();
+		return ss.str();
+	}();
+	return instance + "-" + std::to_string(++messageCounter_);
+}
+
+void ChatClient::sendMessage(const std::string &text) {
+	std::string frame{ "/send:" + createMessageId() + ":" + text };
+	// sent messages are kept for a while to be retried after reconnect; server drops duplicates by id
+	auto now = std::chrono::steady_clock::now();
+	while (!outbox_.empty() && now - outbox_.front().sent > RETRY_WINDOW) {
+		outbox_.pop_front();
+	}
+	outbox_.push_back(OutgoingMessage{ frame, now });
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strncpy(message_, frame.c_str(), MESSAGE_LENGTH - 1);
+	sendRequest();
+}
+
+void ChatClient::retryRecentMessages() {
+	auto now = std::chrono::steady_clock::now();
+	for (const auto &message: outbox_) {
+		if (now - message.sent > RETRY_WINDOW) {
+			continue;
+		}
+		std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+		strncpy(message_, message.frame.c_str(), MESSAGE_LENGTH - 1);
+		sendRequest();
+	}
+	outbox_.clear();
+}
+
+void ChatClient::syncMissedMessages() {
+	// last sequence numbers are saved by the poller which lost the connection
+	std::ifstream file{ SEQUENCES };
+	std::vector<std::string> requests;
+	std::string request, conversation;
+	unsigned long long seq;
+	while (file >> conversation >> seq) {
+		std::string entry{ conversation + "=" + std::to_string(seq) };
+		if (!request.empty() && request.length() + entry.length() + 1 >= MESSAGE_LENGTH) {
+			requests.push_back(request);
+			request.clear();
+		}
+		request += (request.empty() ? "/sync:" : ";") + entry;
+	}
+	if (!request.empty()) {
+		requests.push_back(request);
+	}
+	// missed messages are printed by the poller, duplicates are dropped by sequence numbers
+	for (const auto &cmd: requests) {
+		std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+		strncpy(message_, cmd.c_str(), MESSAGE_LENGTH - 1);
+		sendRequest();
+		waitForResponse();
+	}
+}
+
+void ChatClient::waitForResponse() const {
+	while (!readResponseFromFile()) {
+		if (connectionLost_) {
+			throw std::invalid_argument("Connection with server was lost");
+		}
+		sleep(1);
+	}
+}
+
+void ChatClient::saveSequences() const {
+	std::ofstream file{ SEQUENCES, std::ios::out | std::ios::trunc };
+	for (const auto &[conversation, seq]: lastSequence_) {
+		file << conversation << ' ' << seq << '\n';
+	}
+}
+
+void ChatClient::loadSequences() {
+	lastSequence_.clear();
+	std::ifstream file{ SEQUENCES };
+	std::string conversation;
+	unsigned long long seq;
+	while (file >> conversation >> seq) {
+		lastSequence_[conversation] = seq;
+	}
+}
+
 // login availability
 bool ChatClient::isLoginAvailable(const std::string& login) const {
 	strcpy(message_, "/checklogin:");
@@ -176,11 +365,14 @@ void ChatClient::signIn() {
 		auto tokens = Chat::split(std::string{ message_ }, ":");
 		std::string name;
 		unsigned user_id;
-		if (tokens.size() >= 3) {
+		if (tokens.size() >= 4) {
 			name = tokens[2];
 			user_id = std::stoi(tokens[3]);
 		}
+		sessionToken_ = tokens.size() >= 5 ? tokens[4] : std::string{};
 		loggedUser_ = login;
+		fs::remove(SEQUENCES);
+		openLocalHistory();
 		startPoller();
 	}
 	else if (strncmp(message_, "/response:loggedin", 18) == 0) {
@@ -200,13 +392,96 @@ void ChatClient::startPoller() {
 		return;
 	}
 
+	loadSequences();
+	// flock() does not separate processes sharing one open file, so the poller opens the file again
+	openLocalHistory();
+	heartbeatInterval_ = std::chrono::seconds{ std::stoul(config_.get("HeartbeatInterval", DEFAULT_HEARTBEAT_INTERVAL)) };
+	heartbeatMisses_ = std::stoul(config_.get("HeartbeatMisses", DEFAULT_HEARTBEAT_MISSES));
+	lastHeard_ = std::chrono::steady_clock::now();
 	while (true) {
+		if (!waitForFrame()) {
+			// dead server looks like a closed connection, read() returns 0 and the poller exits as usual
+			shutdown(sockFd_, SHUT_RDWR);
+		}
 		receiveResponse();
+		lastHeard_ = std::chrono::steady_clock::now();
+		pingsSent_ = 0;
 		if (strncmp(message_, "/response", 9) == 0) {
 			writeResponseToFile();
 			continue;
 		}
+		if (strncmp(message_, "TRANSFER", 8) == 0 || strncmp(message_, "CHUNK\n", 6) == 0) {
+			receiveTransferFrame();
+			continue;
+		}
+		if (strcmp(message_, "PING\n") == 0) {
+			sendFrame("/pong");
+			continue;
+		}
+		if (strcmp(message_, "PONG\n") == 0) {
+			continue;
+		}
 		auto tokens = Chat::split(message_, "\n");
+		if (tokens.size() == 2 && tokens[0] == "NOTICE") {
+			clearPrompt();
+			std::cout << tokens[1] << std::endl;
+			printPrompt();
+			continue;
+		}
+		if (tokens.size() == 2 && tokens[0] == "RECONNECT") {
+			// server is going down: 1: delay in milliseconds, so clients do not come back all at once
+			clearPrompt();
+			std::cout << "Server is restarting, reconnecting..." << std::endl;
+			printPrompt();
+			std::this_thread::sleep_for(std::chrono::milliseconds{ std::stoul(tokens[1]) });
+			// the closed connection is handled as a lost one, the session is resumed by its token
+			shutdown(sockFd_, SHUT_RDWR);
+			continue;
+		}
+		if (tokens.size() == 3 && tokens[0] == "UNREAD") {
+			// 1: conversation, 2: number of unread messages
+			auto target = getConversationTarget(tokens[1]);
+			clearPrompt();
+			std::cout << tokens[2] << " unread message(s) in " << (target == "*" ? std::string{ "broadcast chat" } : target) <<
+				", type /unread " << target << " to read them" << std::endl;
+			printPrompt();
+			continue;
+		}
+		if (tokens.size() == 5 && tokens[0] == "CHANNEL") {
+			// 1: #channel, 2: seq:previous seq:id, 3: sender, 4: text
+			acknowledge(tokens[2]);
+			if (!acceptSequence(tokens[1], tokens[2])) {
+				continue;
+			}
+			if (localHistory_) {
+				localHistory_->append(tokens[1], tokens[3], tokens[4], std::stoull(tokens[2]));
+			}
+			std::stringstream ss;
+			ss << tokens[1] << ' ' << tokens[3] << ": " << tokens[4];
+			clearPrompt();
+			std::cout << ss.str() << std::endl;
+			*logger_ << ss.str();
+			printPrompt();
+			continue;
+		}
+		if (tokens.size() == 5 && tokens[0] == "HISTORY") {
+			// 1: id, 2: sent, 3: sender, 4: text
+			clearPrompt();
+			std::cout << '[' << tokens[1] << "] " << tokens[2] << ' ' << tokens[3] << ": " << tokens[4] << std::endl;
+			printPrompt();
+			continue;
+		}
+		if (tokens.size() == 5 && (tokens[0] == "PRIVATE" || tokens[0] == "BROADCAST")) {
+			// 1: conversation, 2: seq:previous seq:id
+			acknowledge(tokens[2]);
+			if (!acceptSequence(tokens[1], tokens[2])) {
+				continue;
+			}
+			if (localHistory_) {
+				localHistory_->append(tokens[1], tokens[3], tokens[4], std::stoull(tokens[2]));
+			}
+			tokens.erase(tokens.begin() + 1, tokens.begin() + 3);
+		}
 		if (tokens.size() != 3) {
 			continue; // Wrong message
 		}
@@ -223,6 +498,29 @@ void ChatClient::startPoller() {
 	}
 }
 
+bool ChatClient::acceptSequence(const std::string &conversation, const std::string &position) {
+	// 0: seq, 1: seq of the previous message sent by somebody else, 2: message id
+	auto numbers = Chat::split(position, ":");
+	if (numbers.size() < 2) {
+		return true;
+	}
+	auto seq = std::stoull(numbers[0]);
+	auto previous = std::stoull(numbers[1]);
+	auto it = lastSequence_.find(conversation);
+	if (it != lastSequence_.end()) {
+		if (seq <= it->second) {
+			return false; // already received
+		}
+		if (previous > it->second) {
+			clearPrompt();
+			std::cout << "Some messages of " << conversation << " were missed, type /history to load them" << std::endl;
+			printPrompt();
+		}
+	}
+	lastSequence_[conversation] = seq;
+	return true;
+}
+
 void ChatClient::writeResponseToFile() const {
 	while(fs::exists(RESPONSE_LOCK)) {
 		sleep(1);
@@ -273,7 +571,11 @@ void ChatClient::signOut() {
 	strcpy(message_, "/logout");
 	sendRequest();
 	loggedUser_.clear();
+	sessionToken_.clear();
 	kill(pollerPid_, SIGTERM);
+	pollerPid_ = 0;
+	fs::remove(SEQUENCES);
+	localHistory_.reset();
 }
 
 void ChatClient::removeUser() {
@@ -283,9 +585,7 @@ void ChatClient::removeUser() {
 	}
 	strcpy(message_, "/remove");
 	sendRequest();
-	while (!readResponseFromFile()) {
-		sleep(1);
-	}
+	waitForResponse();
 	if (strncmp(message_, "/response:fail", 14) == 0) {
 		std::cout << "Some issue occured while removing current user on server. Try again later" << std::endl;
 	}
@@ -295,27 +595,628 @@ void ChatClient::removeUser() {
 	}
 }
 
+void ChatClient::requestHistory() {
+	if (loggedUser_.empty()) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	std::string peer, before_id{ "0" };
+	auto tokens = Chat::split(std::string{ message_ }, " ");
+	for (size_t i = 1; i < tokens.size(); ++i) {
+		if (tokens[i].empty()) {
+			continue;
+		}
+		if (tokens[i][0] == '@') {
+			peer = tokens[i].substr(1);
+		}
+		else if (std::all_of(tokens[i].begin(), tokens[i].end(), ::isdigit)) {
+			before_id = tokens[i];
+		}
+		else {
+			throw std::invalid_argument("Usage: /history [@login] [id]");
+		}
+	}
+	if (!isValidLogin(peer)) {
+		throw std::invalid_argument("Login contains invalid characters.");
+	}
+
+	std::string cmd{ "/history:" + peer + ":" + before_id + ":" + std::to_string(HISTORY_PAGE_LENGTH) };
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, cmd.c_str());
+	sendRequest();
+	// messages are printed by the poller, the summary comes as a response
+	waitForResponse();
+	// 0: /response, 1: history, 2: count, 3: oldest id
+	tokens = Chat::split(std::string{ message_ }, ":");
+	if (tokens.size() < 4 || tokens[1] != "history") {
+		std::cout << "Can not load message history" << std::endl;
+		return;
+	}
+	if (tokens[2] == "0") {
+		std::cout << "No more messages" << std::endl;
+	}
+	else {
+		std::cout << "Type /history " << (peer.empty() ? std::string{} : "@" + peer + " ") << tokens[3] << " to view older messages" << std::endl;
+	}
+}
+
+std::string ChatClient::getConversationKey(const std::string &target) const {
+	// @login is a conversation of two, longer lists are given as keys
+	if (target.length() > 1 && target[0] == '@' && target.find(',') == std::string::npos) {
+		auto other = target.substr(1);
+		if (other == loggedUser_) {
+			return target;
+		}
+		return "@" + std::min(loggedUser_, other) + "," + std::max(loggedUser_, other);
+	}
+	return target;
+}
+
+std::string ChatClient::getConversationTarget(const std::string &key) const {
+	auto participants = Chat::split(key.substr(1), ",");
+	if (key[0] == '@' && participants.size() == 2 && (participants[0] == loggedUser_ || participants[1] == loggedUser_)) {
+		return "@" + (participants[0] == loggedUser_ ? participants[1] : participants[0]);
+	}
+	return key;
+}
+
+void ChatClient::requestUnread() {
+	if (loggedUser_.empty()) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	auto tokens = Chat::split(std::string{ message_ }, " ");
+	std::string target;
+	for (size_t i = 1; i < tokens.size(); ++i) {
+		if (tokens[i].empty()) {
+			continue;
+		}
+		if (!target.empty() || (tokens[i][0] != '@' && tokens[i][0] != '#' && tokens[i] != "*")) {
+			throw std::invalid_argument("Usage: /unread [@login|#channel|*]");
+		}
+		target = tokens[i];
+	}
+
+	std::string cmd{ "/unread:" + getConversationKey(target) };
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strncpy(message_, cmd.c_str(), MESSAGE_LENGTH - 1);
+	sendRequest();
+	// messages and counters are printed by the poller
+	waitForResponse();
+	// 0: /response, 1: unread, 2: count, 3: more pages
+	tokens = Chat::split(std::string{ message_ }, ":");
+	if (tokens.size() < 3 || tokens[1] != "unread") {
+		std::cout << "Can not load unread messages" << std::endl;
+		return;
+	}
+	if (target.empty()) {
+		if (tokens[2] == "0") {
+			std::cout << "No unread messages" << std::endl;
+		}
+	}
+	else if (tokens.size() > 3 && tokens[3] == "1") {
+		std::cout << "Type /unread " << target << " to read more" << std::endl;
+	}
+	else if (tokens[2] == "0") {
+		std::cout << "No unread messages in " << target << std::endl;
+	}
+}
+
+void ChatClient::openLocalHistory() {
+	localHistory_.reset();
+	try {
+		localHistory_ = std::make_unique<LocalHistory>(
+			config_.get("HistoryDir", DEFAULT_HISTORY_DIR) + "/history_" + loggedUser_ + ".dat");
+	}
+	catch (const std::runtime_error &e) {
+		std::cout << "Warning: " << e.what() << std::endl;
+	}
+}
+
+void ChatClient::storeOwnMessage(const std::string &message) {
+	if (!localHistory_) {
+		return;
+	}
+	// conversation key is built the same way as on the server
+	std::string conversation{ "*" };
+	size_t pos = 0;
+	if (message[0] == '#') {
+		pos = message.find(' ');
+		if (pos == std::string::npos) {
+			return;
+		}
+		conversation = message.substr(0, pos);
+	}
+	else if (message[0] == '@') {
+		std::vector<std::string> participants{ loggedUser_ };
+		while (pos < message.length() && message[pos] == '@') {
+			size_t end = message.find(' ', pos);
+			if (end == std::string::npos) {
+				return;
+			}
+			participants.push_back(message.substr(pos + 1, end - pos - 1));
+			pos = message.find_first_not_of(' ', end);
+		}
+		std::sort(participants.begin(), participants.end());
+		participants.erase(std::unique(participants.begin(), participants.end()), participants.end());
+		conversation = "@";
+		for (size_t i = 0; i < participants.size(); ++i) {
+			conversation += (i == 0 ? "" : ",") + participants[i];
+		}
+	}
+	if (pos == std::string::npos || pos >= message.length()) {
+		return;
+	}
+	localHistory_->append(conversation, loggedUser_, message.substr(message[0] == '#' ? pos + 1 : pos), 0);
+}
+
+void ChatClient::printLocalEntries(const std::vector<LocalHistory::Entry> &entries) const {
+	for (const auto &entry: entries) {
+		std::time_t time = entry.time;
+		std::cout << '[' << entry.position << "] " << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S") << ' ';
+		if (entry.conversation != "*") {
+			std::cout << entry.conversation << ' ';
+		}
+		std::cout << entry.sender << ": " << entry.text << std::endl;
+	}
+}
+
+void ChatClient::showLocalHistory() {
+	if (loggedUser_.empty() || !localHistory_) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	std::string conversation{ "*" }, peer;
+	size_t before{ 0 };
+	auto tokens = Chat::split(std::string{ message_ }, " ");
+	for (size_t i = 1; i < tokens.size(); ++i) {
+		if (tokens[i].empty()) {
+			continue;
+		}
+		if (tokens[i][0] == '#' && tokens[i].length() > 1) {
+			conversation = peer = tokens[i];
+		}
+		else if (tokens[i][0] == '@' && tokens[i].length() > 1) {
+			peer = tokens[i];
+			conversation = getConversationKey(peer);
+		}
+		else if (std::all_of(tokens[i].begin(), tokens[i].end(), ::isdigit)) {
+			before = std::stoul(tokens[i]);
+		}
+		else {
+			throw std::invalid_argument("Usage: /recent [@login|#channel] [n]");
+		}
+	}
+
+	auto entries = localHistory_->getPage(conversation, before, HISTORY_PAGE_LENGTH);
+	if (entries.empty()) {
+		std::cout << "No more messages stored on this computer, type /history to load them from server" << std::endl;
+		return;
+	}
+	printLocalEntries(entries);
+	if (entries.front().position > 1) {
+		std::cout << "Type /recent " << (peer.empty() ? std::string{} : peer + " ") << entries.front().position << " to view older messages" << std::endl;
+	}
+}
+
+void ChatClient::searchLocalHistory() {
+	if (loggedUser_.empty() || !localHistory_) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	std::string query{ std::string{ message_ }.substr(5) };
+	if (query.find_first_not_of(' ') == std::string::npos) {
+		throw std::invalid_argument("Usage: /find <words>");
+	}
+	auto entries = localHistory_->search(query, SEARCH_RESULTS_LIMIT);
+	std::reverse(entries.begin(), entries.end());
+	printLocalEntries(entries);
+	std::cout << "Found " << entries.size() << " message(s)" << std::endl;
+}
+
+void ChatClient::searchMessages() {
+	if (loggedUser_.empty()) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	std::string query{ std::string{ message_ }.substr(7) };
+	if (query.find_first_not_of(' ') == std::string::npos) {
+		throw std::invalid_argument("Usage: /search <words>");
+	}
+
+	std::string cmd{ "/search:" + query.substr(query.find_first_not_of(' ')) };
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strncpy(message_, cmd.c_str(), MESSAGE_LENGTH - 1);
+	sendRequest();
+	// found messages are printed by the poller, the summary comes as a response
+	waitForResponse();
+	// 0: /response, 1: search, 2: count
+	auto tokens = Chat::split(std::string{ message_ }, ":");
+	if (tokens.size() < 3 || tokens[1] != "search") {
+		std::cout << "Can not search messages" << std::endl;
+		return;
+	}
+	std::cout << "Found " << tokens[2] << " message(s)" << std::endl;
+}
+
+void ChatClient::manageChannel() {
+	if (loggedUser_.empty()) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	// 0: /join or /leave, 1: #channel
+	auto tokens = Chat::split(std::string{ message_ }, " ");
+	if (tokens.size() != 2 || tokens[1].length() < 2 || tokens[1][0] != '#') {
+		throw std::invalid_argument("Usage: " + tokens[0] + " #channel");
+	}
+	auto channel = tokens[1].substr(1);
+	if (!isValidLogin(channel)) {
+		throw std::invalid_argument("Channel name contains invalid characters.");
+	}
+
+	std::string cmd{ tokens[0] + ":" + channel };
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, cmd.c_str());
+	sendRequest();
+	waitForResponse();
+	if (strcmp(message_, "/response:success") != 0) {
+		std::cout << "Operation with channel #" << channel << " failed" << std::endl;
+		return;
+	}
+	std::cout << (cmd[1] == 'j' ? "Joined" : "Left") << " channel #" << channel << std::endl;
+}
+
+void ChatClient::listChannels() {
+	if (loggedUser_.empty()) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strcpy(message_, "/channels");
+	sendRequest();
+	waitForResponse();
+	// 0: /response, 1: channels, 2: comma separated names
+	auto tokens = Chat::split(std::string{ message_ }, ":");
+	if (tokens.size() < 2 || tokens[1] != "channels") {
+		std::cout << "Can not load channel list" << std::endl;
+		return;
+	}
+	if (tokens.size() < 3 || tokens[2].empty()) {
+		std::cout << "You are not a member of any channel" << std::endl;
+		return;
+	}
+	for (const auto &channel: Chat::split(tokens[2], ",")) {
+		std::cout << '#' << channel << std::endl;
+	}
+}
+
+void ChatClient::negotiateCompression() {
+	auto requested = config_.get("Compression", "deflate-dict");
+	strcpy(message_, ("/compress:" + requested).c_str());
+	sendRequest();
+	receiveResponse();
+	// 0: /response, 1: compress, 2: mode chosen by server
+	auto tokens = Chat::split(std::string{ message_ }, ":");
+	if (tokens.size() >= 3 && tokens[1] == "compress") {
+		connection_.setCompression(ChatConnection::compressionFromString(tokens[2]));
+	}
+}
+
+void ChatClient::sendFile() {
+	if (loggedUser_.empty()) {
+		std::cout << "You are not logged in\n" << std::endl;
+		return;
+	}
+	std::string receiver, path;
+	std::string args{ std::string{ message_ }.substr(5) };
+	args.erase(0, args.find_first_not_of(' '));
+	if (!args.empty() && args[0] == '@') {
+		auto pos = args.find(' ');
+		receiver = args.substr(1, pos == std::string::npos ? std::string::npos : pos - 1);
+		args = pos == std::string::npos ? std::string{} : args.substr(pos + 1);
+		args.erase(0, args.find_first_not_of(' '));
+	}
+	path = args;
+	if (path.empty()) {
+		throw std::invalid_argument("Usage: /file [@login] <path>");
+	}
+	if (!isValidLogin(receiver)) {
+		throw std::invalid_argument("Login contains invalid characters.");
+	}
+	if (!fs::is_regular_file(path)) {
+		throw std::invalid_argument("File " + path + " does not exist");
+	}
+
+	std::ifstream file{ path, std::ios::in | std::ios::binary };
+	if (!file.is_open()) {
+		throw std::invalid_argument("Can not open file " + path);
+	}
+	auto size = fs::file_size(path);
+
+	// server is offered the hash first and may already have the content
+	SHA256 sha;
+	std::string buf(TRANSFER_CHUNK_LENGTH, '\0');
+	while (file.read(buf.data(), buf.length()) || file.gcount() > 0) {
+		sha.update(reinterpret_cast<const uint8_t *>(buf.data()), file.gcount());
+	}
+	uint8_t *digest = sha.digest();
+	std::string hash{ SHA256::toString(digest) };
+	delete[] digest;
+	file.clear();
+	file.seekg(0);
+
+	std::string token{ createTransferToken() };
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strncpy(message_, ("/transfer:offer:" + token + ":FILE:" + receiver + ":" + std::to_string(size) + ":" +
+		hash + ":" + fs::path(path).filename().string()).c_str(), MESSAGE_LENGTH - 1);
+	sendRequest();
+	waitForResponse();
+	if (strncmp(message_, "/response:transfer:have", 23) == 0) {
+		std::cout << "File " << std::quoted(path) << " (" << size << " bytes) has been sent, server already had its content" << std::endl;
+		return;
+	}
+	if (strncmp(message_, "/response:transfer:upload", 25) != 0) {
+		std::cout << "Server has rejected file " << std::quoted(path) << std::endl;
+		return;
+	}
+	streamChunks(token, file, size);
+	std::cout << "File " << std::quoted(path) << " (" << size << " bytes) has been sent" << std::endl;
+}
+
+void ChatClient::sendLongMessage(const std::string &message) {
+	std::string receiver;
+	size_t start = 0;
+	if (message[0] == '@') {
+		auto pos = message.find(' ');
+		if (pos != std::string::npos) {
+			receiver = message.substr(1, pos - 1);
+			start = pos + 1;
+		}
+	}
+	std::istringstream in{ message.substr(start) };
+	streamTransfer("TEXT", receiver, "message", in, message.length() - start);
+}
+
+void ChatClient::streamTransfer(
+	const std::string &kind,
+	const std::string &receiver,
+	const std::string &name,
+	std::istream &in,
+	const unsigned long long size
+	) {
+	std::string token{ createTransferToken() };
+	if (sendFrame("/transfer:begin:" + token + ":" + kind + ":" + receiver + ":" + std::to_string(size) + ":" + name) == -1) {
+		throw std::runtime_error{ std::string{ "Error while writing to socket: " } + strerror(errno) };
+	}
+	streamChunks(token, in, size);
+}
+
+std::string ChatClient::createTransferToken() {
+	// token identifies the transfer inside this connection only
+	return std::to_string(getpid()) + "-" + std::to_string(++transferCounter_);
+}
+
+void ChatClient::streamChunks(const std::string &token, std::istream &in, const unsigned long long size) {
+	// every chunk is a separate frame, so server can handle other requests between them
+	std::string prefix{ "/transfer:chunk:" + token + ":" };
+	std::string chunk;
+	unsigned long long sent = 0;
+	while (sent < size) {
+		chunk = prefix;
+		chunk.resize(prefix.length() + TRANSFER_CHUNK_LENGTH);
+		in.read(chunk.data() + prefix.length(), TRANSFER_CHUNK_LENGTH);
+		auto bytes = in.gcount();
+		if (bytes <= 0) {
+			break;
+		}
+		chunk.resize(prefix.length() + bytes);
+		if (sendFrame(chunk) == -1) {
+			throw std::runtime_error{ std::string{ "Error while writing to socket: " } + strerror(errno) };
+		}
+		sent += bytes;
+	}
+	sendFrame("/transfer:end:" + token);
+}
+
+void ChatClient::receiveTransferFrame() {
+	auto headerEnd = response_.find('\n', response_.find('\n') + 1);
+	if (headerEnd == std::string::npos) {
+		return;
+	}
+	auto tokens = Chat::split(response_.substr(0, headerEnd), "\n");
+	unsigned long long id = std::stoull(tokens.at(1));
+
+	if (tokens[0] == "TRANSFER") {
+		// 1: id, 2: kind, 3: sender, 4: name, 5: size, 6: conversation, 7: seq:previous seq:id
+		tokens = Chat::split(response_, "\n");
+		if (tokens.size() < 6) {
+			return;
+		}
+		if (tokens.size() >= 8) {
+			// restarted transfer is received again even if its sequence number is known
+			acceptSequence(tokens[6], tokens[7]);
+		}
+		auto &download = downloads_[id];
+		download.kind = tokens[2];
+		download.sender = tokens[3];
+		download.name = tokens[4];
+		download.size = std::stoull(tokens[5]);
+		download.received = 0;
+		if (download.kind == "FILE") {
+			fs::path path{ config_.get("DownloadDir", ".") };
+			path /= download.name;
+			if (fs::exists(path)) {
+				path.replace_filename(std::to_string(id) + "_" + download.name);
+			}
+			download.name = path.string();
+			download.file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+			clearPrompt();
+			std::cout << download.sender << " is sending file " << std::quoted(download.name)
+				<< " (" << download.size << " bytes)" << std::endl;
+			printPrompt();
+		}
+		if (download.size != 0) {
+			return; // content comes in chunks
+		}
+	}
+	else if (tokens[0] == "TRANSFER_ABORT") {
+		auto it = downloads_.find(id);
+		if (it != downloads_.end()) {
+			clearPrompt();
+			std::cout << "Transfer from " << it->second.sender << " has been aborted" << std::endl;
+			printPrompt();
+			if (it->second.kind == "FILE") {
+				it->second.file.close();
+				fs::remove(it->second.name);
+			}
+			downloads_.erase(it);
+		}
+		return;
+	}
+
+	auto it = downloads_.find(id);
+	if (it == downloads_.end()) {
+		return;
+	}
+	auto &download = it->second;
+	if (tokens[0] == "CHUNK") {
+		const char *data = response_.data() + headerEnd + 1;
+		size_t length = response_.length() - headerEnd - 1;
+		if (download.kind == "FILE") {
+			download.file.write(data, length);
+		}
+		else {
+			download.text.append(data, length);
+		}
+		download.received += length;
+	}
+	if (download.received < download.size) {
+		return;
+	}
+
+	clearPrompt();
+	if (download.kind == "FILE") {
+		download.file.close();
+		std::cout << "File from " << download.sender << " has been saved to " << std::quoted(download.name) << std::endl;
+	}
+	else {
+		std::string line{ download.sender + ": " + download.text };
+		std::cout << line << std::endl;
+		*logger_ << line;
+	}
+	printPrompt();
+	downloads_.erase(it);
+}
+
 ssize_t ChatClient::sendRequest() const {
 	if (*message_ == '\0') {
 		// invalid argument passed
 		throw std::invalid_argument("Message cannot be empty");
 	}
-	ssize_t bytes = write(sockFd_, message_, MESSAGE_LENGTH);
+	ssize_t bytes = sendFrame(message_);
+	if (bytes == -1 && getpid() == mainPid_) {
+		connectionLost_ = 1;
+		throw std::invalid_argument("Connection with server was lost");
+	}
 
 	return bytes;
 }
 
+ssize_t ChatClient::sendFrame(const std::string &frame) const {
+	// main process and poller write to the same socket, frames must not interleave
+	if (sendLockPid_ != getpid()) {
+		// flock() does not separate processes sharing one open file
+		if (sendLockFd_ != -1) {
+			close(sendLockFd_);
+		}
+		sendLockFd_ = open(SEND_LOCK.c_str(), O_RDWR | O_CREAT, 0600);
+		sendLockPid_ = getpid();
+	}
+	if (sendLockFd_ != -1) {
+		flock(sendLockFd_, LOCK_EX);
+	}
+	auto bytes = connection_.send(frame);
+	if (sendLockFd_ != -1) {
+		flock(sendLockFd_, LOCK_UN);
+	}
+	return bytes;
+}
+
+void ChatClient::acknowledge(const std::string &position) {
+	// seq:previous seq:message id
+	auto numbers = Chat::split(position, ":");
+	if (numbers.size() != 3) {
+		return;
+	}
+	if (pendingAcks_.empty()) {
+		firstPendingAck_ = std::chrono::steady_clock::now();
+	}
+	pendingAcks_.push_back(numbers[2]);
+}
+
+void ChatClient::sendAcknowledgements() {
+	// acks are coalesced: one frame for many messages
+	std::string frame;
+	for (const auto &id: pendingAcks_) {
+		if (!frame.empty() && frame.length() + id.length() + 1 >= MESSAGE_LENGTH) {
+			sendFrame(frame);
+			frame.clear();
+		}
+		frame += frame.empty() ? "/ack:" : ",";
+		frame += id;
+	}
+	if (!frame.empty()) {
+		sendFrame(frame);
+	}
+	pendingAcks_.clear();
+}
+
+bool ChatClient::waitForFrame() {
+	// pending acks are sent when they are due or when the batch is full,
+	// server is pinged when it is silent; false if it has not answered several pings
+	while (!connection_.hasPending()) {
+		auto now = std::chrono::steady_clock::now();
+		if (!pendingAcks_.empty() && (pendingAcks_.size() >= ACK_BATCH_SIZE || now - firstPendingAck_ >= ACK_INTERVAL)) {
+			sendAcknowledgements();
+		}
+		auto deadline = now + std::chrono::hours{ 24 };
+		if (heartbeatInterval_.count() > 0) {
+			if (now - lastHeard_ >= heartbeatInterval_ * (pingsSent_ + 1)) {
+				if (pingsSent_ >= heartbeatMisses_) {
+					return false;
+				}
+				sendFrame("/ping");
+				++pingsSent_;
+			}
+			deadline = lastHeard_ + heartbeatInterval_ * (pingsSent_ + 1);
+		}
+		if (!pendingAcks_.empty()) {
+			deadline = std::min(deadline, firstPendingAck_ + std::chrono::duration_cast<std::chrono::steady_clock::duration>(ACK_INTERVAL));
+		}
+		auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now);
+		if (left.count() < 0) {
+			left = std::chrono::microseconds{ 0 };
+		}
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(sockFd_, &rfds);
+		struct timeval tv;
+		tv.tv_sec = left.count() / 1000000;
+		tv.tv_usec = left.count() % 1000000;
+		if (select(sockFd_ + 1, &rfds, nullptr, nullptr, &tv) > 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
 ssize_t ChatClient::receiveResponse() const {
-	ssize_t bytes = read(sockFd_, message_, MESSAGE_LENGTH);
-	if (bytes == -1) {
-		throw std::runtime_error{
-			std::string{ "Error while reading from socket: " } + 
-			std::string{ strerror(errno) } 
-		};
-	}
-	if (bytes == 0 || strncmp(message_, "/response:kick", 14) == 0) {
+	ssize_t bytes = connection_.receive(response_);
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	strncpy(message_, response_.c_str(), MESSAGE_LENGTH - 1);
+	if (strncmp(message_, "/response:kick", 14) == 0) {
 		clearPrompt();
-		std::cout << "\nError: connection with server was lost\n" << std::endl;
+		std::cout << "\nError: you have been disconnected by server\n" << std::endl;
 		if (getpid() == mainPid_) {
 			cleanExit();
 		}
@@ -323,6 +1224,23 @@ ssize_t ChatClient::receiveResponse() const {
 			kill(mainPid_, SIGTERM);
 		}
 	}
+	if (bytes <= 0) {
+		clearPrompt();
+		std::cout << "\nError: connection with server was lost";
+		if (bytes == -1) {
+			std::cout << " (" << strerror(errno) << ")";
+		}
+		std::cout << '\n' << std::endl;
+		if (getpid() == mainPid_) {
+			// reconnection is done by work() loop
+			connectionLost_ = 1;
+			throw std::invalid_argument("Connection with server was lost");
+		}
+		// poller leaves its state for the next poller and asks main process to reconnect
+		saveSequences();
+		kill(mainPid_, SIGUSR1);
+		exit(EXIT_SUCCESS);
+	}
 	return bytes;
 }
 
@@ -334,8 +1252,28 @@ void ChatClient::printPrompt() const {
 void ChatClient::work() {
 	while (true) {
 		try {
+			if (connectionLost_) {
+				reconnect();
+			}
 			printPrompt();
-			std::cin.getline(message_, MESSAGE_LENGTH);
+			std::string line;
+			if (!std::getline(std::cin, line)) {
+				if (connectionLost_) {
+					// reading was interrupted by the poller
+					std::cin.clear();
+					clearerr(stdin);
+					continue;
+				}
+				break;
+			}
+			if (line.length() + SEND_HEADER_LENGTH >= MESSAGE_LENGTH && !loggedUser_.empty() && line[0] != '/') {
+				// does not fit into one message, streamed in chunks
+				*logger_ << line;
+				sendLongMessage(line);
+				continue;
+			}
+			std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+			strncpy(message_, line.c_str(), MESSAGE_LENGTH - 1);
 			
 			// working out the program algor5ithm
 
@@ -361,9 +1299,42 @@ void ChatClient::work() {
 					removeUser();
 				}
 			}
+			else if (strncmp(message_, "/history", 8) == 0) {
+				// page of message history
+				requestHistory();
+			}
+			else if (strncmp(message_, "/search", 7) == 0) {
+				// full-text search
+				searchMessages();
+			}
+			else if (strncmp(message_, "/join", 5) == 0 || strncmp(message_, "/leave", 6) == 0) {
+				// channel membership
+				manageChannel();
+			}
+			else if (strncmp(message_, "/channels", 9) == 0) {
+				// channel list
+				listChannels();
+			}
+			else if (strncmp(message_, "/file", 5) == 0) {
+				// file attachment
+				sendFile();
+			}
+			else if (strncmp(message_, "/unread", 7) == 0) {
+				// unread backlog page by page
+				requestUnread();
+			}
+			else if (strncmp(message_, "/recent", 7) == 0) {
+				// scroll-back without server
+				showLocalHistory();
+			}
+			else if (strncmp(message_, "/find", 5) == 0) {
+				// search without server
+				searchLocalHistory();
+			}
 			else if (!loggedUser_.empty() && *message_ != '/') {
-				*logger_ << std::string{ message_ };
-				sendRequest();
+				*logger_ << line;
+				storeOwnMessage(line);
+				sendMessage(line);
 			}
 			else if (
 				strncmp(message_, "/exit", 5) == 0 ||
@@ -401,6 +1372,10 @@ void ChatClient::sigIntHandler(int signum) const {
 	cleanExit();
 }
 
+void ChatClient::connectionLostHandler(int signum) {
+	connectionLost_ = 1;
+}
+
 void ChatClient::sigTermHandler(int signum) const {
 	if (mainPid_ != getpid()) {
 		exit(EXIT_SUCCESS);
@@ -2,15 +2,22 @@
 
 #include "config_file.h"
 #include "logger.h"
+#include "chat_connection.h"
+#include "local_history.h"
+#include "SHA256.h"
 
 #include <cstdlib>
 #include <cstring>
+#include <csignal>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
+#include <chrono>
 #include <memory>
 #include <algorithm>
+#include <fstream>
 
 #if defined(_WIN64) or defined(_WIN32)
 #include <Windows.h>
@@ -33,16 +40,51 @@ public:
 	void work(); // main work
 	void sigIntHandler(int signum) const;
 	void sigTermHandler(int signum) const;
+	void connectionLostHandler(int signum);
 
 private:
+	bool connectToServer(); // connecting and negotiating compression
+	void reconnect(); // reconnecting with backoff after connection loss
+	bool resumeSession(); // restoring the session by token after reconnect
+	void syncMissedMessages(); // requesting messages missed while connection was lost
+	std::string createMessageId(); // client id of the message, makes retries idempotent
+	void sendMessage(const std::string &text); // sending a chat message with client id
+	void retryRecentMessages(); // sending again messages which could be lost with the connection
+	void waitForResponse() const; // waiting for response received by the poller
+	void saveSequences() const;
+	void loadSequences();
 	bool isLoginAvailable(const std::string& login) const; // login availability
 	void signUp(); // registration
 	bool isValidLogin(const std::string& login) const; // login verification
 	void signIn(); // authorization
 	void signOut(); // user logout
 	void removeUser(); // deleting a user
+	void requestHistory(); // requesting a page of message history
+	void requestUnread(); // requesting unread counters or a page of unread messages
+	std::string getConversationKey(const std::string &target) const; // @login, #channel or * to conversation key
+	std::string getConversationTarget(const std::string &key) const; // conversation key to @login, #channel or *
+	void showLocalHistory(); // scroll-back over messages stored on this computer
+	void searchLocalHistory(); // search over messages stored on this computer
+	void openLocalHistory(); // history file of logged user
+	void storeOwnMessage(const std::string &message); // adding sent message to local history
+	void printLocalEntries(const std::vector<LocalHistory::Entry> &entries) const;
+	void searchMessages(); // full-text search over message history
+	void manageChannel(); // joining or leaving a channel
+	void listChannels(); // requesting channels of the user
+	void sendFile(); // streaming a file attachment
+	void sendLongMessage(const std::string &message); // streaming a message longer than MESSAGE_LENGTH
+	void streamTransfer(const std::string &kind, const std::string &receiver, const std::string &name, std::istream &in, unsigned long long size); // chunked transfer
+	void streamChunks(const std::string &token, std::istream &in, unsigned long long size);
+	std::string createTransferToken();
+	void receiveTransferFrame(); // handling of transfer frames in poller
+	bool acceptSequence(const std::string &conversation, const std::string &position); // false for duplicates, reports gaps
 	ssize_t sendRequest() const; // sending a message
+	ssize_t sendFrame(const std::string &frame) const; // sending a frame under the lock shared with the poller
+	void acknowledge(const std::string &position); // queueing delivery acknowledgement in poller
+	void sendAcknowledgements(); // sending queued acknowledgements in one batch
+	bool waitForFrame(); // waiting for the next frame, sends acknowledgements and pings when they are due; false if server is dead
 	ssize_t receiveResponse() const; // receiving a response
+	void negotiateCompression(); // agree on frame compression with server
 	void sendPrivateMessage(const std::string &senderName, const std::string& receiverName, const std::string& messageText); // sending a private message
 	void sendBroadcastMessage(const std::string &senderName, const std::string& message); // sending a shared message
 	void printSystemInformation() const; // print information about process and OS
@@ -55,23 +97,75 @@ private:
 	void displayHelp() const;
 	
 	static const unsigned short MESSAGE_LENGTH{ 1024 };
+	static const unsigned short HISTORY_PAGE_LENGTH{ 20 };
+	static const unsigned short SEARCH_RESULTS_LIMIT{ 20 };
+	static constexpr size_t TRANSFER_CHUNK_LENGTH{ 16 * 1024 };
+	static constexpr size_t SEND_HEADER_LENGTH{ 40 }; // "/send:<message id>:"
+	static constexpr std::chrono::seconds RETRY_WINDOW{ 60 };
+	static constexpr size_t ACK_BATCH_SIZE{ 64 };
+	static constexpr std::chrono::milliseconds ACK_INTERVAL{ 200 };
 	const std::string USER_CONFIG{ "users.cfg" };
 	const std::string MESSAGES_LOG{ "messages.log" };
 	const std::string CONFIG_FILE{ "client.cfg" };
 	const std::string TEMP_DIR{ "/tmp/chat_client" };
 	const std::string RESPONSE_LOCK{ TEMP_DIR + "/response.lock" };
 	const std::string RESPONSE{ TEMP_DIR + "/response.tmp" };
+	const std::string SEQUENCES{ TEMP_DIR + "/sequences" };
+	const std::string SEND_LOCK{ TEMP_DIR + "/send.lock" };
+	const std::string DEFAULT_RECONNECT_ATTEMPTS{ "10" };
+	const std::string DEFAULT_RECONNECT_MAX_DELAY{ "30" };
+	const std::string DEFAULT_HISTORY_DIR{ "." };
+	const std::string DEFAULT_HEARTBEAT_INTERVAL{ "30" };
+	const std::string DEFAULT_HEARTBEAT_MISSES{ "3" };
 
 #if defined(_WIN64) or defined(_WIN32)
 	std::string getLiteralOSName(OSVERSIONINFOEX &osv) const; // Get literal version, i.e. 5.0 is Windows 2000
 #endif
 
 	std::string loggedUser_;
+	std::string sessionToken_;
+	mutable volatile std::sig_atomic_t connectionLost_{ 0 }; // set by SIGUSR1 from the poller
 	ConfigFile config_{ CONFIG_FILE };
 	sockaddr_in server_;
 	pid_t mainPid_;
-	pid_t pollerPid_;
+	pid_t pollerPid_{ 0 };
 	int sockFd_;
+	mutable ChatConnection connection_;
 	std::unique_ptr<Logger> logger_;
 	mutable char message_[MESSAGE_LENGTH];
+	mutable std::string response_; // last received frame, may be binary or longer than message_
+	std::unique_ptr<LocalHistory> localHistory_; // opened while user is logged in
+
+	// recently sent messages, retried after reconnect
+	struct OutgoingMessage {
+		std::string frame;
+		std::chrono::steady_clock::time_point sent;
+	};
+	std::deque<OutgoingMessage> outbox_;
+	unsigned long long messageCounter_{ 0 };
+
+	// transfers being received by poller
+	struct Download {
+		std::string kind;
+		std::string sender;
+		std::string name;
+		unsigned long long size;
+		unsigned long long received;
+		std::ofstream file;
+		std::string text;
+	};
+	std::map<unsigned long long, Download> downloads_;
+	unsigned transferCounter_{ 0 };
+	// sequence number of the last message received by poller in every conversation
+	std::map<std::string, unsigned long long> lastSequence_;
+	// ids of received messages not acknowledged yet
+	std::vector<std::string> pendingAcks_;
+	std::chrono::steady_clock::time_point firstPendingAck_;
+	// heartbeat of the poller
+	std::chrono::steady_clock::time_point lastHeard_;
+	std::chrono::seconds heartbeatInterval_{ 0 };
+	unsigned heartbeatMisses_{ 3 };
+	unsigned pingsSent_{ 0 };
+	mutable int sendLockFd_{ -1 };
+	mutable pid_t sendLockPid_{ 0 };
 };
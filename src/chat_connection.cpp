@@ -0,0 +1,538 @@
+#include "chat_connection.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__linux__)
+extern "C" {
+	#include <unistd.h>
+	#include <arpa/inet.h>
+	#include <sys/sendfile.h>
+	#include <sys/socket.h>
+	#include <sys/uio.h>
+	#include <fcntl.h>
+}
+#endif
+
+namespace {
+	// Words which appear in almost every frame. Deflate can reference them
+	// even in the first bytes of a short message
+	const std::string SHARED_DICTIONARY{
+		"/response:success/response:fail/response:history:/response:search:"
+		"/checklogin:/signup:/signin:/history:/search:"
+		"the you and that have for not with this but are what all was "
+		"HISTORY\nBROADCAST\nPRIVATE\n"
+	};
+
+	void putUint32(std::string &dst, uint32_t value) {
+		value = htonl(value);
+		dst.append(reinterpret_cast<const char *>(&value), sizeof(value));
+	}
+
+	uint32_t getUint32(const char *src) {
+		uint32_t value;
+		memcpy(&value, src, sizeof(value));
+		return ntohl(value);
+	}
+}
+
+ChatConnection::ChatConnection(const int fd) : fd_{ fd } {}
+
+ChatConnection::~ChatConnection() {
+	if (deflater_) {
+		deflateEnd(deflater_.get());
+	}
+	if (inflater_) {
+		inflateEnd(inflater_.get());
+	}
+}
+
+void ChatConnection::swap(ChatConnection &other) noexcept {
+	std::swap(fd_, other.fd_);
+	std::swap(compression_, other.compression_);
+	std::swap(statistics_, other.statistics_);
+	pending_.swap(other.pending_);
+	std::swap(uring_, other.uring_);
+	input_.swap(other.input_);
+	std::swap(inputPosition_, other.inputPosition_);
+	output_.swap(other.output_);
+	std::swap(outputBytes_, other.outputBytes_);
+	std::swap(maxOutputBytes_, other.maxOutputBytes_);
+	std::swap(maxOutputFrames_, other.maxOutputFrames_);
+	// z_stream is on the heap and keeps its address, only the pointers change hands
+	deflater_.swap(other.deflater_);
+	inflater_.swap(other.inflater_);
+}
+
+void ChatConnection::setFd(const int fd) {
+	fd_ = fd;
+	pending_.clear();
+	input_.clear();
+	inputPosition_ = 0;
+	output_.clear();
+	outputBytes_ = 0;
+}
+
+void ChatConnection::setUring(UringIo *uring) {
+	uring_ = uring;
+}
+
+int ChatConnection::getFd() const {
+	return fd_;
+}
+
+void ChatConnection::setCompression(const Compression compression) {
+	compression_ = compression;
+}
+
+ChatConnection::Compression ChatConnection::getCompression() const {
+	return compression_;
+}
+
+const ChatConnection::Statistics &ChatConnection::getStatistics() const {
+	return statistics_;
+}
+
+std::string ChatConnection::compressionToString(const Compression compression) {
+	switch (compression) {
+	case Compression::DEFLATE:
+		return "deflate";
+	case Compression::DEFLATE_DICTIONARY:
+		return "deflate-dict";
+	default:
+		return "none";
+	}
+}
+
+ChatConnection::Compression ChatConnection::compressionFromString(const std::string &name) {
+	if (name == "deflate") {
+		return Compression::DEFLATE;
+	}
+	if (name == "deflate-dict") {
+		return Compression::DEFLATE_DICTIONARY;
+	}
+	return Compression::NONE;
+}
+
+bool ChatConnection::hasPending() const {
+	return !pending_.empty() || inputPosition_ < input_.length();
+}
+
+bool ChatConnection::writeExactly(const char *buf, size_t length) {
+	if (uring_ != nullptr) {
+		return uring_->send(fd_, { { buf, length } });
+	}
+	while (length > 0) {
+		auto bytes = write(fd_, buf, length);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			return false;
+		}
+		buf += bytes;
+		length -= bytes;
+	}
+	return true;
+}
+
+bool ChatConnection::readExactly(char *buf, size_t length) {
+	if (uring_ != nullptr) {
+		// one receive usually brings several frames, the next ones are taken from the buffer
+		while (input_.length() - inputPosition_ < length) {
+			if (inputPosition_ > 0) {
+				input_.erase(0, inputPosition_);
+				inputPosition_ = 0;
+			}
+			if (uring_->recv(fd_, input_) <= 0) {
+				return false;
+			}
+		}
+		memcpy(buf, input_.data() + inputPosition_, length);
+		inputPosition_ += length;
+		if (inputPosition_ == input_.length()) {
+			input_.clear();
+			inputPosition_ = 0;
+		}
+		return true;
+	}
+	while (length > 0) {
+		auto bytes = read(fd_, buf, length);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			return false;
+		}
+		buf += bytes;
+		length -= bytes;
+	}
+	return true;
+}
+
+bool ChatConnection::compress(const std::string &src, std::string &dst, const bool useDictionary) {
+	if (!deflater_) {
+		deflater_ = std::make_unique<z_stream>();
+		if (deflateInit2(deflater_.get(), Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			deflater_.reset();
+			return false;
+		}
+	}
+	else {
+		deflateReset(deflater_.get());
+	}
+	if (useDictionary) {
+		deflateSetDictionary(deflater_.get(),
+			reinterpret_cast<const Bytef *>(SHARED_DICTIONARY.data()), SHARED_DICTIONARY.length());
+	}
+
+	dst.clear();
+	putUint32(dst, src.length());
+	auto header = dst.length();
+	dst.resize(header + deflateBound(deflater_.get(), src.length()));
+	deflater_->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src.data()));
+	deflater_->avail_in = src.length();
+	deflater_->next_out = reinterpret_cast<Bytef *>(dst.data() + header);
+	deflater_->avail_out = dst.length() - header;
+	if (deflate(deflater_.get(), Z_FINISH) != Z_STREAM_END) {
+		return false;
+	}
+	dst.resize(dst.length() - deflater_->avail_out);
+	return true;
+}
+
+bool ChatConnection::decompress(const std::string &src, std::string &dst, const bool useDictionary) {
+	if (src.length() < sizeof(uint32_t)) {
+		return false;
+	}
+	auto length = getUint32(src.data());
+	if (length > MAX_FRAME_LENGTH) {
+		return false;
+	}
+	if (!inflater_) {
+		inflater_ = std::make_unique<z_stream>();
+		if (inflateInit2(inflater_.get(), -MAX_WBITS) != Z_OK) {
+			inflater_.reset();
+			return false;
+		}
+	}
+	else {
+		inflateReset(inflater_.get());
+	}
+	if (useDictionary) {
+		inflateSetDictionary(inflater_.get(),
+			reinterpret_cast<const Bytef *>(SHARED_DICTIONARY.data()), SHARED_DICTIONARY.length());
+	}
+
+	dst.resize(length);
+	inflater_->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src.data() + sizeof(uint32_t)));
+	inflater_->avail_in = src.length() - sizeof(uint32_t);
+	inflater_->next_out = reinterpret_cast<Bytef *>(dst.data());
+	inflater_->avail_out = length;
+	auto status = inflate(inflater_.get(), Z_FINISH);
+	return status == Z_STREAM_END && inflater_->avail_out == 0;
+}
+
+ssize_t ChatConnection::sendFrame(const std::string &payload, uint8_t flags, const std::vector<uint64_t> &tags) {
+	std::string frame;
+	std::string compressed;
+	bool useDictionary = compression_ == Compression::DEFLATE_DICTIONARY;
+	++statistics_.framesSent;
+	statistics_.bytesBeforeCompression += payload.length();
+	// small frames are not worth compressing
+	if (compression_ != Compression::NONE &&
+		payload.length() >= COMPRESSION_THRESHOLD &&
+		compress(payload, compressed, useDictionary) &&
+		compressed.length() < payload.length()) {
+		flags |= FLAG_COMPRESSED;
+		if (useDictionary) {
+			flags |= FLAG_DICTIONARY;
+		}
+		++statistics_.framesCompressed;
+	}
+	const std::string &body = (flags & FLAG_COMPRESSED) ? compressed : payload;
+	statistics_.bytesAfterCompression += body.length();
+
+	putUint32(frame, body.length());
+	frame += static_cast<char>(flags);
+	if (maxOutputBytes_ > 0) {
+		frame += body;
+		return queueFrame(std::move(frame), tags);
+	}
+	if (uring_ != nullptr) {
+		// the body is not copied after the header, both go in one submission
+		if (!uring_->send(fd_, { { frame.data(), frame.length() }, { body.data(), body.length() } })) {
+			return -1;
+		}
+		return HEADER_LENGTH + body.length();
+	}
+	frame.reserve(HEADER_LENGTH + body.length());
+	frame += body;
+	if (!writeExactly(frame.data(), frame.length())) {
+		return -1;
+	}
+	return frame.length();
+}
+
+ssize_t ChatConnection::send(const std::string &message) {
+	return sendFrame(message, 0);
+}
+
+ssize_t ChatConnection::sendBatch(const std::vector<std::string> &messages, const std::vector<uint64_t> &tags) {
+	if (messages.empty()) {
+		return 0;
+	}
+	if (messages.size() == 1) {
+		return sendFrame(messages.front(), 0, tags);
+	}
+	std::string payload;
+	for (const auto &message: messages) {
+		putUint32(payload, message.length());
+		payload += message;
+	}
+	return sendFrame(payload, FLAG_BATCH, tags);
+}
+
+ssize_t ChatConnection::sendFileRange(const std::string &header, const int fileFd, off_t offset, size_t length) {
+	std::string frame;
+	putUint32(frame, header.length() + length);
+	frame += static_cast<char>(0);
+	frame += header;
+	if (maxOutputBytes_ > 0) {
+		return sendFileRangeQueued(std::move(frame), fileFd, offset, length);
+	}
+	if (!writeExactly(frame.data(), frame.length())) {
+		return -1;
+	}
+	auto total = frame.length() + length;
+	while (length > 0) {
+		auto bytes = sendfile(fd_, fileFd, &offset, length);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			// frame is broken, the connection can not be used any more
+			return -1;
+		}
+		length -= bytes;
+	}
+	++statistics_.framesSent;
+	statistics_.bytesBeforeCompression += total - HEADER_LENGTH;
+	statistics_.bytesAfterCompression += total - HEADER_LENGTH;
+	return total;
+}
+
+ssize_t ChatConnection::receive(std::string &message) {
+	if (!pending_.empty()) {
+		message = std::move(pending_.front());
+		pending_.pop_front();
+		return 1;
+	}
+
+	char header[HEADER_LENGTH];
+	errno = 0;
+	if (!readExactly(header, HEADER_LENGTH)) {
+		return errno == 0 ? 0 : -1;
+	}
+	auto length = getUint32(header);
+	uint8_t flags = header[4];
+	if (length > MAX_FRAME_LENGTH) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	std::string payload(length, '\0');
+	errno = 0;
+	if (!readExactly(payload.data(), length)) {
+		return errno == 0 ? 0 : -1;
+	}
+	statistics_.bytesReceivedOnWire += HEADER_LENGTH + length;
+
+	if (flags & FLAG_COMPRESSED) {
+		std::string decompressed;
+		if (!decompress(payload, decompressed, flags & FLAG_DICTIONARY)) {
+			errno = EBADMSG;
+			return -1;
+		}
+		payload = std::move(decompressed);
+	}
+	statistics_.bytesReceived += payload.length();
+
+	if (!(flags & FLAG_BATCH)) {
+		message = std::move(payload);
+		return 1;
+	}
+	size_t pos = 0;
+	while (pos + sizeof(uint32_t) <= payload.length()) {
+		auto itemLength = getUint32(payload.data() + pos);
+		pos += sizeof(uint32_t);
+		if (pos + itemLength > payload.length()) {
+			break;
+		}
+		pending_.emplace_back(payload, pos, itemLength);
+		pos += itemLength;
+	}
+	if (pending_.empty()) {
+		errno = EBADMSG;
+		return -1;
+	}
+	message = std::move(pending_.front());
+	pending_.pop_front();
+	return 1;
+}
+
+void ChatConnection::setOutputLimits(const size_t bytes, const size_t frames) {
+	maxOutputBytes_ = bytes;
+	maxOutputFrames_ = frames;
+}
+
+bool ChatConnection::hasOutput() const {
+	return !output_.empty();
+}
+
+size_t ChatConnection::getOutputBytes() const {
+	return outputBytes_;
+}
+
+size_t ChatConnection::getOutputFrames() const {
+	return output_.size();
+}
+
+bool ChatConnection::isOutputOverLimit() const {
+	return outputBytes_ > maxOutputBytes_ || (maxOutputFrames_ > 0 && output_.size() > maxOutputFrames_);
+}
+
+ssize_t ChatConnection::queueFrame(std::string frame, const std::vector<uint64_t> &tags) {
+	auto length = frame.length();
+	bool queued = !output_.empty();
+	outputBytes_ += length;
+	output_.push_back({ std::move(frame), 0, tags });
+	// frames behind others wait for the socket to become writable
+	if (!queued && flush() == -1) {
+		return -1;
+	}
+	if (!output_.empty()) {
+		++statistics_.framesQueued;
+		statistics_.peakOutputBytes = std::max<uint64_t>(statistics_.peakOutputBytes, outputBytes_);
+	}
+	return length;
+}
+
+ssize_t ChatConnection::flush() {
+	ssize_t total = 0;
+	while (!output_.empty()) {
+		// the queue goes to the kernel with one call, as much of it as the socket takes
+		iovec iov[64];
+		size_t count = 0;
+		for (auto it = output_.begin(); it != output_.end() && count < std::size(iov); ++it, ++count) {
+			iov[count].iov_base = it->data.data() + it->offset;
+			iov[count].iov_len = it->data.length() - it->offset;
+		}
+		msghdr msg{};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		auto bytes = sendmsg(fd_, &msg, MSG_DONTWAIT);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (bytes == -1) {
+			return -1;
+		}
+		total += bytes;
+		outputBytes_ -= bytes;
+		while (bytes > 0) {
+			auto &front = output_.front();
+			auto left = front.data.length() - front.offset;
+			if (static_cast<size_t>(bytes) < left) {
+				front.offset += bytes;
+				break;
+			}
+			bytes -= left;
+			output_.pop_front();
+		}
+	}
+	return total;
+}
+
+std::vector<uint64_t> ChatConnection::dropOutput(const bool untilUnderLimit) {
+	std::vector<uint64_t> dropped;
+	for (auto it = output_.begin(); it != output_.end(); ) {
+		if (untilUnderLimit && !isOutputOverLimit()) {
+			break;
+		}
+		// a frame written in part must be completed, or the stream breaks
+		if (it->tags.empty() || it->offset > 0) {
+			++it;
+			continue;
+		}
+		dropped.insert(dropped.end(), it->tags.begin(), it->tags.end());
+		outputBytes_ -= it->data.length();
+		++statistics_.framesDropped;
+		it = output_.erase(it);
+	}
+	return dropped;
+}
+
+ssize_t ChatConnection::sendFileRangeQueued(std::string frame, const int fileFd, off_t offset, size_t length) {
+	auto total = frame.length() + length;
+	++statistics_.framesSent;
+	statistics_.bytesBeforeCompression += total - HEADER_LENGTH;
+	statistics_.bytesAfterCompression += total - HEADER_LENGTH;
+	if (output_.empty()) {
+		auto bytes = ::send(fd_, frame.data(), frame.length(), MSG_DONTWAIT);
+		if (bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			return -1;
+		}
+		frame.erase(0, std::max<ssize_t>(bytes, 0));
+		if (frame.empty()) {
+			// the file is still copied by the kernel, only for this call the socket does not block
+			auto fileFlags = fcntl(fd_, F_GETFL);
+			fcntl(fd_, F_SETFL, fileFlags | O_NONBLOCK);
+			while (length > 0) {
+				bytes = sendfile(fd_, fileFd, &offset, length);
+				if (bytes == -1 && errno == EINTR) {
+					continue;
+				}
+				if (bytes <= 0) {
+					break;
+				}
+				length -= bytes;
+			}
+			auto error = errno;
+			fcntl(fd_, F_SETFL, fileFlags);
+			if (bytes == -1 && error != EAGAIN && error != EWOULDBLOCK) {
+				errno = error;
+				return -1;
+			}
+			if (length == 0) {
+				return total;
+			}
+		}
+	}
+	// the rest of the range waits in the queue behind other frames
+	auto position = frame.length();
+	frame.resize(position + length);
+	while (length > 0) {
+		auto bytes = pread(fileFd, frame.data() + position, length, offset);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			return -1;
+		}
+		position += bytes;
+		offset += bytes;
+		length -= bytes;
+	}
+	outputBytes_ += frame.length();
+	output_.push_back({ std::move(frame), 0, {} });
+	++statistics_.framesQueued;
+	statistics_.peakOutputBytes = std::max<uint64_t>(statistics_.peakOutputBytes, outputBytes_);
+	return total;
+}
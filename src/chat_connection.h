@@ -0,0 +1,135 @@
+#pragma once
+
+#include "uring_io.h"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/types.h>
+#endif
+
+extern "C" {
+	#include <zlib.h>
+}
+
+// Length-prefixed frames over a stream socket.
+// Frame: 4 bytes payload length (network order), 1 byte flags, payload.
+// Compressed payload starts with 4 bytes of original length and is raw deflate,
+// every frame is compressed independently. Batch payload is a sequence of
+// length-prefixed messages, so a burst of messages costs one frame
+class ChatConnection final {
+public:
+	enum Flags : uint8_t {
+		FLAG_COMPRESSED = 0x01,
+		FLAG_DICTIONARY = 0x02,
+		FLAG_BATCH = 0x04
+	};
+
+	enum class Compression {
+		NONE,
+		DEFLATE,
+		DEFLATE_DICTIONARY // deflate primed with the shared dictionary of protocol words
+	};
+
+	struct Statistics {
+		uint64_t framesSent{ 0 };
+		uint64_t framesCompressed{ 0 };
+		uint64_t bytesBeforeCompression{ 0 };
+		uint64_t bytesAfterCompression{ 0 };
+		uint64_t bytesReceived{ 0 }; // payload bytes after decompression
+		uint64_t bytesReceivedOnWire{ 0 };
+		uint64_t framesQueued{ 0 }; // frames which could not be written at once
+		uint64_t framesDropped{ 0 };
+		uint64_t peakOutputBytes{ 0 };
+	};
+
+	ChatConnection() = default;
+	explicit ChatConnection(int fd);
+	ChatConnection(const ChatConnection &) = delete;
+	ChatConnection &operator=(const ChatConnection &) = delete;
+	~ChatConnection();
+
+	// exchanges connections with all their state, a worker process keeps one per session
+	void swap(ChatConnection &other) noexcept;
+
+	void setFd(int fd);
+	int getFd() const;
+
+	// socket I/O goes through the ring: received bytes are read ahead into a buffer,
+	// frame header and body are sent as linked requests. nullptr returns to read() and write()
+	void setUring(UringIo *uring);
+
+	// send one message, returns -1 on error
+	ssize_t send(const std::string &message);
+
+	// send several messages in one frame. Tags (ids of the messages) make the frame droppable while it waits in the queue
+	ssize_t sendBatch(const std::vector<std::string> &messages, const std::vector<uint64_t> &tags = {});
+
+	// send header followed by length bytes of file from offset as one frame.
+	// File content is copied by the kernel with sendfile() and is never compressed
+	ssize_t sendFileRange(const std::string &header, int fileFd, off_t offset, size_t length);
+
+	// receive next message, messages of a batch are returned one by one.
+	// Returns 1 if a message was received, 0 if peer has closed the connection and -1 on error
+	ssize_t receive(std::string &message);
+
+	// with limits set, writes do not block: frames the socket does not take wait in the queue
+	// and are written by flush() when the socket is writable. Zero limits return to blocking writes
+	void setOutputLimits(size_t bytes, size_t frames);
+	ssize_t flush(); // bytes written, -1 on error
+	bool hasOutput() const;
+	size_t getOutputBytes() const;
+	size_t getOutputFrames() const;
+	bool isOutputOverLimit() const;
+	// drops queued frames which have tags and are not being written yet, oldest first;
+	// with untilUnderLimit only as many as needed to fit the limits. Returns tags of dropped frames
+	std::vector<uint64_t> dropOutput(bool untilUnderLimit);
+
+	// there are messages of already received batch or bytes read ahead from the socket
+	bool hasPending() const;
+
+	void setCompression(Compression compression);
+	Compression getCompression() const;
+	const Statistics &getStatistics() const;
+
+	static std::string compressionToString(Compression compression);
+	static Compression compressionFromString(const std::string &name);
+
+	static constexpr size_t COMPRESSION_THRESHOLD{ 128 };
+	static constexpr size_t MAX_FRAME_LENGTH{ 16 * 1024 * 1024 };
+
+private:
+	static constexpr size_t HEADER_LENGTH{ 5 };
+
+	struct Output {
+		std::string data;
+		size_t offset; // bytes already written
+		std::vector<uint64_t> tags;
+	};
+
+	ssize_t sendFrame(const std::string &payload, uint8_t flags, const std::vector<uint64_t> &tags = {});
+	ssize_t queueFrame(std::string frame, const std::vector<uint64_t> &tags);
+	ssize_t sendFileRangeQueued(std::string frame, int fileFd, off_t offset, size_t length);
+	bool compress(const std::string &src, std::string &dst, bool useDictionary);
+	bool decompress(const std::string &src, std::string &dst, bool useDictionary);
+	bool readExactly(char *buf, size_t length);
+	bool writeExactly(const char *buf, size_t length);
+
+	int fd_{ -1 };
+	Compression compression_{ Compression::NONE };
+	Statistics statistics_;
+	std::deque<std::string> pending_;
+	UringIo *uring_{ nullptr };
+	std::string input_; // bytes received through the ring and not parsed yet
+	size_t inputPosition_{ 0 };
+	std::deque<Output> output_;
+	size_t outputBytes_{ 0 };
+	size_t maxOutputBytes_{ 0 };
+	size_t maxOutputFrames_{ 0 };
+	std::unique_ptr<z_stream> deflater_;
+	std::unique_ptr<z_stream> inflater_;
+};
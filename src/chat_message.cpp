@@ -0,0 +1,53 @@
+#include "chat_message.h"
+#include "conversation.h"
+
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+	// concurrent servers take ids as MAX(`id`) + 1, so an insert can lose the id to another one
+	const unsigned INSERT_ATTEMPTS{ 5 };
+
+	bool isStored(Mysql &mysql, const std::string &sender, const std::string &clientId) {
+		std::stringstream ss;
+		ss << "SELECT `messages`.`id` FROM `messages` "
+			"JOIN `users` ON `users`.`id` = `messages`.`sender` "
+			"WHERE `users`.`login` = '" << sender << "' AND `messages`.`client_id` = '" << clientId << "'";
+		mysql.query(ss.str());
+		return !mysql.fetchAll().empty();
+	}
+}
+
+unsigned long long ChatMessage::insert(
+	Mysql &mysql,
+	const std::string &sender,
+	const std::string &clientId,
+	const std::string &conversation,
+	const std::function<std::string(unsigned long long id, unsigned long long seq)> &statement
+	) {
+	// a retried message must not take a sequence number
+	if (!clientId.empty() && isStored(mysql, sender, clientId)) {
+		return DUPLICATE;
+	}
+	auto seq = Conversation::nextSequence(mysql, conversation);
+	for (unsigned attempt = 1; ; ++attempt) {
+		mysql.query("SELECT COALESCE(max(`id`), -1) FROM `messages`");
+		auto rows = mysql.fetchAll();
+		unsigned long long id = std::stoll(rows.front().at(0)) + 1;
+		if (mysql.query(statement(id, seq))) {
+			return id;
+		}
+		// unique (`sender`, `client_id`) rejects a message retried concurrently,
+		// otherwise the primary key has been taken by another message
+		auto error = mysql.getErrorNumber();
+		if (error == ER_DUP_ENTRY && !clientId.empty() && isStored(mysql, sender, clientId)) {
+			Conversation::releaseSequence(mysql, conversation, seq);
+			return DUPLICATE;
+		}
+		if (error != ER_DUP_ENTRY || attempt == INSERT_ATTEMPTS) {
+			std::string message{ mysql.getError() };
+			Conversation::releaseSequence(mysql, conversation, seq);
+			throw std::runtime_error{ message };
+		}
+	}
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include "chat_user.h"
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -9,7 +10,7 @@ public:
 	virtual void print() const = 0;
 
 	// print the message if it is not read by user
-	virtual void printIfUnreadByUser(const std::string &) = 0;
+	virtual void printIfUnreadByUser(const ChatUser &) = 0;
 
 	// check if message is read
 	virtual bool isRead() const = 0;
@@ -17,13 +18,33 @@ public:
 	// pack string with message information for transferring it through a network
 	virtual std::string createTransferString() const = 0;
 
-	// save message to database
-	virtual void save(Mysql &) const = 0;
+	// returned by save() if message with the same client id is already stored
+	static constexpr unsigned long long DUPLICATE{ ~0ULL };
+
+	// save message to database, returns id of the new message or DUPLICATE
+	virtual unsigned long long save(Mysql &) const = 0;
 	
 	// save message to file
 	virtual void save(const std::string &) const = 0;
 
+	// id given to the message by sender's client, makes retried sends idempotent
+	void setClientId(const std::string &clientId) { clientId_ = clientId; }
+
+	// insert a message row built by statement(id, seq), returns its id or DUPLICATE.
+	// The sequence number of the conversation is taken only for a message which is not stored yet
+	// and is given back if the insert fails; an id taken by a concurrent insert is retried
+	static unsigned long long insert(
+		Mysql &mysql,
+		const std::string &sender,
+		const std::string &clientId,
+		const std::string &conversation,
+		const std::function<std::string(unsigned long long id, unsigned long long seq)> &statement);
+
 protected:
+	// SQL value for `client_id` column
+	std::string getClientIdValue() const { return clientId_.empty() ? "NULL" : "'" + clientId_ + "'"; }
+
 	std::string text_;
 	std::string sender_;
+	std::string clientId_;
 };
@@ -3,6 +3,7 @@
 #include "project_lib.h"
 
 #include <functional>
+#include <random>
 #include <string>
 #include <fstream>
 #include <filesystem>
@@ -11,7 +12,13 @@
 extern "C" {
 	#include <sys/utsname.h>
 	#include <errno.h>
+	#include <fcntl.h>
 	#include <sys/select.h>
+	#include <sys/stat.h>
+	#include <sys/un.h>
+	#include <sys/signalfd.h>
+	#include <poll.h>
+	#include <sched.h>
 }
 #elif defined(_WIN64) or defined(_WIN32)
 #pragma comment(lib, "ntdll")
@@ -21,8 +28,19 @@ extern "C" NTSTATUS __stdcall RtlGetVersion(OSVERSIONINFOEXW * lpVersionInformat
 
 namespace fs = std::filesystem;
 
+namespace {
+	bool isValidConversation(const std::string &conversation) {
+		return !conversation.empty() &&
+			conversation.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_,@#*") == std::string::npos;
+	}
+
+	bool isNumber(const std::string &value) {
+		return !value.empty() && std::all_of(value.begin(), value.end(), ::isdigit);
+	}
+}
+
 // constructor
-ChatServer::ChatServer() {
+ChatServer::ChatServer(const bool takeover) {
 	mainPid_ = getpid();
 	printSystemInformation();
 
@@ -38,46 +56,85 @@ ChatServer::ChatServer() {
 		throw std::runtime_error{ ss.str() };
 	}
 
-	if (fs::exists(TEMP_DIR)) {
+	if (takeover) {
+		// the running server keeps serving its sessions until they move here
+		if (!fs::exists(HANDOFF_SOCKET)) {
+			throw std::runtime_error{ "No running server to take over: " + HANDOFF_SOCKET + " does not exist" };
+		}
+	}
+	else if (fs::exists(TEMP_DIR)) {
 		throw std::runtime_error{
 			std::string{ "Temporary directory " } +
 			TEMP_DIR +
 			" exists. Maybe server is already running? "
+			"Start the new server with --takeover to restart it without downtime. "
 			"If server is not running, please delete temporary directory before start"
 		};
 	}
-	fs::create_directory(TEMP_DIR);
+	else {
+		fs::create_directory(TEMP_DIR);
+	}
 	try {
 		loadUsers();
-		setUsersInactive();
+		updateSearchIndex();
+		std::cout << "Search index contains " << searchIndex_.size() << " messages" << std::endl;
 	}
 	catch (const std::runtime_error &e) {
 		std::cerr << e.what() << std::endl;
 	}
-
-	sockFd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sockFd_ == -1) {
-		throw std::runtime_error{ "Error while creating socket!" };
+	// the running server drains as soon as it has handed over, so this is done when the rest is ready
+	std::vector<int> listeners;
+	int presenceFd = -1;
+	if (takeover) {
+		listeners = receiveListeners(presenceFd);
 	}
-
-	int trueVal = 1;
-	if (setsockopt(sockFd_, SOL_SOCKET, SO_REUSEADDR, &trueVal, sizeof(trueVal)) == -1) {
-		throw std::runtime_error{ std::string{ "Can not set socket options: " } + std::string{ strerror(errno) } };	
+	// must exist before the first fork()
+	if (presenceFd != -1) {
+		// sessions of the running server stay visible and logged in until it has drained them
+		try {
+			presence_ = PresenceTable::attach(presenceFd);
+		}
+		catch (const std::runtime_error &e) {
+			std::cout << "Warning: " << e.what() << ", users of the running server may log in again until it stops" << std::endl;
+			presenceFd = -1;
+		}
+	}
+	if (presence_ == nullptr) {
+		presence_ = std::make_unique<PresenceTable>(std::stoul(config_.get("PresenceSlots", DEFAULT_PRESENCE_SLOTS)));
+		try {
+			setUsersInactive();
+		}
+		catch (const std::runtime_error &e) {
+			std::cerr << e.what() << std::endl;
+		}
 	}
+	fs::create_directories(config_.get("SpoolDir", DEFAULT_SPOOL_DIR));
+	fs::create_directories(fs::path{ attachments_.getTemporaryPath(0) }.parent_path());
 
 	server_.sin_addr.s_addr = htonl(INADDR_ANY);
 	server_.sin_port = htons(stoi(config_["ListenPort"]));
 	server_.sin_family = AF_INET;
-
-	auto bindStatus = bind(sockFd_, reinterpret_cast<sockaddr *>(&server_), sizeof(server_));
-	if (bindStatus == -1) {
-		throw std::runtime_error{ std::string{ "Can not bind socket: " } + std::string{ strerror(errno) } };
+	acceptors_ = std::clamp(std::stoul(config_.get("Acceptors", DEFAULT_ACCEPTORS)), 1ul, MAX_HANDOFF_LISTENERS);
+	// the main process is the first acceptor, its listener is also the one inherited by the children
+	if (takeover) {
+		sockFd_ = listeners.front();
+		acceptorListeners_.assign(listeners.begin() + 1, listeners.end());
+		// every listener taken over needs an acceptor, connections in its queue are not lost then
+		acceptors_ = std::max(acceptors_, listeners.size());
 	}
-
-	auto connectionStatus = listen(sockFd_, BACKLOG);
-	if (connectionStatus == -1) {
-		throw std::runtime_error{ "Error: could not listen the specified TCP port" };
+	else {
+		sockFd_ = createListener();
+	}
+	while (acceptorListeners_.size() + 1 < acceptors_) {
+		acceptorListeners_.push_back(createListener());
+	}
+	if (config_.get("IoBackend", "select") == "io_uring") {
+		useUring_ = UringIo::isAvailable();
+		if (!useUring_) {
+			std::cout << "Warning: server is built without liburing, IoBackend = io_uring is ignored" << std::endl;
+		}
 	}
+
 	std::cout <<
 		"Welcome to the chat admin console. "
 		"This chat server supports multiple client login and creates own process for each one.\n"
@@ -90,7 +147,11 @@ ChatServer::ChatServer() {
 		}
 	}
 
-	std::cout << "\n\nServer has been started and listening port TCP/" << config_["ListenPort"] << std::endl;
+	std::cout << "\n\nServer has been started and listening port TCP/" << config_["ListenPort"];
+	if (acceptors_ > 1) {
+		std::cout << " with " << acceptors_ << " acceptors";
+	}
+	std::cout << std::endl;
 	printPrompt();
 }
 
@@ -114,7 +175,9 @@ void ChatServer::displayHelp() const {
 		" /list: list connected users\n"
 		" /log: print one line from log\n"
 		" /kick <username>: kick connected user\n"
+		" /search <words>: find messages containing all the words\n"
 		" /remove: delete inactive user\n"
+		" /drain: stop accepting connections, ask clients to reconnect and exit when they have left\n"
 		" /exit, /quit, Ctrl-C: close the program\n"
 		<< std::endl;
 }
@@ -137,10 +200,41 @@ void ChatServer::checkLogin() const {
 		strcat(message_, "available");
 	}
 	
-	auto bytes = write(connection_, message_, MESSAGE_LENGTH);
+	auto bytes = connection_.send(message_);
 	printPrompt();
 }
 
+void ChatServer::negotiateCompression() {
+	// 0: cmd, 1: compression requested by client
+	auto tokens = Chat::split(std::string{ message_ }, ":");
+	auto requested = ChatConnection::compressionFromString(tokens.size() > 1 ? tokens[1] : std::string{});
+	auto allowed = ChatConnection::compressionFromString(config_.get("Compression", "deflate-dict"));
+	// the weakest of requested and allowed modes is chosen
+	auto chosen = std::min(requested, allowed);
+	strcpy(message_, ("/response:compress:" + ChatConnection::compressionToString(chosen)).c_str());
+	connection_.send(message_);
+	connection_.setCompression(chosen);
+}
+
+void ChatServer::printCompressionStatistics() const {
+	const auto &stats = connection_.getStatistics();
+	if (stats.framesCompressed == 0) {
+		return;
+	}
+	std::cout << "Compression (" << ChatConnection::compressionToString(connection_.getCompression()) << "): "
+		<< stats.framesCompressed << " of " << stats.framesSent << " frames compressed, "
+		<< stats.bytesBeforeCompression - stats.bytesAfterCompression << " bytes saved" << std::endl;
+}
+
+void ChatServer::printOutputStatistics() const {
+	const auto &stats = connection_.getStatistics();
+	if (stats.framesQueued == 0) {
+		return;
+	}
+	std::cout << "Outbound queue: " << stats.framesQueued << " frames waited, peak " << stats.peakOutputBytes << " bytes, "
+		<< stats.framesDropped << " frames dropped" << std::endl;
+}
+
 void ChatServer::signUp() {
 	std::string hash;
 	auto tokens = Chat::split(message_, ":");
@@ -170,7 +264,7 @@ void ChatServer::signUp() {
 
 			users_.emplace(tokens[1], ChatUser(new_id, tokens[1], hash, tokens[3]));
 			strcpy(message_, "/response:success");
-			auto bytes = write(connection_, message_, MESSAGE_LENGTH);
+			auto bytes = connection_.send(message_);
 			clearPrompt();
 			std::cout << "User '" << tokens[1] << "' has been registered" << std::endl;
 			printPrompt();
@@ -224,16 +318,15 @@ void ChatServer::signIn() {
 		clearPrompt();
 		std::cout << "Login failed for user " << std::quoted(login) << " from " << getClientIpAndPort() << std::endl;
 		strcpy(message_, "/response:fail");
-		auto bytes = write(connection_, message_, MESSAGE_LENGTH);
+		auto bytes = connection_.send(message_);
 	}
 	else {
-		updateActiveUsers();
-		if (users_.at(login).isLoggedIn()) {
+		if (!presence_->setOnline(users_.at(login).getUserId(), getpid(), client_.sin_addr.s_addr, getClientPort(), false)) {
 			strcpy(message_, "/response:loggedin");
 			clearPrompt();
 			std::cout << "User " << std::quoted(login) << " is already logged in" << std::endl;
 			std::cout << "Sending response: " << message_ << std::endl;
-			auto bytes = write(connection_, message_, MESSAGE_LENGTH);
+			auto bytes = connection_.send(message_);
 			printPrompt();
 			return;
 		}
@@ -255,69 +348,179 @@ void ChatServer::signIn() {
 			std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
 			printPrompt();
 		}
+		std::string token;
+		try {
+			Mysql mysql;
+			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+			token = createSessionToken(mysql, users_.at(login).getUserId());
+			// older unread messages are fetched by the client page by page, new ones are pushed
+			backlogLimit_ = getLatestMessageId(mysql);
+			summaryPending_ = true;
+		}
+		catch (const std::runtime_error &e) {
+			clearPrompt();
+			std::cout << "Error: can not create session token (" << e.what() << ")" << std::endl;
+			printPrompt();
+		}
 		clearPrompt();
 		std::cout << "User " << std::quoted(login) << " successfully logged in" << std::endl;
 		strcpy(message_, "/response:success:");
 		strcat(message_, users_.at(login).getName().c_str());
 		strcat(message_, ":");
 		strcat(message_, std::to_string(users_.at(login).getUserId()).c_str());
-		auto bytes = write(connection_, message_, MESSAGE_LENGTH);
+		strcat(message_, ":");
+		strcat(message_, token.c_str());
+		auto bytes = connection_.send(message_);
 		loggedUser_ = login;
 	}
 	printPrompt();
 }
 
-void ChatServer::removeSessionByPid(const pid_t pid) const {
+unsigned long long ChatServer::getLatestMessageId(Mysql &mysql) const {
+	mysql.query("SELECT COALESCE(MAX(`id`), 0) FROM `messages`");
+	auto rows = mysql.fetchAll();
+	return rows.empty() ? 0 : std::stoull(rows.front().at(0));
+}
+
+std::string ChatServer::createSessionToken(Mysql &mysql, const unsigned userId) const {
+	std::random_device random;
+	std::stringstream token;
+	for (int i = 0; i < 8; ++i) {
+		token << std::hex << std::setw(8) << std::setfill('0') << random();
+	}
+	// only hash of the token is stored
+	SHA256 sha;
+	sha.update(token.str());
+	uint8_t *digest = sha.digest();
+	std::string hash{ SHA256::toString(digest) };
+	delete[] digest;
+
+	std::stringstream ss;
+	ss << "DELETE FROM `session_tokens` WHERE `expires` < CURRENT_TIMESTAMP";
+	mysql.query(ss.str());
+	ss.str(std::string{});
+	ss << "INSERT INTO `session_tokens` (`token_hash`, `user_id`, `expires`) VALUES ('" << hash << "', " << userId << ", "
+		"CURRENT_TIMESTAMP + INTERVAL " << std::stoul(config_.get("SessionLifetime", DEFAULT_SESSION_LIFETIME)) << " SECOND)";
+	if (!mysql.query(ss.str())) {
+		throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+	}
+	return token.str();
+}
+
+void ChatServer::resumeSession() {
+	// 0: cmd, 1: login, 2: session token
+	auto tokens = Chat::split(std::string{ message_ }, ":");
+	if (!loggedUser_.empty() || tokens.size() < 3 || !isValidLogin(tokens[1]) ||
+		tokens[2].find_first_not_of("0123456789abcdef") != std::string::npos) {
+		connection_.send("/response:fail");
+		return;
+	}
+	const auto &login = tokens[1];
+	SHA256 sha;
+	sha.update(tokens[2]);
+	uint8_t *digest = sha.digest();
+	std::string hash{ SHA256::toString(digest) };
+	delete[] digest;
+
 	try {
 		Mysql mysql;
 		try {
-			std::stringstream ss;
-
 			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			ss << "DELETE FROM `active_sessions` WHERE `pid` = " << pid;
+			// only the resumed user is loaded, not the whole users table
+			std::stringstream ss;
+			ss << "SELECT `users`.`id`, `users`.`login`, `users`.`password_hash`, `users`.`name` "
+				"FROM `session_tokens` "
+				"JOIN `users` ON `users`.`id` = `session_tokens`.`user_id` "
+				"WHERE `session_tokens`.`token_hash` = '" << hash << "' AND "
+					"`users`.`login` = '" << login << "' AND "
+					"`session_tokens`.`expires` > CURRENT_TIMESTAMP";
 			mysql.query(ss.str());
+			auto rows = mysql.fetchAll();
+			if (rows.empty()) {
+				clearPrompt();
+				std::cout << "Session resume failed for user " << std::quoted(login) << " from " << getClientIpAndPort() << std::endl;
+				printPrompt();
+				connection_.send("/response:fail");
+				return;
+			}
+			auto row = rows.front();
+			unsigned userId = std::stoi(row[0]);
+			// the old connection may be still half-open, the resumed session takes its place
+			auto old = presence_->get(userId);
+			if (!presence_->setOnline(userId, getpid(), client_.sin_addr.s_addr, getClientPort(), true)) {
+				throw std::runtime_error{ "presence table is full" };
+			}
+			if (old && old->pid != getpid()) {
+				kill(old->pid, SIGUSR1); // wakes it up to notice that the session is taken over
+			}
+			users_.insert_or_assign(login, ChatUser(userId, row[1], row[2], row[3]));
+			users_.at(login).login(mysql, getClientIp(), getClientPort(), getpid());
+			// messages missed while disconnected come with /sync, the backlog stays lazy.
+			// Conversations without a saved position are not synced, the summary tells about them
+			backlogLimit_ = getLatestMessageId(mysql);
+			summaryPending_ = true;
+			loggedUser_ = login;
 		}
 		catch (const std::runtime_error &e) {
 			clearPrompt();
-			std::cout << "Error: can not remove user session from database (" << e.what() << ")" << std::endl;
+			std::cout << "Error: can not resume session (" << e.what() << ")" << std::endl;
 			printPrompt();
+			connection_.send("/response:fail");
+			return;
 		}
 	}
 	catch (const std::runtime_error &e) {
 		clearPrompt();
-		std::cerr << "Error: cannot connect to database (" << e.what() << ")" << std::endl;
+		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		printPrompt();
+		connection_.send("/response:fail");
+		return;
+	}
+	clearPrompt();
+	std::cout << "User " << std::quoted(loggedUser_) << " resumed session from " << getClientIpAndPort() << std::endl;
+	printPrompt();
+	connection_.send("/response:success");
+}
+
+void ChatServer::removeSessionTokens() const {
+	if (loggedUser_.empty()) {
+		return;
+	}
+	try {
+		Mysql mysql;
+		mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+		mysql.query("DELETE FROM `session_tokens` WHERE `user_id` = " + std::to_string(users_.at(loggedUser_).getUserId()));
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not remove session tokens (" << e.what() << ")" << std::endl;
 		printPrompt();
 	}
 }
 
 void ChatServer::signOut() {
+	applyAcknowledgements();
+	unacknowledged_.clear();
+	undelivered_.clear();
+	pendingAcks_.clear();
+	history_.clear();
+	summaryPending_ = false;
 	clearPrompt();
 	std::cout << "User '" << loggedUser_ << "' logged out at " << getClientIpAndPort() << std::endl;
 	printPrompt();
 	try {
-		try {
-			Mysql mysql;
-            try {
-				mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-				users_.at(loggedUser_).logout(mysql);
-			}
-			catch (const std::runtime_error &e) {
-                clearPrompt();
-                std::cout << "Error: can not save user information to database (" << e.what() << ")" << std::endl;
-                printPrompt();
-            }
-		}
-		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
-			printPrompt();
-		}
+		presence_->setOffline(users_.at(loggedUser_).getUserId(), getpid(), getClientPort());
+		users_.at(loggedUser_).logout();
 	}
 	catch (const std::out_of_range &e) {
 		clearPrompt();
 		std::cout << "Error: can not log out (" << e.what() << std::endl;
 		printPrompt();
 	}
+	for (auto &it: outgoingTransfers_) {
+		close(it.second.fd);
+	}
+	outgoingTransfers_.clear();
 	loggedUser_.clear();
 }
 
@@ -325,14 +528,13 @@ void ChatServer::removeUser(const std::string &cmd) {
 	std::string removingUser{ cmd.substr(7, cmd.length() - 7) };
 	std::erase(removingUser, ' ');
 	loadUsers();
-	updateActiveUsers();
 	auto it = users_.find(removingUser);
 	if (it == users_.end()) {
 		clearPrompt();
 		std::cout << "User " << std::quoted(removingUser) << " does not exist" << std::endl;
 		return;
 	}
-	if (it->second.isLoggedIn()) {
+	if (presence_->get(it->second.getUserId())) {
 		clearPrompt();
 		std::cout << "Can not remove user " << std::quoted(removingUser) << " because he/she is logged in now. Kick him/her first" << std::endl;
 		return;
@@ -347,12 +549,12 @@ void ChatServer::removeUser() {
 	std::string removingUser{ loggedUser_ };
 	if (!users_.at(removingUser).isLoggedIn()) {
 		strcpy(message_, "/response:fail");
-		write(connection_, message_, MESSAGE_LENGTH);
+		connection_.send(message_);
 		return;
 	}
 		
 	strcpy(message_, "/response:success");
-	write(connection_, message_, MESSAGE_LENGTH);
+	connection_.send(message_);
 	signOut();
 	removeUserFromDb(removingUser);
 	loggedUser_.clear();
@@ -361,7 +563,7 @@ void ChatServer::removeUser() {
 	printPrompt();
 }
 
-void ChatServer::sendMessage() {
+void ChatServer::sendMessage(const std::string &clientId) {
 	std::string message{ message_ };
 	if (message.empty()) {
 		// message can no be empty
@@ -369,40 +571,41 @@ void ChatServer::sendMessage() {
 	}
 
 	loadUsers();
-	try {
-		Mysql mysql;
-		try {
-			std::stringstream ss;
-			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			ss << "UPDATE `active_sessions` SET `last_activity` = CURRENT_TIMESTAMP WHERE "
-				"`user_id` = " << users_.at(loggedUser_).getUserId();
-			if (!mysql.query(ss.str())) {
-				ss.str(std::string{});
-				ss << "MySQL error: " << mysql.getError();
-				throw std::runtime_error{ ss.str() };
+
+	if (message[0] == '#') {
+		size_t pos = message.find(' ');
+		if (pos != std::string::npos) {
+			try {
+				sendChannelMessage(users_.at(loggedUser_), message.substr(1, pos - 1), message.substr(pos + 1), clientId);
+			}
+			catch (const std::out_of_range &e) {
+				clearPrompt();
+				std::cout << "Error: can not send channel message (" << e.what() << std::endl;
+				printPrompt();
 			}
 		}
-		catch (const std::runtime_error &e) {
-			clearPrompt();
-			std::cout << "Error: can not update last activity field in the database (" << e.what() << ")" << std::endl;
-			printPrompt();
-		}
-	}
-	catch (const std::runtime_error &e) {
-		clearPrompt();
-		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
-		printPrompt();
 	}
-	
-	if (message[0] == '@') {
-		size_t pos = message.find(' ');
-		if (pos != std::string::npos) {
-			std::string receiverName = message.substr(1, pos - 1);
+	else if (message[0] == '@') {
+		// "@a @b @c text": every leading @login adds a recipient
+		std::vector<std::string> receiverNames;
+		size_t pos = 0;
+		while (pos < message.length() && message[pos] == '@') {
+			size_t end = message.find(' ', pos);
+			if (end == std::string::npos) {
+				break;
+			}
+			auto receiverName = message.substr(pos + 1, end - pos - 1);
+			if (std::find(receiverNames.begin(), receiverNames.end(), receiverName) == receiverNames.end()) {
+				receiverNames.push_back(receiverName);
+			}
+			pos = message.find_first_not_of(' ', end);
+		}
+		if (!receiverNames.empty() && pos != std::string::npos && pos < message.length() && message[pos] != '@') {
 			clearPrompt();
 			printPrompt();
-			std::string messageText = message.substr(pos + 1);
+			std::string messageText = message.substr(pos);
 			try {
-				sendPrivateMessage(users_.at(loggedUser_), receiverName, messageText);
+				sendPrivateMessage(users_.at(loggedUser_), receiverNames, messageText, clientId);
 			}
 			catch (const std::out_of_range &e) {
 				clearPrompt();
@@ -413,7 +616,7 @@ void ChatServer::sendMessage() {
 	}
 	else {
 		try {
-			sendBroadcastMessage(users_.at(loggedUser_), message);
+			sendBroadcastMessage(users_.at(loggedUser_), message, clientId);
 		}
 		catch (const std::out_of_range &e) {
 			clearPrompt();
@@ -423,23 +626,53 @@ void ChatServer::sendMessage() {
 	}
 }
 
-void ChatServer::sendPrivateMessage(ChatUser& sender, const std::string& receiverName, const std::string& messageText) {
-	if (users_.find(receiverName) == users_.end()) {
-		throw std::invalid_argument("RECEIVER_DOES_NOT_EXIST");
+bool ChatServer::isValidClientId(const std::string &clientId) {
+	return !clientId.empty() && clientId.length() <= MAX_CLIENT_ID_LENGTH &&
+		clientId.find_first_not_of("0123456789abcdef-") == std::string::npos;
+}
+
+bool ChatServer::isKnownClientId(const std::string &clientId) const {
+	return recentClientIds_.find(clientId) != recentClientIds_.end();
+}
+
+void ChatServer::rememberClientId(const std::string &clientId) {
+	if (clientId.empty() || !recentClientIds_.insert(clientId).second) {
+		return;
+	}
+	// the window is bounded, older retries are caught by the unique index
+	recentClientIdOrder_.push_back(clientId);
+	if (recentClientIdOrder_.size() > DEDUP_WINDOW) {
+		recentClientIds_.erase(recentClientIdOrder_.front());
+		recentClientIdOrder_.pop_front();
 	}
+}
 
+void ChatServer::sendPrivateMessage(
+	ChatUser& sender,
+	const std::vector<std::string>& receiverNames,
+	const std::string& messageText,
+	const std::string& clientId
+	) {
 	std::stringstream ss;
-
-	ss << sender.getLogin() << ": @" << receiverName << ' ' << messageText;
+	ss << sender.getLogin() << ":";
+	for (const auto &receiverName: receiverNames) {
+		if (users_.find(receiverName) == users_.end()) {
+			throw std::invalid_argument("RECEIVER_DOES_NOT_EXIST");
+		}
+		ss << " @" << receiverName;
+	}
+	ss << ' ' << messageText;
 	*logger_ << ss.str();
 
-	auto newMessage = std::make_shared<PrivateMessage>(sender.getLogin(), receiverName, messageText);
+	PrivateMessage newMessage{ sender.getLogin(), receiverNames, messageText };
+	newMessage.setClientId(clientId);
 	
 	try {
 		Mysql mysql;
 		try {
 			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			newMessage->save(mysql);
+			newMessage.save(mysql);
+			rememberClientId(clientId);
 		}
 		catch (const std::runtime_error &e) {
 			clearPrompt();
@@ -454,19 +687,20 @@ void ChatServer::sendPrivateMessage(ChatUser& sender, const std::string& receive
 	}
 }
 
-void ChatServer::sendBroadcastMessage(ChatUser& sender, const std::string& message) {
+void ChatServer::sendBroadcastMessage(ChatUser& sender, const std::string& message, const std::string& clientId) {
 	std::stringstream ss;
 
 	ss << sender.getLogin() << ": " << message;
 	*logger_ << ss.str();
 
-	// Dynamically allocate memory for new message
-	auto newMessage = std::make_shared<BroadcastMessage>(sender.getLogin(), message, users_);
+	BroadcastMessage newMessage{ sender.getLogin(), message, users_ };
+	newMessage.setClientId(clientId);
 	try {
 		Mysql mysql;
 		try {
 			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			newMessage->save(mysql);
+			newMessage.save(mysql);
+			rememberClientId(clientId);
 		}
 		catch (const std::runtime_error &e) {
 			clearPrompt();
@@ -481,32 +715,70 @@ void ChatServer::sendBroadcastMessage(ChatUser& sender, const std::string& messa
 	}
 }
 
-void ChatServer::listActiveUsers() {
+void ChatServer::sendChannelMessage(
+	ChatUser& sender,
+	const std::string& channelName,
+	const std::string& message,
+	const std::string& clientId
+	) {
+	if (channelName.empty() || !isValidLogin(channelName)) {
+		sendNotice("Channel name contains invalid characters");
+		return;
+	}
+	std::stringstream ss;
+	ss << sender.getLogin() << ": #" << channelName << ' ' << message;
+	*logger_ << ss.str();
+
 	try {
 		Mysql mysql;
 		try {
 			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			mysql.query("SELECT "
-					"`users`.`login`, "
-					"INET_NTOA(`active_sessions`.`ip`), "
-					"`active_sessions`.`port`, "
-					"`active_sessions`.`pid`, "
-					"`active_sessions`.`session_start` "
-				"FROM "
-					"`active_sessions` "
-				"JOIN "
-					"`users` ON `users`.`id` = `active_sessions`.`user_id` "
-				"ORDER BY "
-					"session_start DESC "
-			);
+			ss.str(std::string{});
+			ss << "SELECT `channels`.`id` FROM `channels` "
+				"JOIN `channel_members` ON `channel_members`.`channel_id` = `channels`.`id` "
+				"WHERE `channels`.`name` = '" << channelName << "' AND `channel_members`.`user_id` = " << sender.getUserId();
+			mysql.query(ss.str());
 			auto rows = mysql.fetchAll();
-			for (const auto &row: rows) {
-				std::cout << "Login: " << std::setw(8) << row[0] << "; Address: " << std::setw(24) << (row[1] + ":" + row[2]) << "; Pid: " << std::setw(4) << row[3] << "; Started: " << row[4] << std::endl;
+			if (rows.empty()) {
+				sendNotice("You are not a member of channel #" + channelName + ". Type /join #" + channelName + " first");
+				return;
+			}
+			auto channelId = rows.front().at(0);
+
+			// one row per message, members read it by their cursors in channel_members
+			auto conversation = Conversation::channel(channelName);
+			auto new_id = ChatMessage::insert(mysql, sender.getLogin(), clientId, conversation,
+				[&](unsigned long long id, unsigned long long seq) {
+					std::stringstream insert;
+					insert << "INSERT INTO `messages` (`id`, `type`, `conversation`, `seq`, `client_id`, `sender`, `channel`, `text`) VALUES ("
+						<< id << ", 'CHANNEL', '" << conversation << "', " << seq << ", "
+						<< (clientId.empty() ? std::string{ "NULL" } : "'" + clientId + "'") << ", "
+						<< sender.getUserId() << ", " << channelId << ", '" << message << "')";
+					return insert.str();
+				});
+			rememberClientId(clientId);
+			if (new_id == ChatMessage::DUPLICATE) {
+				return; // retried message is already stored and delivered
+			}
+			ss.str(std::string{});
+			ss << "SELECT `user_id` FROM `channel_members` WHERE `channel_id` = " << channelId << " AND `user_id` <> " << sender.getUserId();
+			Conversation::addUnread(mysql, conversation, ss.str());
+
+			// fan-out touches online members only: their sessions are woken up to fetch the message now
+			ss.str(std::string{});
+			ss << "SELECT `user_id` FROM `channel_members` "
+				"WHERE `channel_id` = " << channelId << " AND `user_id` <> " << sender.getUserId();
+			mysql.query(ss.str());
+			for (const auto &row: mysql.fetchAll()) {
+				auto session = presence_->get(std::stoul(row.at(0)));
+				if (session && session->state == PresenceTable::State::ONLINE) {
+					kill(session->pid, SIGUSR1);
+				}
 			}
 		}
 		catch (const std::runtime_error &e) {
 			clearPrompt();
-			std::cout << "Error: can not load active user list from database (" << e.what() << ")" << std::endl;
+			std::cout << "Error: can not save massage to database (" << e.what() << ")" << std::endl;
 			printPrompt();
 		}
 	}
@@ -515,6 +787,130 @@ void ChatServer::listActiveUsers() {
 		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
 		printPrompt();
 	}
+}
+
+std::set<unsigned> ChatServer::getUserChannels(Mysql &mysql) const {
+	std::set<unsigned> result;
+	mysql.query("SELECT `channel_id` FROM `channel_members` WHERE `user_id` = " +
+		std::to_string(users_.at(loggedUser_).getUserId()));
+	for (const auto &row: mysql.fetchAll()) {
+		result.insert(std::stoul(row.at(0)));
+	}
+	return result;
+}
+
+void ChatServer::joinChannel() {
+	// 0: cmd, 1: channel name
+	auto tokens = Chat::split(std::string{ message_ }, ":");
+	if (tokens.size() < 2 || tokens[1].empty() || !isValidLogin(tokens[1])) {
+		connection_.send("/response:fail");
+		return;
+	}
+	const auto &name = tokens[1];
+	try {
+		Mysql mysql;
+		mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+		auto userId = users_.at(loggedUser_).getUserId();
+		std::stringstream ss;
+		ss << "INSERT IGNORE INTO `channels` (`name`, `owner`) VALUES ('" << name << "', " << userId << ")";
+		mysql.query(ss.str());
+		// new member starts reading from the current end of the channel
+		ss.str(std::string{});
+		ss << "INSERT IGNORE INTO `channel_members` (`channel_id`, `user_id`, `last_read_id`) "
+			"SELECT `id`, " << userId << ", (SELECT COALESCE(MAX(`id`), -1) FROM `messages`) "
+			"FROM `channels` WHERE `name` = '" << name << "'";
+		if (!mysql.query(ss.str())) {
+			throw std::runtime_error{ mysql.getError() };
+		}
+		connection_.send("/response:success");
+		clearPrompt();
+		std::cout << "User " << std::quoted(loggedUser_) << " joined channel #" << name << std::endl;
+		printPrompt();
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not join channel (" << e.what() << ")" << std::endl;
+		printPrompt();
+		connection_.send("/response:fail");
+	}
+}
+
+void ChatServer::leaveChannel() {
+	// 0: cmd, 1: channel name
+	auto tokens = Chat::split(std::string{ message_ }, ":");
+	if (tokens.size() < 2 || !isValidLogin(tokens[1])) {
+		connection_.send("/response:fail");
+		return;
+	}
+	try {
+		Mysql mysql;
+		mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+		std::stringstream ss;
+		ss << "DELETE `channel_members` FROM `channel_members` "
+			"JOIN `channels` ON `channels`.`id` = `channel_members`.`channel_id` "
+			"WHERE `channels`.`name` = '" << tokens[1] << "' AND "
+			"`channel_members`.`user_id` = " << users_.at(loggedUser_).getUserId();
+		if (!mysql.query(ss.str())) {
+			throw std::runtime_error{ mysql.getError() };
+		}
+		ss.str(std::string{});
+		ss << "DELETE FROM `unread_counters` WHERE `user_id` = " << users_.at(loggedUser_).getUserId() << " AND "
+			"`conversation` = '" << Conversation::channel(tokens[1]) << "'";
+		mysql.query(ss.str());
+		connection_.send("/response:success");
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not leave channel (" << e.what() << ")" << std::endl;
+		printPrompt();
+		connection_.send("/response:fail");
+	}
+}
+
+void ChatServer::listChannels() {
+	std::string list;
+	try {
+		Mysql mysql;
+		mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+		mysql.query("SELECT `channels`.`name` FROM `channels` "
+			"JOIN `channel_members` ON `channel_members`.`channel_id` = `channels`.`id` "
+			"WHERE `channel_members`.`user_id` = " + std::to_string(users_.at(loggedUser_).getUserId()) + " "
+			"ORDER BY `channels`.`name`");
+		for (const auto &row: mysql.fetchAll()) {
+			list += (list.empty() ? "" : ",") + row.at(0);
+		}
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not load channel list (" << e.what() << ")" << std::endl;
+		printPrompt();
+	}
+	connection_.send("/response:channels:" + list);
+}
+
+void ChatServer::listActiveUsers() {
+	// sessions are read from shared memory, only logins come from the database
+	auto sessions = presence_->list();
+	std::sort(sessions.begin(), sessions.end(), [](const auto &a, const auto &b) { return a.since > b.since; });
+	std::map<unsigned, std::string> logins;
+	try {
+		loadUsers();
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not load user list from database (" << e.what() << ")" << std::endl;
+		printPrompt();
+	}
+	for (const auto &[login, user]: users_) {
+		logins[user.getUserId()] = login;
+	}
+	for (const auto &session: sessions) {
+		in_addr ip{ session.ip };
+		std::time_t since = session.since;
+		std::stringstream started;
+		started << std::put_time(std::localtime(&since), "%Y-%m-%d %H:%M:%S");
+		std::cout << "Login: " << std::setw(8) << logins[session.user_id] << "; Address: " << std::setw(24) << (std::string{ inet_ntoa(ip) } + ":" + std::to_string(session.port)) << "; Pid: " << std::setw(4) << session.pid << "; Started: " << started.str() << "; Queued: " << session.outbound_bytes << std::endl;
+	}
 	std::cout << std::endl;
 }
 
@@ -523,65 +919,747 @@ void ChatServer::kickClient(const std::string &cmd) {
 	if (tokens.size() != 2) {
 		throw std::invalid_argument{ "Error: invalid format" };
 	}
-	updateActiveUsers();
+	loadUsers();
 	auto it = users_.find(tokens[1]);
 	if (it == users_.end()) {
 		throw std::invalid_argument{ "Error: user not exist" };
 	}
-	if (!it->second.isLoggedIn()) {
+	// session process notices the mark and closes the connection itself
+	auto pid = presence_->kick(it->second.getUserId());
+	if (pid == 0) {
 		throw std::invalid_argument{ "Error: user is not logged in" };
 	}
-	for (const auto &user: activeUsers_) {
-		if (user == tokens[1]) {
-			kill(users_.at(user).getPid(), SIGTERM);
-			try {
-				Mysql mysql;
-            	try {
-					mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-					users_.at(tokens[1]).logout(mysql);
-				}
-				catch (const std::runtime_error &e) {
-                	clearPrompt();
-                	std::cout << "Error: can not save user information to database (" << e.what() << ")" << std::endl;
-                	printPrompt();
-            	}
-			}
-			catch (const std::runtime_error &e) {
-				clearPrompt();
-				std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
-				printPrompt();
-			}
+	kill(pid, SIGUSR1);
+}
+
+void ChatServer::startPresenceReporter() {
+	reporterPid_ = fork();
+	if (reporterPid_ != 0) {
+		if (reporterPid_ > 0) {
+			children_.insert(reporterPid_);
+		}
+		return;
+	}
+	restoreSignals();
+	// `active_sessions` is only a report for external tools, sessions never wait for it
+	auto interval = std::stoul(config_.get("PresenceReportInterval", DEFAULT_PRESENCE_REPORT_INTERVAL));
+	uint64_t reported = ~0ULL;
+	while (true) {
+		// SIGUSR1 from the main process interrupts the sleep when sessions have been reaped
+		sleep(interval);
+		// last activity is flushed by the sessions themselves, here only logins and logouts matter
+		auto generation = presence_->getGeneration();
+		if (generation == reported) {
+			continue;
+		}
+		try {
+			Mysql mysql;
+			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+			reportPresence(mysql);
+			reported = generation;
+		}
+		catch (const std::runtime_error &e) {
+			clearPrompt();
+			std::cout << "Error: can not report active sessions to database (" << e.what() << ")" << std::endl;
+			printPrompt();
 		}
 	}
 }
 
+void ChatServer::reportPresence(Mysql &mysql) const {
+	std::stringstream ss;
+	for (const auto &session: presence_->list()) {
+		ss << (ss.tellp() == 0 ? "" : ", ") << "(" << session.user_id << ", " << ntohl(session.ip) << ", " << session.pid << ", " << session.port << ", "
+			"FROM_UNIXTIME(" << session.since << "), FROM_UNIXTIME(" << session.last_activity << "))";
+	}
+	mysql.query("START TRANSACTION");
+	mysql.query("DELETE FROM `active_sessions`");
+	if (ss.tellp() != 0 && !mysql.query("INSERT INTO `active_sessions` (`user_id`, `ip`, `pid`, `port`, `session_start`, `last_activity`) VALUES " + ss.str())) {
+		std::string error{ mysql.getError() };
+		mysql.query("ROLLBACK");
+		throw std::runtime_error{ error };
+	}
+	mysql.query("COMMIT");
+}
+
 void ChatServer::work() {
-	socklen_t length = sizeof(client_);
+	blockSignals();
 	consolePid_ = fork();
 	if (consolePid_ == 0) {
+		restoreSignals();
 		startConsole();
 	}
 	else {
-		int clientPid;
-		while (mainLoopActive_) {
-			socklen_t length = sizeof(client_);
-			try {
-				connection_ = accept(sockFd_, reinterpret_cast<sockaddr *>(&client_), &length);
-			}
-			catch (const std::out_of_range &e) {
-				clearPrompt();
-				std::cout << "Error: out of range while trying to call accept() (" << e.what() << ')' << std::endl;
-				printPrompt();
-			}
-			clientPid = fork();
-			if (clientPid == 0) {
-				processNewClient();
-			}
-			else {
-				children_.insert(clientPid);
+		startPresenceReporter();
+		startHandoffServer();
+		startAcceptors();
+		pinToCpu(0);
+		acceptClients();
+	}
+}
+
+int ChatServer::createListener() const {
+	int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd == -1) {
+		throw std::runtime_error{ "Error while creating socket!" };
+	}
+
+	int trueVal = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &trueVal, sizeof(trueVal)) == -1) {
+		throw std::runtime_error{ std::string{ "Can not set socket options: " } + std::string{ strerror(errno) } };	
+	}
+	// every acceptor has its own listener on the same port, the kernel spreads connections between them.
+	// Set even for one acceptor: a server taking over the listeners may add acceptors on the same port
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &trueVal, sizeof(trueVal)) == -1) {
+		throw std::runtime_error{ std::string{ "Can not set SO_REUSEPORT: " } + std::string{ strerror(errno) } };
+	}
+
+	auto bindStatus = bind(fd, reinterpret_cast<const sockaddr *>(&server_), sizeof(server_));
+	if (bindStatus == -1) {
+		throw std::runtime_error{ std::string{ "Can not bind socket: " } + std::string{ strerror(errno) } };
+	}
+
+	auto backlog = std::stoi(config_.get("ListenBacklog", DEFAULT_LISTEN_BACKLOG));
+	auto connectionStatus = listen(fd, backlog);
+	if (connectionStatus == -1) {
+		throw std::runtime_error{ "Error: could not listen the specified TCP port" };
+	}
+	return fd;
+}
+
+void ChatServer::startAcceptors() {
+	for (size_t index = 1; index < acceptors_; ++index) {
+		auto pid = fork();
+		if (pid == -1) {
+			clearPrompt();
+			std::cout << "Error: can not start acceptor " << index << " (" << strerror(errno) << ")" << std::endl;
+			printPrompt();
+			// nobody would accept connections the kernel puts into its queue
+			close(acceptorListeners_[index - 1]);
+			acceptorListeners_[index - 1] = -1;
+			continue;
+		}
+		if (pid != 0) {
+			children_.insert(pid);
+			continue;
+		}
+		// sessions accepted here are children of the acceptor, not of the main process
+		isAcceptor_ = true;
+		children_.clear();
+		close(sockFd_);
+		sockFd_ = acceptorListeners_[index - 1];
+		acceptorListeners_.erase(acceptorListeners_.begin() + index - 1);
+		closeAcceptorListeners();
+		pinToCpu(index);
+		acceptClients();
+		exit(EXIT_SUCCESS);
+	}
+}
+
+void ChatServer::closeAcceptorListeners() {
+	for (auto fd: acceptorListeners_) {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	acceptorListeners_.clear();
+}
+
+void ChatServer::pinToCpu(const size_t index) const {
+	auto cpus = Chat::split(config_.get("AcceptorCpus", ""), ",");
+	cpus.erase(std::remove(cpus.begin(), cpus.end(), std::string{}), cpus.end());
+	if (cpus.empty()) {
+		return;
+	}
+	// sessions inherit the affinity, so they run on the CPU of their acceptor
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	try {
+		CPU_SET(std::stoul(cpus[index % cpus.size()]), &set);
+	}
+	catch (const std::logic_error &e) {
+		clearPrompt();
+		std::cout << "Error: wrong CPU number in AcceptorCpus" << std::endl;
+		printPrompt();
+		return;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		clearPrompt();
+		std::cout << "Error: can not pin acceptor " << index << " to CPU " << cpus[index % cpus.size()] <<
+			" (" << strerror(errno) << ")" << std::endl;
+		printPrompt();
+	}
+}
+
+void ChatServer::acceptClients() {
+	// the listener may be shared with another server during a takeover, a connection may be taken by it
+	fcntl(sockFd_, F_SETFL, fcntl(sockFd_, F_GETFL) | O_NONBLOCK);
+	startWorkers();
+	if (useUring_) {
+		uring_ = createUring();
+		if (uring_) {
+			uring_->startAccept(sockFd_);
+			uring_->setWakeFd(signalFd_);
+		}
+	}
+	int clientPid;
+	while (mainLoopActive_) {
+		if (!uring_) {
+			pollfd fds[]{ { sockFd_, POLLIN, 0 }, { signalFd_, POLLIN, 0 } };
+			if (poll(fds, 2, -1) == -1) {
+				continue;
+			}
+			if (fds[1].revents & POLLIN) {
+				handleSignals();
+			}
+			if (!(fds[0].revents & POLLIN)) {
+				continue;
+			}
+		}
+		socklen_t length = sizeof(client_);
+		int fd = uring_ ? uring_->accept() : accept(sockFd_, reinterpret_cast<sockaddr *>(&client_), &length);
+		if (fd == -1) {
+			if (uring_ && errno == EINTR) {
+				handleSignals(); // signalfd has become readable
+			}
+			// otherwise the connection was reset while waiting in the queue or taken by another server
+			continue;
+		}
+		if (uring_) {
+			getpeername(fd, reinterpret_cast<sockaddr *>(&client_), &length);
+		}
+		if (passToWorker(fd)) {
+			close(fd);
+			continue;
+		}
+		try {
+			connection_.setFd(fd);
+		}
+		catch (const std::out_of_range &e) {
+			clearPrompt();
+			std::cout << "Error: out of range while trying to call accept() (" << e.what() << ")" << std::endl;
+			printPrompt();
+		}
+		// without a pool or when all workers are full the session gets its own process
+		clientPid = fork();
+		if (clientPid == 0) {
+			isAcceptor_ = false;
+			restoreSignals();
+			closeWorkerChannels();
+			closeAcceptorListeners();
+			// the ring of the acceptor stays with the acceptor, the session makes its own
+			releaseInheritedUring();
+			processNewClient();
+		}
+		else {
+			if (clientPid > 0) {
+				children_.insert(clientPid);
+			}
+			close(fd);
+		}
+	}
+}
+
+std::unique_ptr<UringIo> ChatServer::createUring() const {
+	try {
+		return std::make_unique<UringIo>();
+	}
+	catch (const std::runtime_error &e) {
+		// the kernel may be too old or io_uring may be disabled, the usual system calls still work
+		clearPrompt();
+		std::cout << "Error: " << e.what() << ", using select() and accept()" << std::endl;
+		printPrompt();
+		return nullptr;
+	}
+}
+
+void ChatServer::releaseInheritedUring() {
+	if (uring_) {
+		uring_->abandon();
+		uring_.reset();
+	}
+}
+
+void ChatServer::startWorkers() {
+	auto count = std::stoul(config_.get("WorkerProcesses", DEFAULT_WORKER_PROCESSES));
+	workerSessions_ = std::stoul(config_.get("WorkerSessions", DEFAULT_WORKER_SESSIONS));
+	workers_.assign(count, Worker{ 0, -1, 0 });
+	for (size_t index = 0; index < count; ++index) {
+		spawnWorker(index);
+	}
+}
+
+void ChatServer::spawnWorker(const size_t index) {
+	int channel[2];
+	// datagrams keep the boundaries of connections and reports
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel) == -1) {
+		clearPrompt();
+		std::cout << "Error: can not create channel of worker " << index << " (" << strerror(errno) << ")" << std::endl;
+		printPrompt();
+		return;
+	}
+	auto pid = fork();
+	if (pid == -1) {
+		clearPrompt();
+		std::cout << "Error: can not start worker " << index << " (" << strerror(errno) << ")" << std::endl;
+		printPrompt();
+		close(channel[0]);
+		close(channel[1]);
+		return;
+	}
+	if (pid == 0) {
+		isAcceptor_ = false;
+		restoreSignals();
+		close(channel[0]);
+		closeWorkerChannels();
+		closeAcceptorListeners();
+		// a worker respawned by the acceptor inherits its ring, the first session creates a new one
+		releaseInheritedUring();
+		children_.clear();
+		close(sockFd_);
+		runWorker(channel[1]);
+	}
+	close(channel[1]);
+	workers_[index] = Worker{ pid, channel[0], 0 };
+	children_.insert(pid);
+}
+
+bool ChatServer::passToWorker(const int fd) {
+	if (workers_.empty()) {
+		return false;
+	}
+	// every byte from a worker is a closed session
+	char reports[64];
+	for (auto &worker: workers_) {
+		ssize_t bytes;
+		while (worker.pid > 0 && (bytes = recv(worker.channel, reports, sizeof(reports), MSG_DONTWAIT)) > 0) {
+			worker.sessions -= std::min<size_t>(worker.sessions, bytes);
+		}
+	}
+	std::vector<Worker *> order;
+	for (auto &worker: workers_) {
+		if (worker.pid > 0 && worker.sessions < workerSessions_) {
+			order.push_back(&worker);
+		}
+	}
+	std::stable_sort(order.begin(), order.end(), [](const Worker *a, const Worker *b) { return a->sessions < b->sessions; });
+	for (auto worker: order) {
+		// the address goes as data, the descriptor as SCM_RIGHTS
+		iovec iov{ &client_, sizeof(client_) };
+		char control[CMSG_SPACE(sizeof(int))]{};
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		// a worker which has died and is not reaped yet does not take it, the next one is tried
+		if (sendmsg(worker->channel, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != -1) {
+			++worker->sessions;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ChatServer::closeWorkerChannels() {
+	for (auto &worker: workers_) {
+		if (worker.pid > 0) {
+			close(worker.channel);
+		}
+	}
+	workers_.clear();
+}
+
+void ChatServer::runWorker(const int channel) {
+	isWorker_ = true;
+	clearPrompt();
+	std::cout << "Worker process " << getpid() << " has been started" << std::endl;
+	printPrompt();
+	bool listening = true; // the accepting process may go away, then the worker drains
+	// the accepting process gets one byte for every closed session
+	// switching to a session costs, so only the sessions passing the filter are stepped
+	auto step = [this, channel](const std::function<void(WorkerSession &)> &work, const std::function<bool(int, const WorkerSession &)> &filter) {
+		for (auto it = sessions_.begin(); it != sessions_.end(); ) {
+			if (!filter(it->first, *it->second) || stepSession(*it->second, work)) {
+				++it;
+				continue;
+			}
+			it = sessions_.erase(it);
+			char report = 0;
+			send(channel, &report, sizeof(report), MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+	};
+	while (true) {
+		// SIGUSR1 is for all sessions of the worker
+		wokenUp_ = wakeUp_;
+		wakeUp_ = 0;
+		if (drainRequested_ && sessions_.empty()) {
+			exit(EXIT_SUCCESS);
+		}
+		// a session does its work when its timers or poll interval are due, after its connection was ready and after a signal
+		auto now = std::chrono::steady_clock::now();
+		bool everyone = wokenUp_ || drainRequested_;
+		step([now](WorkerSession &session) {
+			session.due = now + session.loop->prepare();
+		}, [now, everyone](int, const WorkerSession &session) { return everyone || session.due <= now; });
+		auto timeout = MAX_SELECT_TIMEOUT;
+		for (const auto &it: sessions_) {
+			timeout = std::min(timeout, std::chrono::ceil<std::chrono::milliseconds>(std::max(it.second->due - now, std::chrono::steady_clock::duration::zero())));
+		}
+		// descriptors are collected after all sessions have done their work, closed ones are gone by then
+		fd_set rfds, wfds;
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		int maxFd = -1;
+		if (listening) {
+			FD_SET(channel, &rfds);
+			maxFd = channel;
+		}
+		for (const auto &it: sessions_) {
+			it.second->loop->addWaiters(rfds, wfds, maxFd);
+		}
+		struct timeval tv;
+		tv.tv_sec = timeout.count() / 1000;
+		tv.tv_usec = (timeout.count() % 1000) * 1000;
+		auto retval = select(maxFd + 1, &rfds, &wfds, nullptr, &tv);
+		if (retval == -1 && errno == EINTR) {
+			continue; // woken up by a signal
+		}
+		if (retval == -1) {
+			throw std::runtime_error{ std::string{ "An error occured while trying to call select(): " } + strerror(errno) };
+		}
+		if (retval == 0) {
+			continue;
+		}
+		// only sessions with a ready connection are switched to
+		step([&rfds, &wfds](WorkerSession &session) {
+			session.loop->dispatch(rfds, wfds);
+			session.due = {};
+		}, [&rfds, &wfds](int fd, const WorkerSession &) { return FD_ISSET(fd, &rfds) || FD_ISSET(fd, &wfds); });
+		if (listening && FD_ISSET(channel, &rfds) && !receiveConnection(channel)) {
+			listening = false;
+			drainRequested_ = 1;
+		}
+	}
+}
+
+bool ChatServer::receiveConnection(const int channel) {
+	sockaddr_in client{};
+	iovec iov{ &client, sizeof(client) };
+	char control[CMSG_SPACE(sizeof(int))]{};
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	auto bytes = recvmsg(channel, &msg, MSG_DONTWAIT);
+	if (bytes == 0) {
+		return false;
+	}
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	if (bytes != sizeof(client) || cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		return true;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	if (fd >= FD_SETSIZE) {
+		clearPrompt();
+		std::cout << "Error: worker " << getpid() << " has too many descriptors, connection is closed" << std::endl;
+		printPrompt();
+		close(fd);
+		char report = 0;
+		send(channel, &report, sizeof(report), MSG_DONTWAIT | MSG_NOSIGNAL);
+		return true;
+	}
+	auto session = std::make_unique<WorkerSession>();
+	// the new session is started with the members, as in a session process
+	swapSession(session->state);
+	connection_.setFd(fd);
+	client_ = client;
+	startSession();
+	session->loop = std::make_unique<SessionLoop>(*timers_, [this] { return pollSession(wokenUp_); });
+	session->tasks.push_back(watchHeartbeat(*session->loop));
+	session->tasks.push_back(flushOutput(*session->loop));
+	session->tasks.push_back(serveClient(*session->loop));
+	swapSession(session->state);
+	sessions_[fd] = std::move(session);
+	return true;
+}
+
+void ChatServer::swapSession(SessionState &state) {
+	connection_.swap(state.connection);
+	std::swap(client_, state.client);
+	loggedUser_.swap(state.loggedUser);
+	uploads_.swap(state.uploads);
+	outgoingTransfers_.swap(state.outgoingTransfers);
+	timers_.swap(state.timers); // the wheel stays where it is, loops of the sessions refer to it
+	std::swap(lastActivity_, state.lastActivity);
+	std::swap(lastHeard_, state.lastHeard);
+	std::swap(activityFlushed_, state.activityFlushed);
+	recentClientIds_.swap(state.recentClientIds);
+	recentClientIdOrder_.swap(state.recentClientIdOrder);
+	unacknowledged_.swap(state.unacknowledged);
+	undelivered_.swap(state.undelivered);
+	std::swap(history_, state.history);
+	pendingAcks_.swap(state.pendingAcks);
+	std::swap(backlogLimit_, state.backlogLimit);
+	std::swap(summaryPending_, state.summaryPending);
+	std::swap(reportedOutputBytes_, state.reportedOutputBytes);
+}
+
+bool ChatServer::stepSession(WorkerSession &session, const std::function<void(WorkerSession &)> &step) {
+	swapSession(session.state);
+	bool alive = true;
+	try {
+		step(session);
+		// heartbeat and outbound queue end only with an error, the session ends with the requests of the client
+		for (const auto &task: session.tasks) {
+			if (task.done()) {
+				task.rethrow();
+			}
+		}
+		if (session.tasks.back().done()) {
+			alive = false;
+			closeSession();
+		}
+	}
+	catch (const SessionClosed &) {
+		alive = false;
+	}
+	catch (const std::exception &e) {
+		clearPrompt();
+		std::cout << "Error in session of " << getClientIpAndPort() << ": " << e.what() << std::endl;
+		printPrompt();
+		alive = false;
+		try {
+			closeSession();
+		}
+		catch (const SessionClosed &) {
+		}
+	}
+	if (!alive) {
+		// coroutines cancel their timers in the wheel of the session, so they go while it is active
+		session.tasks.clear();
+	}
+	swapSession(session.state);
+	return alive;
+}
+
+void ChatServer::drain(const bool handedOver) {
+	if (draining_) {
+		return;
+	}
+	draining_ = true;
+	mainLoopActive_ = false;
+	clearPrompt();
+	std::cout << (handedOver ? "Listening socket has been handed over to the new server. " : "") <<
+		"Draining: new connections are not accepted, clients are asked to reconnect" << std::endl;
+	// after a handover the sockets stay open in the new server, so no connection waiting in their queues is lost
+	close(sockFd_);
+	closeAcceptorListeners();
+	for (auto pid: { reporterPid_, handoffPid_ }) {
+		if (pid > 0) {
+			kill(pid, SIGTERM);
+		}
+	}
+	auto children = children_;
+	for (auto child: children) {
+		kill(child, SIGUSR2);
+	}
+	waitForChildren();
+	kill(consolePid_, SIGTERM);
+	if (!handedOver) {
+		std::cout << "Removing temporary directory..." << std::endl;
+		fs::remove_all(TEMP_DIR);
+	}
+	std::cout << "Exiting from main process..." << std::endl;
+	exit(EXIT_SUCCESS);
+}
+
+void ChatServer::drainAcceptor() {
+	if (draining_) {
+		return;
+	}
+	draining_ = true;
+	mainLoopActive_ = false;
+	close(sockFd_);
+	auto children = children_;
+	for (auto child: children) {
+		kill(child, SIGUSR2);
+	}
+	waitForChildren();
+	exit(EXIT_SUCCESS);
+}
+
+void ChatServer::waitForChildren() {
+	auto timeout = std::stoul(config_.get("DrainTimeout", DEFAULT_DRAIN_TIMEOUT));
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ timeout };
+	// children are removed from the set when SIGCHLD is read, Ctrl-C stops waiting
+	while (!children_.empty() && std::chrono::steady_clock::now() < deadline) {
+		pollfd pfd{ signalFd_, POLLIN, 0 };
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if (poll(&pfd, 1, std::max<long>(left.count(), 0)) > 0) {
+			handleSignals();
+		}
+	}
+	auto children = children_;
+	for (auto child: children) {
+		kill(child, SIGTERM);
+	}
+}
+
+void ChatServer::drainSession() {
+	clearPrompt();
+	std::cout << "Server is draining, client " << getClientIpAndPort() << " is asked to reconnect" << std::endl;
+	printPrompt();
+	releaseSession();
+	// before login the client reads responses itself, it just sees the connection closed
+	if (!loggedUser_.empty()) {
+		// the session is resumed by its token on any server; clients come back spread over DrainSpread seconds
+		auto spread = std::stoul(config_.get("DrainSpread", DEFAULT_DRAIN_SPREAD));
+		std::random_device random;
+		auto delay = std::uniform_int_distribution<unsigned long>{ 0, spread * 1000 }(random);
+		connection_.send("RECONNECT\n" + std::to_string(delay) + "\n");
+		// one deadline for all sessions of a worker
+		if (drainDeadline_ == std::chrono::steady_clock::time_point{}) {
+			drainDeadline_ = std::chrono::steady_clock::now() + DRAIN_FLUSH_TIMEOUT;
+		}
+		while (connection_.hasOutput() && std::chrono::steady_clock::now() < drainDeadline_) {
+			pollfd pfd{ connection_.getFd(), POLLOUT, 0 };
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(drainDeadline_ - std::chrono::steady_clock::now());
+			if (poll(&pfd, 1, std::max<long>(left.count(), 0)) > 0 && connection_.flush() == -1) {
+				break;
 			}
 		}
 	}
+	close(connection_.getFd());
+	endSession();
+}
+
+void ChatServer::startHandoffServer() {
+	handoffPid_ = fork();
+	if (handoffPid_ != 0) {
+		if (handoffPid_ > 0) {
+			children_.insert(handoffPid_);
+		}
+		return;
+	}
+	restoreSignals();
+	// a new server started with --takeover connects here and gets the listening socket
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, HANDOFF_SOCKET.c_str(), sizeof(address.sun_path) - 1);
+	unlink(HANDOFF_SOCKET.c_str());
+	auto mask = umask(0077); // the listening socket is given only to the same user
+	if (fd == -1 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1 || listen(fd, 1) == -1) {
+		umask(mask);
+		clearPrompt();
+		std::cout << "Error: can not create handoff socket (" << strerror(errno) << "), restart without downtime is not available" << std::endl;
+		printPrompt();
+		exit(EXIT_FAILURE);
+	}
+	umask(mask);
+	while (true) {
+		int client = accept(fd, nullptr, nullptr);
+		if (client == -1) {
+			continue;
+		}
+		ucred credentials{};
+		socklen_t length = sizeof(credentials);
+		if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1 || credentials.uid != getuid()) {
+			close(client);
+			continue;
+		}
+		// all listeners go in one message, the one of the main process first, the presence table last
+		std::vector<int> listeners{ sockFd_ };
+		std::copy_if(acceptorListeners_.begin(), acceptorListeners_.end(), std::back_inserter(listeners),
+			[](int fd) { return fd != -1; });
+		listeners.push_back(presence_->getFd());
+		char data = 0;
+		iovec iov{ &data, sizeof(data) };
+		std::vector<char> control(CMSG_SPACE(listeners.size() * sizeof(int)));
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(listeners.size() * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), listeners.data(), listeners.size() * sizeof(int));
+		if (sendmsg(client, &msg, 0) == -1) {
+			close(client);
+			continue;
+		}
+		close(client);
+		close(fd);
+		// the main process drains and leaves the temporary directory to the new server
+		sigval value{};
+		value.sival_int = HANDOFF_SIGNAL_VALUE;
+		sigqueue(getppid(), SIGUSR2, value);
+		exit(EXIT_SUCCESS);
+	}
+}
+
+std::vector<int> ChatServer::receiveListeners(int &presenceFd) const {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, HANDOFF_SOCKET.c_str(), sizeof(address.sun_path) - 1);
+	if (fd == -1 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1) {
+		throw std::runtime_error{ std::string{ "Can not connect to the running server: " } + strerror(errno) };
+	}
+	char data;
+	iovec iov{ &data, sizeof(data) };
+	char control[CMSG_SPACE((MAX_HANDOFF_LISTENERS + 1) * sizeof(int))]{};
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	auto bytes = recvmsg(fd, &msg, 0);
+	close(fd);
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	if (bytes <= 0 || cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		throw std::runtime_error{ "Running server has not handed over the listening socket" };
+	}
+	std::vector<int> listeners((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+	memcpy(listeners.data(), CMSG_DATA(cmsg), listeners.size() * sizeof(int));
+	// the presence table is the only descriptor which is not a socket
+	presenceFd = -1;
+	auto table = std::find_if(listeners.begin(), listeners.end(), [](int fd) {
+		struct stat status;
+		return fstat(fd, &status) == 0 && !S_ISSOCK(status.st_mode);
+	});
+	if (table != listeners.end()) {
+		presenceFd = *table;
+		listeners.erase(table);
+	}
+	if (listeners.empty()) {
+		throw std::runtime_error{ "Running server has not handed over the listening socket" };
+	}
+	// the backlog may have been changed in the configuration
+	for (auto listener: listeners) {
+		listen(listener, std::stoi(config_.get("ListenBacklog", DEFAULT_LISTEN_BACKLOG)));
+	}
+	std::cout << "Listening sockets (" << listeners.size() << ") have been taken over from the running server" << std::endl;
+	return listeners;
+}
+
+void ChatServer::stopAcceptor() {
+	mainLoopActive_ = false;
+	for (auto child: children_) {
+		kill(child, SIGTERM);
+	}
+	close(sockFd_);
+	exit(EXIT_SUCCESS);
 }
 
 void ChatServer::startConsole() {
@@ -598,64 +1676,1333 @@ void ChatServer::startConsole() {
 			try {
 				kickClient(cmd);
 			}
-			catch (const std::exception &e) {
-				std::cout << "Can not kick client: " << e.what() << std::endl;
+			catch (const std::exception &e) {
+				std::cout << "Can not kick client: " << e.what() << std::endl;
+			}
+		}
+		else if (cmd == "/list") {
+			listActiveUsers();
+		}
+		else if (cmd == "/drain") {
+			// main process stops accepting and waits for sessions to move to other servers
+			kill(getppid(), SIGTERM);
+		}
+		else if (cmd == "/log") {
+			printLineFromLog();
+		}
+		else if (cmd.substr(0, 7) == "/search") {
+			printSearchResults(cmd);
+		}
+		else if (cmd.substr(0, 7) == "/remove") {
+			removeUser(cmd);
+		}
+		printPrompt();
+	}
+}
+
+void ChatServer::printLineFromLog() const {
+	clearPrompt();
+	if (logger_->isEof()) {
+		std::cout << "Error: EOF has been reached" << std::endl;
+		return;
+	}
+	std::cout << logger_->readline() << std::endl;
+}
+
+void ChatServer::cleanExit() {
+	if (mainPid_ != getpid()) {
+		terminateChild();
+		return;
+	}
+	mainLoopActive_ = false;
+	clearPrompt();
+	std::cout << "Killing all children..." << std::endl;
+	for (auto child: children_) {
+		kill(child, SIGTERM);
+	}
+	sleep(2); // Waiting 2 seconds for all children will die
+	clearPrompt();
+	std::cout << "Closing socket..." << std::endl;
+	close(sockFd_);
+	std::cout << "Removing temporary directory..." << std::endl;
+	fs::remove_all(TEMP_DIR);
+	std::cout << "Exiting from main process..." << std::endl;
+	
+	exit(EXIT_SUCCESS);	
+}
+
+void ChatServer::terminateChild() {
+	if (isWorker_) {
+		// called from a signal handler: the loop of the worker flushes and closes its sessions, then exits
+		drainRequested_ = 1;
+		return;
+	}
+	if (connection_.getFd() > 0) {
+		// the handler may interrupt a write of the presence table or a ring operation,
+		// so the session is closed by its loop and not here
+		terminateRequested_ = 1;
+		return;
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+void ChatServer::releaseSession() {
+	applyAcknowledgements();
+	abortUploads();
+	for (auto &it: outgoingTransfers_) {
+		close(it.second.fd);
+	}
+	outgoingTransfers_.clear();
+	leavePresence();
+}
+
+void ChatServer::leavePresence() {
+	if (!loggedUser_.empty()) {
+		presence_->setOffline(users_.at(loggedUser_).getUserId(), getpid(), getClientPort());
+	}
+}
+
+void ChatServer::closeSession() {
+	releaseSession();
+	strcpy(message_, "/response:kick");
+	if (connection_.send(message_) == -1) {
+		std::cerr << "Error while calling write: " << strerror(errno) << std::endl;
+	}
+	close(connection_.getFd());
+	endSession();
+}
+
+void ChatServer::endSession() const {
+	if (isWorker_) {
+		throw SessionClosed{};
+	}
+	exit(EXIT_SUCCESS);
+}
+
+void ChatServer::blockSignals() {
+	// the main process and the acceptors read these signals from signalfd in their loops,
+	// so the handlers run between accept() calls and not in the middle of the console output or a query
+	sigset_t signals;
+	sigemptyset(&signals);
+	for (auto signum: LOOP_SIGNALS) {
+		sigaddset(&signals, signum);
+	}
+	if (sigprocmask(SIG_BLOCK, &signals, nullptr) == -1) {
+		throw std::runtime_error{ std::string{ "Can not block signals: " } + strerror(errno) };
+	}
+	signalFd_ = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signalFd_ == -1) {
+		throw std::runtime_error{ std::string{ "Can not create signalfd: " } + strerror(errno) };
+	}
+}
+
+void ChatServer::restoreSignals() {
+	// console, reporter and sessions wait for the signals with the usual handlers
+	close(signalFd_);
+	signalFd_ = -1;
+	sigset_t signals;
+	sigemptyset(&signals);
+	for (auto signum: LOOP_SIGNALS) {
+		sigaddset(&signals, signum);
+	}
+	sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+}
+
+void ChatServer::handleSignals() {
+	signalfd_siginfo info;
+	bool childExited = false;
+	int stopSignal = 0;
+	bool handedOver = false;
+	// a burst of signals is read at once, several SIGCHLD are merged by the kernel anyway
+	while (read(signalFd_, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGCHLD) {
+			childExited = true;
+		}
+		else if (stopSignal != SIGINT) {
+			// Ctrl-C wins over a graceful stop
+			stopSignal = info.ssi_signo;
+			handedOver = info.ssi_signo == SIGUSR2 && info.ssi_code == SI_QUEUE &&
+				static_cast<int>(info.ssi_int) == HANDOFF_SIGNAL_VALUE;
+		}
+	}
+	if (childExited) {
+		reapChildren();
+	}
+	switch (stopSignal) {
+	case SIGINT:
+		sigIntHandler(SIGINT);
+		break;
+	case SIGTERM:
+		sigTermHandler(SIGTERM);
+		break;
+	case SIGUSR2:
+		drainHandler(SIGUSR2, handedOver);
+		break;
+	}
+}
+
+void ChatServer::reapChildren() {
+	std::vector<pid_t> exited;
+	bool consoleExited = false;
+	pid_t pid;
+	while ((pid = waitpid(-1, nullptr, WNOHANG)) > 0) {
+		if (pid == consolePid_) {
+			consoleExited = true;
+			continue;
+		}
+		exited.push_back(pid);
+		children_.erase(pid);
+		auto worker = std::find_if(workers_.begin(), workers_.end(), [pid](const Worker &worker) { return worker.pid == pid; });
+		if (worker != workers_.end()) {
+			// sessions of the worker are lost, their clients reconnect to other workers
+			close(worker->channel);
+			worker->pid = 0;
+			if (!draining_ && mainLoopActive_) {
+				clearPrompt();
+				std::cout << "Worker process " << pid << " has exited, starting a new one" << std::endl;
+				printPrompt();
+				spawnWorker(worker - workers_.begin());
+			}
+		}
+	}
+	if (!exited.empty()) {
+		// sessions of crashed children must not stay online; the reporter writes the whole batch
+		// to `active_sessions` in one transaction
+		auto generation = presence_->getGeneration();
+		presence_->clearPids(exited);
+		if (presence_->getGeneration() != generation && reporterPid_ > 0) {
+			kill(reporterPid_, SIGUSR1);
+		}
+	}
+	if (consoleExited && !draining_) {
+		cleanExit();
+	}
+}
+
+void ChatServer::startSessionTimers() {
+	// the wheel starts with the session, not with the server
+	*timers_ = TimerWheel{ TIMER_TICK };
+	lastActivity_ = TimerWheel::Clock::now();
+	timers_->schedule(UNREAD_CHECK_INTERVAL, [this] { onUnreadCheckTimer(); });
+	auto idleTimeout = std::chrono::seconds{ std::stoul(config_.get("IdleTimeout", DEFAULT_IDLE_TIMEOUT)) };
+	if (idleTimeout.count() > 0) {
+		timers_->schedule(idleTimeout, [this, idleTimeout] { onIdleTimer(idleTimeout); });
+	}
+	auto flushInterval = std::chrono::seconds{ std::stoul(config_.get("ActivityFlushInterval", DEFAULT_ACTIVITY_FLUSH_INTERVAL)) };
+	timers_->schedule(flushInterval, [this, flushInterval] { onActivityFlushTimer(flushInterval); });
+	lastHeard_ = lastActivity_;
+	heartbeatInterval_ = std::chrono::seconds{ std::stoul(config_.get("HeartbeatInterval", DEFAULT_HEARTBEAT_INTERVAL)) };
+	heartbeatMisses_ = std::stoul(config_.get("HeartbeatMisses", DEFAULT_HEARTBEAT_MISSES));
+}
+
+void ChatServer::closeDeadSession(const std::string &reason) {
+	clearPrompt();
+	std::cout << "Client " << getClientIpAndPort() << " " << reason << ", closing the session" << std::endl;
+	printPrompt();
+	// nothing is written to the peer: a dead connection with full buffers would block the process
+	releaseSession();
+	close(connection_.getFd());
+	endSession();
+}
+
+void ChatServer::markActivity() {
+	// only memory is touched here, database gets it from the flush timer
+	lastActivity_ = TimerWheel::Clock::now();
+	activityFlushed_ = false;
+	if (!loggedUser_.empty()) {
+		presence_->touch(users_.at(loggedUser_).getUserId());
+	}
+}
+
+void ChatServer::checkUnread() {
+	try {
+		checkUnreadMessages();
+	}
+	catch (const std::logic_error &e) {
+		std::cout << "Logic error: " << e.what() << std::endl;
+	}
+}
+
+void ChatServer::onUnreadCheckTimer() {
+	if (!loggedUser_.empty()) {
+		checkUnread();
+	}
+	timers_->schedule(UNREAD_CHECK_INTERVAL, [this] { onUnreadCheckTimer(); });
+}
+
+void ChatServer::onIdleTimer(const std::chrono::seconds idleTimeout) {
+	// the timer is not moved on every request: it checks the last activity and sleeps for the rest
+	auto idle = TimerWheel::Clock::now() - lastActivity_;
+	if (idle < idleTimeout) {
+		timers_->schedule(std::chrono::ceil<std::chrono::milliseconds>(idleTimeout - idle), [this, idleTimeout] { onIdleTimer(idleTimeout); });
+		return;
+	}
+	clearPrompt();
+	std::cout << "Client " << getClientIpAndPort() << " has been idle for " << idleTimeout.count() << " seconds, disconnecting" << std::endl;
+	printPrompt();
+	sendNotice("You have been disconnected after " + std::to_string(idleTimeout.count()) + " seconds of inactivity");
+	closeSession();
+}
+
+void ChatServer::onActivityFlushTimer(const std::chrono::seconds flushInterval) {
+	// at most one UPDATE per interval and only when something has happened
+	if (!activityFlushed_ && !loggedUser_.empty()) {
+		activityFlushed_ = true;
+		try {
+			Mysql mysql;
+			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+			auto session = presence_->get(users_.at(loggedUser_).getUserId());
+			if (session) {
+				std::stringstream ss;
+				ss << "UPDATE `active_sessions` SET `last_activity` = FROM_UNIXTIME(" << session->last_activity << ") WHERE "
+					"`user_id` = " << session->user_id << " AND `pid` = " << getpid();
+				mysql.query(ss.str());
+			}
+		}
+		catch (const std::runtime_error &e) {
+			clearPrompt();
+			std::cout << "Error: can not update last activity field in the database (" << e.what() << ")" << std::endl;
+			printPrompt();
+		}
+	}
+	timers_->schedule(flushInterval, [this, flushInterval] { onActivityFlushTimer(flushInterval); });
+}
+
+bool ChatServer::isSessionClosed() const {
+	if (loggedUser_.empty()) {
+		return false;
+	}
+	auto session = presence_->get(users_.at(loggedUser_).getUserId());
+	return !session || session->pid != getpid() || session->port != getClientPort() || session->state == PresenceTable::State::KICKED;
+}
+
+void ChatServer::wakeUpHandler(int signum) {
+	wakeUp_ = 1;
+}
+
+void ChatServer::sigIntHandler(int signum) {
+	if (isAcceptor_) {
+		stopAcceptor();
+	}
+	else if (mainPid_ != getpid()) {
+		terminateChild();
+	}
+	else {
+		std::cout << "\nCaught interrupt signal!" << std::endl;
+		kill(consolePid_, SIGTERM);
+		cleanExit();
+	}
+}
+
+void ChatServer::sigTermHandler(int signum) {
+	if (isAcceptor_) {
+		stopAcceptor();
+	}
+	else if (mainPid_ != getpid()) {
+		terminateChild();
+	}
+	else {
+		std::cout << "\nCaught terminate signal!" << std::endl;
+		drain(false);
+	}
+}
+
+void ChatServer::drainHandler(int signum, const bool handedOver) {
+	if (mainPid_ == getpid()) {
+		drain(handedOver);
+	}
+	else if (isAcceptor_) {
+		drainAcceptor();
+	}
+	else {
+		drainRequested_ = 1; // the session loop finishes the session
+	}
+}
+
+void ChatServer::processNewClient() {
+	startSession();
+	// the session is coroutines: requests of the client, writing of the outbound queue and the heartbeat
+	SessionLoop loop{ *timers_, [this] {
+		bool wokenUp = wakeUp_;
+		wakeUp_ = 0;
+		return pollSession(wokenUp);
+	} };
+	auto heartbeat = watchHeartbeat(loop);
+	auto output = flushOutput(loop);
+	auto session = serveClient(loop);
+	loop.run(session);
+	closeSession();
+}
+
+void ChatServer::startSession() {
+	clearPrompt();
+	std::cout << "Client connected from " << getClientIpAndPort() << std::endl;
+	printPrompt();
+
+	if (useUring_) {
+		// a worker has one ring for all its sessions
+		if (!uring_) {
+			uring_ = createUring();
+		}
+		connection_.setUring(uring_.get());
+	}
+	connection_.setOutputLimits(
+		std::stoul(config_.get("OutboundQueueBytes", DEFAULT_OUTBOUND_QUEUE_BYTES)),
+		std::stoul(config_.get("OutboundQueueFrames", DEFAULT_OUTBOUND_QUEUE_FRAMES)));
+	slowConsumerPolicy_ = slowConsumerPolicyFromString(config_.get("SlowConsumerPolicy", "coalesce"));
+	startSessionTimers();
+}
+
+std::chrono::milliseconds ChatServer::pollSession(const bool wokenUp) {
+	if (terminateRequested_ || isSessionClosed()) {
+		closeSession();
+	}
+	if (drainRequested_) {
+		drainSession();
+	}
+	if (!loggedUser_.empty() && wokenUp) {
+		checkUnread();
+	}
+	pumpTransfers();
+	enforceOutputLimits();
+	// while transfers are streamed the loop must come back soon
+	return outgoingTransfers_.empty() ? MAX_SELECT_TIMEOUT : TRANSFER_SELECT_TIMEOUT;
+}
+
+SessionLoop::Task ChatServer::serveClient(SessionLoop &loop) {
+	std::string request;
+	bool connected = true;
+	while (true) {
+		// handshake: login check, compression, sign up, then sign in or resume of a session
+		while (loggedUser_.empty()) {
+			co_await readRequest(loop, request, connected);
+			if (!connected || !handleHandshake(request)) {
+				co_return;
+			}
+		}
+		// requests of the user until logout, the handshake starts again then
+		while (!loggedUser_.empty()) {
+			co_await readRequest(loop, request, connected);
+			if (!connected) {
+				co_return;
+			}
+			try {
+				if (!handleRequest(request)) {
+					co_return;
+				}
+			}
+			catch (std::invalid_argument e) {
+				// exception handling
+				std::cout << "Error: " << e.what() << "\n" << std::endl;
+			}
+		}
+	}
+}
+
+SessionLoop::Task ChatServer::readRequest(SessionLoop &loop, std::string &request, bool &connected) {
+	// messages of an already received batch do not need select()
+	if (!connection_.hasPending()) {
+		co_await loop.readable(connection_.getFd());
+	}
+	request.clear();
+	std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+	auto bytes = connection_.receive(request);
+	if (bytes == -1) {
+		throw std::runtime_error{
+			std::string{ "Error while reading from socket: " } + 
+			std::string{ strerror(errno) } 
+		};
+	}
+	if (bytes == 0) {
+		clearPrompt();
+		std::cout << "Client with address " << getClientIpAndPort() << " has been disconnected" << std::endl;
+		printCompressionStatistics();
+		printOutputStatistics();
+		std::cout << std::endl;
+		printPrompt();
+		connected = false;
+	}
+}
+
+SessionLoop::Task ChatServer::flushOutput(SessionLoop &loop) {
+	while (true) {
+		if (!connection_.hasOutput()) {
+			co_await loop.next();
+			continue;
+		}
+		co_await loop.writable(connection_.getFd());
+		if (connection_.flush() == -1) {
+			// the connection is broken, reading from it ends the session
+			clearPrompt();
+			std::cout << "Error while writing to socket: " << strerror(errno) << std::endl;
+			printPrompt();
+			co_return;
+		}
+	}
+}
+
+ChatServer::SlowConsumerPolicy ChatServer::slowConsumerPolicyFromString(const std::string &name) {
+	if (name == "drop-oldest") {
+		return SlowConsumerPolicy::DROP_OLDEST;
+	}
+	if (name == "disconnect") {
+		return SlowConsumerPolicy::DISCONNECT;
+	}
+	return SlowConsumerPolicy::COALESCE;
+}
+
+void ChatServer::enforceOutputLimits() {
+	if (connection_.isOutputOverLimit()) {
+		// only frames of delivered messages are dropped, responses to requests always stay
+		std::vector<uint64_t> dropped;
+		if (slowConsumerPolicy_ == SlowConsumerPolicy::DROP_OLDEST) {
+			// dropped messages stay unread in the database and come again with /unread or after reconnect
+			dropped = connection_.dropOutput(true);
+		}
+		else if (slowConsumerPolicy_ == SlowConsumerPolicy::COALESCE) {
+			// dropped messages become a part of the backlog, the client gets the summary and fetches them with /unread
+			dropped = connection_.dropOutput(false);
+			if (!dropped.empty()) {
+				backlogLimit_ = std::max<unsigned long long>(backlogLimit_, *std::max_element(dropped.begin(), dropped.end()));
+				summaryPending_ = true;
+			}
+		}
+		for (auto id: dropped) {
+			unacknowledged_.erase(id);
+			undelivered_.insert(id);
+		}
+		if (!dropped.empty()) {
+			clearPrompt();
+			std::cout << "Client " << getClientIpAndPort() << " is slow, " << dropped.size() << " messages dropped from the outbound queue" << std::endl;
+			printPrompt();
+		}
+		if (connection_.isOutputOverLimit()) {
+			closeDeadSession("does not read its messages");
+		}
+	}
+	// queue depth is published for /list only when it changes
+	if (!loggedUser_.empty() && connection_.getOutputBytes() != reportedOutputBytes_) {
+		reportedOutputBytes_ = connection_.getOutputBytes();
+		presence_->setOutbound(users_.at(loggedUser_).getUserId(), reportedOutputBytes_);
+	}
+}
+
+SessionLoop::Task ChatServer::watchHeartbeat(SessionLoop &loop) {
+	if (heartbeatInterval_.count() == 0) {
+		co_return;
+	}
+	while (true) {
+		co_await loop.sleep(heartbeatInterval_);
+		auto silence = TimerWheel::Clock::now() - lastHeard_;
+		// pings go to logged users only: before login the client reads responses itself and does not expect them
+		if (!loggedUser_.empty()) {
+			if (silence >= heartbeatInterval_ * heartbeatMisses_) {
+				closeDeadSession("does not answer pings");
+			}
+			// the peer may be dead already, so the ping must not block: it is skipped
+			// while earlier output is still queued or the socket does not take more
+			pollfd writable{ connection_.getFd(), POLLOUT, 0 };
+			if (silence >= heartbeatInterval_ && !connection_.hasOutput() &&
+				poll(&writable, 1, 0) == 1 && (writable.revents & POLLOUT)) {
+				connection_.send("PING\n");
+			}
+		}
+	}
+}
+
+bool ChatServer::acceptFrame(const std::string &request) {
+	strncpy(message_, request.c_str(), MESSAGE_LENGTH - 1);
+	// any frame proves that the client is alive
+	lastHeard_ = TimerWheel::Clock::now();
+	if (strcmp(message_, "/ping") == 0) {
+		connection_.send("PONG\n");
+		return false;
+	}
+	if (strcmp(message_, "/pong") == 0) {
+		return false;
+	}
+	if (strncmp(message_, "/ack:", 5) != 0) {
+		// automatic frames of the client are not user activity
+		markActivity();
+	}
+
+	clearPrompt();
+	std::cout << "Received " << request.length() << " bytes: " << message_ << std::endl;
+	printPrompt();
+	return true;
+}
+
+bool ChatServer::handleHandshake(const std::string &request) {
+	// requests of a user are not served before login
+	if (request.compare(0, 10, "/transfer:") == 0 || !acceptFrame(request)) {
+		return true;
+	}
+	if (strncmp(message_, "/checklogin", 11) == 0) {
+		checkLogin();
+	}
+	else if (strncmp(message_, "/compress", 9) == 0) {
+		negotiateCompression();
+	}
+	else if (strncmp(message_, "/signup", 7) == 0) {
+		signUp();
+	}
+	else if (strncmp(message_, "/signin", 7) == 0) {
+		signIn();
+	}
+	else if (strncmp(message_, "/resume", 7) == 0) {
+		resumeSession();
+	}
+	else if (strncmp(message_, "/exit", 5) == 0 || strncmp(message_, "/quit", 5) == 0) {
+		return false;
+	}
+	return true;
+}
+
+bool ChatServer::handleRequest(const std::string &request) {
+	if (request.compare(0, 10, "/transfer:") == 0) {
+		// chunks are binary and may be longer than message buffer
+		receiveTransfer(request);
+		return true;
+	}
+	if (!acceptFrame(request)) {
+		return true;
+	}
+	if (strncmp(message_, "/checklogin", 11) == 0) {
+		checkLogin();
+	}
+	else if (strncmp(message_, "/compress", 9) == 0) {
+		// compression negotiation
+		negotiateCompression();
+	}
+	else if (strncmp(message_, "/signup", 7) == 0) {
+		// registration
+		signUp();
+	}
+	else if (strncmp(message_, "/signin", 7) == 0) {
+		// authorization
+		signIn();
+	}
+	else if (strncmp(message_, "/resume", 7) == 0) {
+		// authorization by session token
+		resumeSession();
+	}
+	else if (strncmp(message_, "/logout", 7) == 0) {
+		// logout, the session can not be resumed any more
+		removeSessionTokens();
+		signOut();
+	}
+	else if (strncmp(message_, "/remove", 7) == 0) {
+		// removing current user
+		if (!loggedUser_.empty()) {
+			removeUser();
+		}
+	}
+	else if (strncmp(message_, "/history", 8) == 0) {
+		// page of message history
+		if (!loggedUser_.empty()) {
+			sendHistory();
+		}
+	}
+	else if (strncmp(message_, "/search", 7) == 0) {
+		// full-text search
+		if (!loggedUser_.empty()) {
+			sendSearchResults();
+		}
+	}
+	else if (strncmp(message_, "/since", 6) == 0) {
+		// messages of conversation after given sequence number
+		if (!loggedUser_.empty()) {
+			sendSince();
+		}
+	}
+	else if (strncmp(message_, "/sync", 5) == 0) {
+		// missed messages after reconnect
+		if (!loggedUser_.empty()) {
+			sendSync();
+		}
+	}
+	else if (strncmp(message_, "/join", 5) == 0) {
+		if (!loggedUser_.empty()) {
+			joinChannel();
+		}
+	}
+	else if (strncmp(message_, "/leave", 6) == 0) {
+		if (!loggedUser_.empty()) {
+			leaveChannel();
+		}
+	}
+	else if (strncmp(message_, "/channels", 9) == 0) {
+		if (!loggedUser_.empty()) {
+			listChannels();
+		}
+	}
+	else if (
+		strncmp(message_, "/exit", 5) == 0 ||
+		strncmp(message_, "/quit", 5) == 0) {
+		// closing the program
+		return false;
+	}
+	else if (strncmp(message_, "/unread", 7) == 0) {
+		// login summary or next page of unread messages of a conversation
+		if (!loggedUser_.empty()) {
+			sendUnread();
+		}
+	}
+	else if (strncmp(message_, "/ack:", 5) == 0) {
+		// delivery acknowledgements, no response
+		if (!loggedUser_.empty()) {
+			receiveAcknowledgements();
+		}
+	}
+	else if (strncmp(message_, "/send:", 6) == 0) {
+		// message with client id: /send:<client id>:<text>
+		if (!loggedUser_.empty()) {
+			std::string clientId{ request.substr(6, request.find(':', 6) - 6) };
+			std::string text{ request.find(':', 6) == std::string::npos ? std::string{} : request.substr(request.find(':', 6) + 1) };
+			if (!isValidClientId(clientId) || isKnownClientId(clientId)) {
+				return true; // duplicate of a message stored in this session
+			}
+			std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
+			strncpy(message_, text.c_str(), MESSAGE_LENGTH - 1);
+			sendMessage(clientId);
+		}
+	}
+	else if (!loggedUser_.empty()) {
+		// if there is an authorized user, we send a message
+		sendMessage(std::string{});
+	}	
+	return true;
+}
+
+std::string ChatServer::previousSequenceColumn() const {
+	// own messages of the user are never delivered back, so they must not look like gaps
+	std::stringstream ss;
+	ss << "COALESCE((SELECT MAX(`previous`.`seq`) FROM `messages` AS `previous` WHERE "
+		"`previous`.`conversation` = `messages`.`conversation` AND "
+		"`previous`.`seq` < `messages`.`seq` AND "
+		"`previous`.`sender` <> " << users_.at(loggedUser_).getUserId() << "), 0)";
+	return ss.str();
+}
+
+void ChatServer::checkUnreadMessages() {	
+	applyAcknowledgements();
+	if (summaryPending_) {
+		summaryPending_ = false;
+		sendUnreadSummary();
+	}
+	try {
+		Mysql mysql;
+		try {
+			std::stringstream ss;
+			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+			ss << 
+				"SELECT "
+					"`receiver_users`.`login`, "
+					"`messages`.`text`, "
+					"`unread_users`.`id`, "
+					"`messages`.`id`, "
+					"`sender_users`.`login`, "
+					"COALESCE(`transfers`.`kind`, ''), "
+					"`transfers`.`name`, "
+					"`transfers`.`size`, "
+					"COALESCE(`transfers`.`hash`, ''), "
+					"`messages`.`type`, "
+					"COALESCE(`messages`.`conversation`, ''), "
+					"COALESCE(`messages`.`seq`, 0), "
+					<< previousSequenceColumn() << " "
+				"FROM "
+					"`unread_messages` "
+				"JOIN "
+					"`messages` ON `messages`.`id` = `unread_messages`.`message_id` "
+				"JOIN "
+					"`users` AS `unread_users` ON `unread_messages`.`user_id` = `unread_users`.`id` "
+				"JOIN "
+					"`users` AS `sender_users` ON `messages`.`sender` = `sender_users`.`id` "
+				"LEFT JOIN "
+					"`users` AS `receiver_users` ON `messages`.`receiver` = `receiver_users`.`id` "
+				"LEFT JOIN "
+					"`transfers` ON `transfers`.`message_id` = `messages`.`id` "
+				"WHERE "
+					"`unread_users`.`login` = '" << loggedUser_ << "' AND "
+					// files are streamed in background, other messages of the backlog are fetched with /unread.
+					// Old messages without conversation are not counted by the summary and can not be paged, so they are pushed
+					"(`messages`.`id` > " << backlogLimit_ << " OR `transfers`.`message_id` IS NOT NULL OR `messages`.`conversation` IS NULL) "
+				"ORDER BY `messages`.`id`";
+			mysql.query(ss.str());
+			auto rows = mysql.fetchAll();
+			// streamed messages and files are delivered chunk by chunk from the spool
+			rows.remove_if([this](const std::vector<std::string> &row) {
+				if (row[5].empty()) {
+					// sent already, waiting for acknowledgement, or dropped from the queue
+					auto messageId = std::stoull(row[3]);
+					return unacknowledged_.count(messageId) != 0 || undelivered_.count(messageId) != 0;
+				}
+				auto messageId = std::stoull(row[3]);
+				if (outgoingTransfers_.find(messageId) == outgoingTransfers_.end()) {
+					std::string position{ row[10].empty() ? std::string{} : row[11] + ":" + row[12] + ":" + row[3] };
+					startOutgoingTransfer(messageId, row[5], row[4], row[6], std::stoull(row[7]), row[8], row[10], position);
+				}
+				return true;
+			});
+			// the whole backlog is one batch in the message store arena
+			messages_.clear();
+			std::vector<std::string> legacy; // messages without conversation can not be acknowledged
+			for (const auto &row: rows) {
+				size_t index;
+				if (row[9] == "BROADCAST") {
+					RecipientSet recipient;
+					recipient.set(std::stoi(row[2]));
+					index = messages_.addBroadcast(row[4], row[1], recipient);
+				}
+				else {
+					// messages for several users have no single receiver
+					index = messages_.addPrivate(row[4], row[0].empty() ? loggedUser_ : row[0], row[1]);
+				}
+				if (!row[10].empty()) {
+					messages_.setSequence(index, row[10], std::stoull(row[11]), std::stoull(row[12]), std::stoull(row[3]));
+					unacknowledged_.insert(std::stoull(row[3]));
+				}
+				else {
+					legacy.push_back(row[3]);
+				}
+			}
+			// the backlog goes to the client in one frame
+			std::vector<std::string> frames;
+			for (size_t i = 0; i < messages_.size(); ++i) {
+				frames.push_back(messages_.createTransferString(i));
+			}
+			// channel messages are stored once and read by the member's cursor
+			auto userId = users_.at(loggedUser_).getUserId();
+			ss.str(std::string{});
+			ss <<
+				"SELECT "
+					"`channel_members`.`channel_id`, "
+					"`channels`.`name`, "
+					"`messages`.`id`, "
+					"`messages`.`sender`, "
+					"`sender_users`.`login`, "
+					"`messages`.`text`, "
+					"COALESCE(`messages`.`seq`, 0), "
+					<< previousSequenceColumn() << " "
+				"FROM "
+					"`channel_members` "
+				"JOIN "
+					"`messages` ON `messages`.`channel` = `channel_members`.`channel_id` AND "
+					"`messages`.`id` > `channel_members`.`last_read_id` "
+				"JOIN "
+					"`channels` ON `channels`.`id` = `channel_members`.`channel_id` "
+				"JOIN "
+					"`users` AS `sender_users` ON `messages`.`sender` = `sender_users`.`id` "
+				"WHERE "
+					"`channel_members`.`user_id` = " << userId << " AND "
+					// channel is read by cursor, so while it has a backlog its new messages wait for /unread too
+					"NOT EXISTS (SELECT 1 FROM `messages` AS `backlog` WHERE "
+						"`backlog`.`channel` = `channel_members`.`channel_id` AND "
+						"`backlog`.`id` > `channel_members`.`last_read_id` AND "
+						"`backlog`.`id` <= " << backlogLimit_ << " AND "
+						"`backlog`.`sender` <> " << userId << ") "
+				"ORDER BY `messages`.`id`";
+			mysql.query(ss.str());
+			std::vector<uint64_t> channelIds;
+			for (const auto &row: mysql.fetchAll()) {
+				auto messageId = std::stoull(row[2]);
+				if (unacknowledged_.count(messageId) != 0 || undelivered_.count(messageId) != 0) {
+					continue;
+				}
+				if (std::stoul(row[3]) == userId) {
+					// own messages only move the cursor
+					pendingAcks_.push_back(messageId);
+					continue;
+				}
+				unacknowledged_.insert(messageId);
+				channelIds.push_back(messageId);
+				frames.push_back("CHANNEL\n" + Conversation::channel(row[1]) + '\n' + row[6] + ':' + row[7] + ':' + row[2] + '\n' + row[4] + '\n' + row[5] + '\n');
+			}
+			// a batch of acknowledgeable messages may be dropped from the queue of a slow client
+			std::vector<uint64_t> tags;
+			if (legacy.empty()) {
+				for (const auto &row: rows) {
+					tags.push_back(std::stoull(row[3]));
+				}
+				tags.insert(tags.end(), channelIds.begin(), channelIds.end());
+			}
+			if (connection_.sendBatch(frames, tags) == -1) {
+				// nothing has been delivered, try again next time
+				for (const auto &row: rows) {
+					unacknowledged_.erase(std::stoull(row[3]));
+				}
+				messages_.clear();
+				return;
+			}
+			// rows are deleted only when the client confirms them, except old messages without ids
+			if (!legacy.empty()) {
+				ss.str(std::string{});
+				ss << "DELETE FROM `unread_messages` WHERE `user_id` = " << userId << " AND `message_id` IN (";
+				for (size_t i = 0; i < legacy.size(); ++i) {
+					ss << (i == 0 ? "" : ", ") << legacy[i];
+				}
+				ss << ")";
+				mysql.query(ss.str());
+			}
+			messages_.clear();
+		}
+		catch (const std::runtime_error &e) {
+			clearPrompt();
+			std::cout << "Error: can not load unread messages from database (" << e.what() << ")" << std::endl;
+			printPrompt();
+		}
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		printPrompt();
+	}
+
+}
+
+size_t ChatServer::sendUnreadSummary() {
+	// counters are materialized, so the summary costs one indexed read whatever the backlog is
+	std::vector<std::string> frames;
+	try {
+		Mysql mysql;
+		mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+		std::stringstream ss;
+		ss << "SELECT `conversation`, `count` FROM `unread_counters` WHERE "
+			"`user_id` = " << users_.at(loggedUser_).getUserId() << " AND `count` > 0 "
+			"ORDER BY `conversation`";
+		if (!mysql.query(ss.str())) {
+			throw std::runtime_error{ mysql.getError() };
+		}
+		for (const auto &row: mysql.fetchAll()) {
+			frames.push_back("UNREAD\n" + row.at(0) + '\n' + row.at(1) + '\n');
+		}
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not load unread counters (" << e.what() << ")" << std::endl;
+		printPrompt();
+	}
+	connection_.sendBatch(frames);
+	return frames.size();
+}
+
+void ChatServer::sendUnread() {
+	// 0: cmd, 1: conversation; without conversation the summary is sent again
+	auto tokens = Chat::split(std::string{ message_ }, ":");
+	if (tokens.size() < 2 || tokens[1].empty()) {
+		auto count = sendUnreadSummary();
+		connection_.send("/response:unread:" + std::to_string(count));
+		return;
+	}
+	if (!isValidConversation(tokens[1])) {
+		connection_.send("/response:fail");
+		return;
+	}
+	const auto &conversation = tokens[1];
+	// frames of the previous page may be not acknowledged yet
+	applyAcknowledgements();
+	std::vector<std::string> frames;
+	bool more = false;
+	try {
+		Mysql mysql;
+		mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+		auto userId = users_.at(loggedUser_).getUserId();
+		std::stringstream ss;
+		ss << "SELECT "
+				"`messages`.`id`, "
+				"`messages`.`type`, "
+				"`messages`.`seq`, "
+				<< previousSequenceColumn() << ", "
+				"`sender_users`.`login`, "
+				"`messages`.`text`, "
+				"`messages`.`sender` "
+			"FROM `messages` "
+			"JOIN `users` AS `sender_users` ON `sender_users`.`id` = `messages`.`sender` ";
+		if (conversation[0] == '#') {
+			ss << "JOIN `channel_members` ON `channel_members`.`channel_id` = `messages`.`channel` AND "
+					"`channel_members`.`user_id` = " << userId << " AND "
+					"`messages`.`id` > `channel_members`.`last_read_id` ";
+		}
+		else {
+			ss << "JOIN `unread_messages` ON `unread_messages`.`message_id` = `messages`.`id` AND "
+					"`unread_messages`.`user_id` = " << userId << " "
+				"LEFT JOIN `transfers` ON `transfers`.`message_id` = `messages`.`id` ";
+		}
+		ss << "WHERE `messages`.`conversation` = '" << conversation << "'";
+		if (conversation[0] != '#') {
+			ss << " AND `transfers`.`message_id` IS NULL";
+		}
+		if (!unacknowledged_.empty()) {
+			ss << " AND `messages`.`id` NOT IN (";
+			for (auto it = unacknowledged_.begin(); it != unacknowledged_.end(); ++it) {
+				ss << (it == unacknowledged_.begin() ? "" : ", ") << *it;
+			}
+			ss << ")";
+		}
+		// one row more tells whether there is another page
+		ss << " ORDER BY `messages`.`id` LIMIT " << HISTORY_PAGE_LENGTH + 1;
+		if (!mysql.query(ss.str())) {
+			throw std::runtime_error{ mysql.getError() };
+		}
+		auto rows = mysql.fetchAll();
+		if (rows.size() > HISTORY_PAGE_LENGTH) {
+			more = true;
+			rows.pop_back();
+		}
+		for (const auto &row: rows) {
+			auto messageId = std::stoull(row[0]);
+			if (std::stoul(row[6]) == userId) {
+				// own channel messages only move the cursor
+				pendingAcks_.push_back(messageId);
+				continue;
+			}
+			unacknowledged_.insert(messageId);
+			undelivered_.erase(messageId);
+			frames.push_back(row[1] + '\n' + conversation + '\n' + row[2] + ':' + row[3] + ':' + row[0] + '\n' + row[4] + '\n' + row[5] + '\n');
+		}
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not load unread messages (" << e.what() << ")" << std::endl;
+		printPrompt();
+		connection_.send("/response:fail");
+		return;
+	}
+	auto count = frames.size();
+	frames.push_back("/response:unread:" + std::to_string(count) + ":" + (more ? "1" : "0"));
+	connection_.sendBatch(frames);
+}
+
+void ChatServer::receiveAcknowledgements() {
+	// /ack:id,id,...
+	auto tokens = Chat::split(message_, ":");
+	if (tokens.size() != 2) {
+		return;
+	}
+	for (const auto &id: Chat::split(tokens[1], ",")) {
+		if (!isNumber(id)) {
+			continue;
+		}
+		pendingAcks_.push_back(std::stoull(id));
+	}
+	if (pendingAcks_.size() >= MAX_PENDING_ACKS) {
+		applyAcknowledgements();
+	}
+}
+
+void ChatServer::decreaseUnreadCounters(Mysql &mysql, const unsigned userId, const std::string &ids) const {
+	// only messages which are still unread are counted, repeated acks do not change counters
+	std::stringstream ss;
+	ss << "UPDATE `unread_counters` JOIN ("
+			"SELECT `messages`.`conversation`, COUNT(*) AS `read_count` FROM `messages` "
+			"WHERE `messages`.`id` IN (" << ids << ") AND `messages`.`conversation` IS NOT NULL AND ("
+				"EXISTS (SELECT 1 FROM `unread_messages` WHERE `unread_messages`.`message_id` = `messages`.`id` AND "
+					"`unread_messages`.`user_id` = " << userId << ") OR "
+				"EXISTS (SELECT 1 FROM `channel_members` WHERE `channel_members`.`channel_id` = `messages`.`channel` AND "
+					"`channel_members`.`user_id` = " << userId << " AND `channel_members`.`last_read_id` < `messages`.`id` AND "
+					"`messages`.`sender` <> " << userId << ")"
+			") GROUP BY `messages`.`conversation`"
+		") AS `acknowledged` ON `acknowledged`.`conversation` = `unread_counters`.`conversation` "
+		"SET `unread_counters`.`count` = GREATEST(`unread_counters`.`count` - `acknowledged`.`read_count`, 0) "
+		"WHERE `unread_counters`.`user_id` = " << userId;
+	if (!mysql.query(ss.str())) {
+		throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+	}
+}
+
+void ChatServer::applyAcknowledgements() {
+	if (pendingAcks_.empty() || loggedUser_.empty()) {
+		return;
+	}
+	try {
+		Mysql mysql;
+		try {
+			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+			auto userId = users_.at(loggedUser_).getUserId();
+			// counters, unread rows and cursors change together: a retry after a failure must not count the acks twice
+			if (!mysql.query("START TRANSACTION")) {
+				throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+			}
+			// a channel cursor can not pass a message sent and not acknowledged yet or dropped from the queue,
+			// acks of newer messages of the channel wait for it, or the messages come again after reconnect
+			std::set<unsigned long long> acknowledged(pendingAcks_.begin(), pendingAcks_.end());
+			std::stringstream all, outstanding;
+			for (auto it = acknowledged.begin(); it != acknowledged.end(); ++it) {
+				all << (it == acknowledged.begin() ? "" : ", ") << *it;
+			}
+			bool first = true;
+			for (const auto *pending: { &unacknowledged_, &undelivered_ }) {
+				for (auto id: *pending) {
+					if (acknowledged.count(id) == 0) {
+						outstanding << (first ? "" : ", ") << id;
+						first = false;
+					}
+				}
+			}
+			std::set<unsigned long long> deferred;
+			std::stringstream ss;
+			if (!first) {
+				ss << "SELECT `messages`.`id` FROM `messages` JOIN ("
+						"SELECT `channel`, MIN(`id`) AS `first_id` FROM `messages` "
+						"WHERE `channel` IS NOT NULL AND `id` IN (" << outstanding.str() << ") GROUP BY `channel`"
+					") AS `outstanding` ON `outstanding`.`channel` = `messages`.`channel` "
+					"WHERE `messages`.`id` IN (" << all.str() << ") AND `messages`.`id` > `outstanding`.`first_id`";
+				if (!mysql.query(ss.str())) {
+					throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+				}
+				for (const auto &row: mysql.fetchAll()) {
+					deferred.insert(std::stoull(row[0]));
+				}
+			}
+			std::stringstream ids;
+			first = true;
+			for (auto id: acknowledged) {
+				if (deferred.count(id) == 0) {
+					ids << (first ? "" : ", ") << id;
+					first = false;
+				}
+			}
+			if (!first) {
+				decreaseUnreadCounters(mysql, userId, ids.str());
+				ss.str(std::string{});
+				ss << "DELETE FROM `unread_messages` WHERE `user_id` = " << userId << " AND `message_id` IN (" << ids.str() << ")";
+				if (!mysql.query(ss.str())) {
+					throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+				}
+				// channel cursors move to the newest acknowledged message of every channel
+				ss.str(std::string{});
+				ss << "UPDATE `channel_members` JOIN ("
+						"SELECT `channel`, MAX(`id`) AS `last_id` FROM `messages` "
+						"WHERE `channel` IS NOT NULL AND `id` IN (" << ids.str() << ") GROUP BY `channel`"
+					") AS `acknowledged` ON `acknowledged`.`channel` = `channel_members`.`channel_id` "
+					"SET `channel_members`.`last_read_id` = GREATEST(`channel_members`.`last_read_id`, `acknowledged`.`last_id`) "
+					"WHERE `channel_members`.`user_id` = " << userId;
+				if (!mysql.query(ss.str())) {
+					throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+				}
+			}
+			if (!mysql.query("COMMIT")) {
+				throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+			}
+			// deferred messages stay unacknowledged, so they are not sent again in this session
+			for (auto id: acknowledged) {
+				if (deferred.count(id) == 0) {
+					unacknowledged_.erase(id);
+				}
+			}
+			pendingAcks_.assign(deferred.begin(), deferred.end());
+		}
+		catch (const std::runtime_error &e) {
+			// acks stay pending and are applied again as a whole
+			mysql.query("ROLLBACK");
+			clearPrompt();
+			std::cout << "Error: can not save acknowledgements to database (" << e.what() << ")" << std::endl;
+			printPrompt();
+		}
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		printPrompt();
+	}
+}
+
+std::vector<HistoryEntry> ChatServer::fetchHistory(
+	Mysql &mysql,
+	const std::string &peer,
+	const unsigned long long before_id,
+	const unsigned long long after_id,
+	const size_t limit
+	) const {
+	// keyset pagination: every branch is a range scan on an index ending with `id`
+	std::stringstream range;
+	if (before_id != 0) {
+		range << " AND `messages`.`id` < " << before_id;
+	}
+	if (after_id != 0) {
+		range << " AND `messages`.`id` > " << after_id;
+	}
+	auto select = [&](const std::string &filter) {
+		std::stringstream ss;
+		ss << "SELECT "
+				"`messages`.`id` AS `id`, "
+				"`messages`.`sent`, "
+				"`users`.`login`, "
+				"`messages`.`text` "
+			"FROM "
+				"`messages` "
+			"JOIN "
+				"`users` ON `users`.`id` = `messages`.`sender` "
+			"WHERE " << filter << range.str() << " "
+			"ORDER BY `messages`.`id` DESC "
+			"LIMIT " << limit;
+		return ss.str();
+	};
+
+	std::stringstream ss;
+	if (peer.empty()) {
+		ss << select("`messages`.`type` = 'BROADCAST'");
+	}
+	else {
+		auto self = users_.at(loggedUser_).getUserId();
+		auto other = users_.at(peer).getUserId();
+		std::stringstream outgoing, incoming;
+		outgoing << "`messages`.`sender` = " << self << " AND `messages`.`receiver` = " << other;
+		incoming << "`messages`.`sender` = " << other << " AND `messages`.`receiver` = " << self;
+		// messages addressed to several users at once are found by the recipient list
+		auto shared = [](unsigned sender, unsigned receiver) {
+			std::stringstream filter;
+			filter << "`messages`.`sender` = " << sender << " AND `messages`.`receiver` IS NULL AND "
+				"`messages`.`type` = 'PRIVATE' AND EXISTS (SELECT 1 FROM `message_recipients` WHERE "
+				"`message_recipients`.`message_id` = `messages`.`id` AND `message_recipients`.`user_id` = " << receiver << ")";
+			return filter.str();
+		};
+		ss << "(" << select(outgoing.str()) << ") UNION ALL (" << select(incoming.str()) << ") "
+			"UNION ALL (" << select(shared(self, other)) << ") UNION ALL (" << select(shared(other, self)) << ") "
+			"ORDER BY `id` DESC LIMIT " << limit;
+	}
+	if (!mysql.query(ss.str())) {
+		throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+	}
+
+	std::vector<HistoryEntry> result;
+	for (const auto &row: mysql.fetchAll()) {
+		result.push_back(HistoryEntry{ std::stoull(row[0]), row[1], row[2], row[3] });
+	}
+	return result;
+}
+
+void ChatServer::sendHistory() {
+	// 0: cmd, 1: peer login (empty for broadcast), 2: before id (0 for the latest page), 3: page length
+	auto tokens = Chat::split(message_, ":");
+	std::string peer{ tokens.size() > 1 ? tokens[1] : std::string{} };
+	unsigned long long before_id{ 0 };
+	size_t limit{ HISTORY_PAGE_LENGTH };
+	try {
+		if (tokens.size() > 2) {
+			before_id = std::stoull(tokens[2]);
+		}
+		if (tokens.size() > 3) {
+			limit = std::min<size_t>(std::stoul(tokens[3]), HISTORY_MAX_PAGE_LENGTH);
+		}
+	}
+	catch (const std::logic_error &e) {
+		strcpy(message_, "/response:fail");
+		connection_.send(message_);
+		return;
+	}
+	if (!peer.empty() && (!isValidLogin(peer) || users_.find(peer) == users_.end())) {
+		loadUsers();
+		if (!isValidLogin(peer) || users_.find(peer) == users_.end()) {
+			strcpy(message_, "/response:fail");
+			connection_.send(message_);
+			return;
+		}
+	}
+
+	std::string conversation{ peer.empty() ? "*" : loggedUser_ + "@" + peer };
+	std::vector<HistoryEntry> page;
+	try {
+		Mysql mysql;
+		try {
+			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+			if (before_id == 0) {
+				// bring the cached tail up to date, only messages newer than the tail are loaded
+				auto newest = history_.getNewestId(conversation);
+				auto newer = fetchHistory(mysql, peer, 0, newest, HistoryCache::TAIL_LENGTH);
+				std::reverse(newer.begin(), newer.end());
+				history_.appendNewer(conversation, newer, newest == 0 && newer.size() < HistoryCache::TAIL_LENGTH);
+			}
+			if (!history_.getPage(conversation, before_id, limit, page)) {
+				page = fetchHistory(mysql, peer, before_id, 0, limit);
 			}
 		}
-		else if (cmd == "/list") {
-			listActiveUsers();
-		}
-		else if (cmd == "/log") {
-			printLineFromLog();
-		}
-		else if (cmd.substr(0, 7) == "/remove") {
-			removeUser(cmd);
+		catch (const std::runtime_error &e) {
+			clearPrompt();
+			std::cout << "Error: can not load message history from database (" << e.what() << ")" << std::endl;
+			printPrompt();
 		}
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
 		printPrompt();
 	}
-}
 
-void ChatServer::printLineFromLog() const {
-	clearPrompt();
-	if (logger_->isEof()) {
-		std::cout << "Error: EOF has been reached" << std::endl;
-		return;
+	// oldest message goes first, the whole page and the summary are sent as one batch
+	std::vector<std::string> frames;
+	for (auto it = page.rbegin(); it != page.rend(); ++it) {
+		std::stringstream ss;
+		ss << "HISTORY\n" << it->id << '\n' << it->sent << '\n' << it->sender << '\n' << it->text << '\n';
+		frames.push_back(ss.str());
 	}
-	std::cout << logger_->readline() << std::endl;
+	frames.push_back(std::string{ "/response:history:" } +
+		std::to_string(page.size()) + ":" +
+		std::to_string(page.empty() ? 0 : page.back().id));
+	connection_.sendBatch(frames);
 }
 
-void ChatServer::updateActiveUsers() {
-	loadUsers();
+std::list<std::vector<std::string>> ChatServer::fetchSince(
+	Mysql &mysql,
+	const std::string &conversation,
+	const unsigned long long seq
+	) const {
+	auto self = users_.at(loggedUser_).getUserId();
+	// range scan on (`conversation`, `seq`), the rest only checks that user takes part in the conversation
+	std::stringstream ss;
+	ss << "SELECT "
+			"`messages`.`id`, "
+			"`messages`.`sent`, "
+			"`users`.`login`, "
+			"`messages`.`text`, "
+			"`messages`.`seq`, "
+			"`messages`.`type`, "
+			<< previousSequenceColumn() << ", "
+			"`messages`.`sender` "
+		"FROM "
+			"`messages` "
+		"JOIN "
+			"`users` ON `users`.`id` = `messages`.`sender` "
+		"WHERE "
+			"`messages`.`conversation` = '" << conversation << "' AND "
+			"`messages`.`seq` > " << seq << " AND ("
+			"`messages`.`type` = 'BROADCAST' OR "
+			"`messages`.`sender` = " << self << " OR "
+			"`messages`.`receiver` = " << self << " OR "
+			"EXISTS (SELECT 1 FROM `message_recipients` WHERE "
+				"`message_recipients`.`message_id` = `messages`.`id` AND `message_recipients`.`user_id` = " << self << ") OR "
+			"EXISTS (SELECT 1 FROM `channel_members` WHERE "
+				"`channel_members`.`channel_id` = `messages`.`channel` AND `channel_members`.`user_id` = " << self << ")) "
+		"ORDER BY `messages`.`seq` "
+		"LIMIT " << HISTORY_MAX_PAGE_LENGTH;
+	if (!mysql.query(ss.str())) {
+		throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+	}
+	return mysql.fetchAll();
+}
+
+void ChatServer::sendSince() {
+	// 0: cmd, 1: conversation, 2: sequence number of the last received message
+	auto tokens = Chat::split(std::string{ message_ }, ":");
+	if (tokens.size() < 3 || !isValidConversation(tokens[1]) || !isNumber(tokens[2])) {
+		connection_.send("/response:fail");
+		return;
+	}
+	std::vector<std::string> frames;
+	unsigned long long last_seq{ std::stoull(tokens[2]) };
 	try {
 		Mysql mysql;
 		try {
 			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			if (!mysql.query("SELECT "
-					"`users`.`login`, "
-					"`active_sessions`.`ip`, "
-					"`active_sessions`.`port`, "
-					"`active_sessions`.`pid` "
-				"FROM "
-					"`active_sessions` "
-				"JOIN "
-					"`users` ON `users`.`id` = `active_sessions`.`user_id`"
-			)) {
-				std::stringstream ss;
-				ss << "MySQL error: " << mysql.getError();
-				throw std::runtime_error{ ss.str() };
-			}
-			auto rows = mysql.fetchAll();
-			activeUsers_.clear();
-			for (const auto &row: rows) {
-				activeUsers_.insert(row[0]);
-				users_.at(row[0]).setIp(row[1]);
-				users_.at(row[0]).setPort(std::stoi(row[2]));
-				users_.at(row[0]).setPid(std::stoi(row[3]));
-				users_.at(row[0]).setLoggedIn();
+			for (const auto &row: fetchSince(mysql, tokens[1], last_seq)) {
+				frames.push_back("HISTORY\n" + row[0] + '\n' + row[1] + '\n' + row[2] + '\n' + row[3] + '\n');
+				last_seq = std::stoull(row[4]);
 			}
 		}
 		catch (const std::runtime_error &e) {
 			clearPrompt();
+			std::cout << "Error: can not load messages from database (" << e.what() << ")" << std::endl;
 			printPrompt();
 		}
 	}
@@ -664,219 +3011,512 @@ void ChatServer::updateActiveUsers() {
 		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
 		printPrompt();
 	}
+	frames.push_back("/response:since:" + std::to_string(frames.size()) + ":" + std::to_string(last_seq));
+	connection_.sendBatch(frames);
 }
 
-void ChatServer::cleanExit() {
-	if (mainPid_ != getpid()) {
-		terminateChild();
+void ChatServer::sendSync() {
+	// 0: cmd, 1: conversation=seq;conversation=seq;...
+	std::string request{ message_ };
+	auto pos = request.find(':');
+	std::vector<std::string> frames;
+	try {
+		Mysql mysql;
+		try {
+			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+			auto self = std::to_string(users_.at(loggedUser_).getUserId());
+			for (const auto &entry: Chat::split(pos == std::string::npos ? std::string{} : request.substr(pos + 1), ";")) {
+				auto fields = Chat::split(entry, "=");
+				if (fields.size() != 2 || !isValidConversation(fields[0]) || !isNumber(fields[1])) {
+					continue;
+				}
+				// missed messages go as ordinary frames, so receiver orders and dedupes them as usual
+				for (const auto &row: fetchSince(mysql, fields[0], std::stoull(fields[1]))) {
+					if (row[7] == self) {
+						continue;
+					}
+					frames.push_back(row[5] + '\n' + fields[0] + '\n' + row[4] + ':' + row[6] + ':' + row[0] + '\n' + row[2] + '\n' + row[3] + '\n');
+				}
+			}
+		}
+		catch (const std::runtime_error &e) {
+			clearPrompt();
+			std::cout << "Error: can not load messages from database (" << e.what() << ")" << std::endl;
+			printPrompt();
+		}
 	}
-	mainLoopActive_ = false;
-	clearPrompt();
-	std::cout << "Killing all children..." << std::endl;
-	for (auto child: children_) {
-		kill(child, SIGTERM);
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		printPrompt();
 	}
-	sleep(2); // Waiting 2 seconds for all children will die
-	clearPrompt();
-	std::cout << "Closing socket..." << std::endl;
-	close(sockFd_);
-	std::cout << "Removing temporary directory..." << std::endl;
-	fs::remove_all(TEMP_DIR);
-	std::cout << "Exiting from main process..." << std::endl;
-	
-	exit(EXIT_SUCCESS);	
+	frames.push_back("/response:sync:" + std::to_string(frames.size()));
+	connection_.sendBatch(frames);
 }
 
-void ChatServer::terminateChild() const {
-	if (connection_ != 0) {
-		removeSessionByPid(getpid());
-		strcpy(message_, "/response:kick");
-		if (write(connection_, message_, MESSAGE_LENGTH) == -1) {
-			std::cerr << "Error while calling write: " << strerror(errno) << std::endl;
+void ChatServer::updateSearchIndex() {
+	Mysql mysql;
+	mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+	std::stringstream ss;
+	// every process keeps own copy of the index, so it catches up with messages sent by other processes
+	ss << "SELECT `id`, `sender`, COALESCE(`receiver`, -1), `text`, COALESCE(`channel`, 0), `type`, "
+		"COALESCE((SELECT GROUP_CONCAT(`user_id` ORDER BY `user_id`) FROM `message_recipients` "
+		"WHERE `message_recipients`.`message_id` = `messages`.`id`), '') "
+		"FROM `messages`";
+	if (searchIndex_.size() != 0) {
+		ss << " WHERE `id` > " << searchIndex_.getLastId();
+	}
+	ss << " ORDER BY `id`";
+	if (!mysql.query(ss.str())) {
+		throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+	}
+	for (const auto &row: mysql.fetchAll()) {
+		auto id = std::stoull(row[0]);
+		auto receiver = std::stoll(row[2]);
+		unsigned indexedReceiver{ static_cast<unsigned>(receiver) };
+		if (row[5] == "PRIVATE" && receiver < 0) {
+			indexedReceiver = SearchIndex::SEVERAL_RECEIVERS;
+			for (const auto &user_id: Chat::split(row[6], ",")) {
+				searchIndex_.addReceiver(id, std::stoul(user_id));
+			}
 		}
-		close(connection_);
+		else if (receiver < 0) {
+			indexedReceiver = SearchIndex::BROADCAST;
+		}
+		searchIndex_.add(id, std::stoul(row[1]), indexedReceiver, row[3], std::stoul(row[4]));
 	}
+}
 
-	exit(EXIT_SUCCESS);
+std::vector<std::vector<std::string>> ChatServer::searchMessages(const std::string &query, const unsigned user_id) {
+	updateSearchIndex();
+	Mysql mysql;
+	mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+	std::set<unsigned> channels;
+	if (user_id != SearchIndex::ALL_USERS) {
+		channels = getUserChannels(mysql);
+	}
+	auto ids = searchIndex_.search(query, user_id, SEARCH_RESULTS_LIMIT, channels);
+	if (ids.empty()) {
+		return {};
+	}
+
+	std::stringstream ss;
+	ss << "SELECT "
+			"`messages`.`id`, "
+			"`messages`.`sent`, "
+			"`sender_users`.`login`, "
+			"COALESCE("
+				"CONCAT('@', `receiver_users`.`login`), "
+				"CONCAT('#', `channels`.`name`), "
+				"(SELECT GROUP_CONCAT(CONCAT('@', `users`.`login`) SEPARATOR ' ') FROM `message_recipients` "
+				"JOIN `users` ON `users`.`id` = `message_recipients`.`user_id` "
+				"WHERE `message_recipients`.`message_id` = `messages`.`id`), "
+				"''), "
+			"`messages`.`text` "
+		"FROM "
+			"`messages` "
+		"JOIN "
+			"`users` AS `sender_users` ON `messages`.`sender` = `sender_users`.`id` "
+		"LEFT JOIN "
+			"`users` AS `receiver_users` ON `messages`.`receiver` = `receiver_users`.`id` "
+		"LEFT JOIN "
+			"`channels` ON `messages`.`channel` = `channels`.`id` "
+		"WHERE `messages`.`id` IN (";
+	for (size_t i = 0; i < ids.size(); ++i) {
+		ss << (i == 0 ? "" : ", ") << ids[i];
+	}
+	ss << ") ORDER BY `messages`.`id`";
+	if (!mysql.query(ss.str())) {
+		throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+	}
+	auto &rows = mysql.fetchAll();
+	return std::vector<std::vector<std::string>>{ rows.begin(), rows.end() };
 }
 
-void ChatServer::childDeathHandler(int signum) {
-	pid_t pid;
-	while ((pid = waitpid(-1, nullptr, WNOHANG)) > 0) {
-		if (pid == consolePid_) {
-			cleanExit();
-		}
-		else {
-			updateActiveUsers();
-			removeSessionByPid(pid);
-			auto it = children_.find(pid);
-			if (it != children_.end()) {
-				children_.erase(it);
-			}
+void ChatServer::sendSearchResults() {
+	std::string query{ std::string{ message_ }.substr(7) };
+	if (!query.empty() && query[0] == ':') {
+		query.erase(0, 1);
+	}
+	std::vector<std::vector<std::string>> rows;
+	try {
+		rows = searchMessages(query, users_.at(loggedUser_).getUserId());
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not search messages (" << e.what() << ")" << std::endl;
+		printPrompt();
+	}
+
+	std::vector<std::string> frames;
+	for (const auto &row: rows) {
+		std::stringstream ss;
+		ss << "HISTORY\n" << row[0] << '\n' << row[1] << '\n' << row[2];
+		if (!row[3].empty()) {
+			ss << ' ' << row[3];
 		}
+		ss << '\n' << row[4] << '\n';
+		frames.push_back(ss.str());
 	}
+	frames.push_back(std::string{ "/response:search:" } + std::to_string(rows.size()));
+	connection_.sendBatch(frames);
 }
 
-void ChatServer::sigIntHandler(int signum) {
-	if (mainPid_ != getpid()) {
-		terminateChild();
+void ChatServer::printSearchResults(const std::string &cmd) {
+	std::string query{ cmd.length() > 8 ? cmd.substr(8) : std::string{} };
+	clearPrompt();
+	try {
+		auto rows = searchMessages(query, SearchIndex::ALL_USERS);
+		for (const auto &row: rows) {
+			std::cout << '[' << row[0] << "] " << row[1] << ' ' << row[2];
+			if (!row[3].empty()) {
+				std::cout << ' ' << row[3];
+			}
+			std::cout << ": " << row[4] << std::endl;
+		}
+		std::cout << "Found " << rows.size() << " message(s)" << std::endl;
 	}
-	else {
-		std::cout << "\nCaught interrupt signal!" << std::endl;
-		kill(consolePid_, SIGTERM);
-		cleanExit();
+	catch (const std::runtime_error &e) {
+		std::cout << "Error: can not search messages (" << e.what() << ")" << std::endl;
 	}
 }
 
-void ChatServer::sigTermHandler(int signum) {
-	if (mainPid_ != getpid()) {
-		terminateChild();
+std::string ChatServer::getSpoolPath(const unsigned long long messageId) const {
+	return config_.get("SpoolDir", DEFAULT_SPOOL_DIR) + "/" + std::to_string(messageId);
+}
+
+void ChatServer::sendNotice(const std::string &text) {
+	connection_.send("NOTICE\n" + text + "\n");
+}
+
+std::string ChatServer::getTransferPath(const unsigned long long messageId, const std::string &hash) const {
+	if (hash.empty()) {
+		return getSpoolPath(messageId);
 	}
-	else {
-		std::cout << "\nCaught terminate signal!" << std::endl;
-		kill(consolePid_, SIGTERM);
-		cleanExit();
+	if (attachments_.contains(hash)) {
+		return attachments_.getPath(hash);
 	}
+	// content is still being uploaded
+	return attachments_.getTemporaryPath(messageId);
 }
 
-void ChatServer::processNewClient() {
-	clearPrompt();
-	std::cout << "Client connected from " << getClientIpAndPort() << std::endl;
-	printPrompt();
-
-	fd_set rfds;
-	while (true) {
-		try {	
-			if (!loggedUser_.empty()) {
-				try {
-					checkUnreadMessages();
-				}
-				catch (const std::logic_error &e) {
-					std::cout << "Logic error: " << e.what() << std::endl;
-				}
-			}
+void ChatServer::receiveTransfer(const std::string &request) {
+	// /transfer:begin:<token>:<kind>:<receiver>:<size>:<name>
+	// /transfer:offer:<token>:FILE:<receiver>:<size>:<sha256>:<name>
+	// /transfer:chunk:<token>:<binary data>
+	// /transfer:end:<token>
+	auto opEnd = request.find(':', 10);
+	if (opEnd == std::string::npos) {
+		return;
+	}
+	std::string op{ request.substr(10, opEnd - 10) };
+	if (op == "begin") {
+		auto tokens = Chat::split(request.substr(opEnd + 1), ":");
+		beginTransfer(tokens, std::string{});
+		return;
+	}
+	if (op == "offer") {
+		// file is uploaded only if its content is not in the attachment store yet
+		auto tokens = Chat::split(request.substr(opEnd + 1), ":");
+		if (tokens.size() < 6 || tokens[1] != "FILE" || !AttachmentStore::isValidHash(tokens[4])) {
+			connection_.send("/response:transfer:fail");
+			return;
+		}
+		std::string hash{ tokens[4] };
+		tokens.erase(tokens.begin() + 4);
+		beginTransfer(tokens, hash);
+		return;
+	}
 
-			int bytes;
-			struct timeval tv;
-			tv.tv_sec = 0;
-			tv.tv_usec = 500000; // half second
-			FD_ZERO(&rfds);
-			FD_SET(connection_, &rfds);
-			auto retval = select(connection_ + 1, &rfds, nullptr, nullptr, &tv);
-			if (retval == -1) {
-				clearPrompt();
-				std::cout << "An error occured while trying to call select(): " << strerror(errno) << std::endl;
-				printPrompt();
-				continue;
+	auto tokenEnd = request.find(':', opEnd + 1);
+	std::string token{ request.substr(opEnd + 1, tokenEnd == std::string::npos ? std::string::npos : tokenEnd - opEnd - 1) };
+	auto it = uploads_.find(token);
+	if (it == uploads_.end()) {
+		return;
+	}
+	auto &upload = it->second;
+	if (op == "chunk" && tokenEnd != std::string::npos) {
+		const char *data = request.data() + tokenEnd + 1;
+		size_t length = request.length() - tokenEnd - 1;
+		if (!upload.hash.empty()) {
+			upload.sha.update(reinterpret_cast<const uint8_t *>(data), length);
+		}
+		if (upload.received + length > upload.size ||
+			write(upload.fd, data, length) != static_cast<ssize_t>(length)) {
+			sendNotice("Transfer of " + upload.name + " failed");
+			abortUpload(token);
+			return;
+		}
+		upload.received += length;
+	}
+	else if (op == "end") {
+		close(upload.fd);
+		upload.fd = -1;
+		// receivers wait for the declared size, a short transfer can never be delivered
+		if (upload.received != upload.size) {
+			sendNotice("Transfer of " + upload.name + " failed: " + std::to_string(upload.received) +
+				" of " + std::to_string(upload.size) + " bytes received");
+			abortUpload(token);
+			return;
+		}
+		if (!upload.hash.empty()) {
+			uint8_t *digest = upload.sha.digest();
+			std::string hash{ SHA256::toString(digest) };
+			delete[] digest;
+			if (hash != upload.hash) {
+				sendNotice("Transfer of " + upload.name + " failed: content does not match");
+				abortUpload(token);
+				return;
 			}
-			if (retval == 0) { // select() timed out
-				continue;
+			try {
+				attachments_.commit(upload.path, upload.hash);
 			}
-
-			std::fill(message_, message_ + MESSAGE_LENGTH, '\0');
-			bytes = read(connection_, message_, MESSAGE_LENGTH);
-			if (bytes == -1) {
-				throw std::runtime_error{
-					std::string{ "Error while reading from socket: " } + 
-					std::string{ strerror(errno) } 
-				};
-			}
-			if (bytes == 0) {
+			catch (const fs::filesystem_error &e) {
 				clearPrompt();
-				std::cout << "Client with address " << getClientIpAndPort() << " has been disconnected\n" << std::endl;
+				std::cout << "Error: can not store attachment (" << e.what() << ")" << std::endl;
 				printPrompt();
-				break;
+				abortUpload(token);
+				return;
 			}
+		}
+		clearPrompt();
+		std::cout << "User " << std::quoted(loggedUser_) << " has uploaded " << std::quoted(upload.name)
+			<< " (" << upload.received << " of " << upload.size << " bytes)" << std::endl;
+		printPrompt();
+		uploads_.erase(it);
+	}
+}
 
-			clearPrompt();
-			std::cout << "Received " << bytes << " bytes: " << message_ << std::endl;
-			printPrompt();
-			if (strncmp(message_, "/checklogin", 11) == 0) {
-				checkLogin();
-			}
-			else if (strncmp(message_, "/signup", 7) == 0) {
-				// registration
-				signUp();
+void ChatServer::beginTransfer(const std::vector<std::string> &tokens, const std::string &hash) {
+	// 0: token, 1: kind, 2: receiver (empty for broadcast), 3: size, 4: name.
+	// Offered transfers (hash is set) are answered with a response, others with notices on failure
+	auto reject = [&](const std::string &reason) {
+		if (hash.empty()) {
+			sendNotice("Transfer rejected: " + reason);
+		}
+		else {
+			connection_.send("/response:transfer:fail");
+		}
+	};
+	if (tokens.size() < 5 || (tokens[1] != "TEXT" && tokens[1] != "FILE")) {
+		reject("malformed request");
+		return;
+	}
+	unsigned long long size;
+	try {
+		size = std::stoull(tokens[3]);
+	}
+	catch (const std::logic_error &e) {
+		reject("malformed size");
+		return;
+	}
+	if (size > std::stoull(config_.get("MaxTransferSize", DEFAULT_MAX_TRANSFER_SIZE))) {
+		reject(tokens[4] + " is too large");
+		return;
+	}
+	const auto &receiver = tokens[2];
+	if (!receiver.empty() && users_.find(receiver) == users_.end()) {
+		reject("user " + receiver + " does not exist");
+		return;
+	}
+	// only safe characters of the name get to the database and to the receiver
+	std::string name{ tokens[4] };
+	for (auto &c: name) {
+		if (!std::isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-' && c != '_') {
+			c = '_';
+		}
+	}
+	std::string preview{ tokens[1] == "FILE" ?
+		"[file " + name + ", " + tokens[3] + " bytes]" :
+		"[long message, " + tokens[3] + " bytes]" };
+
+	try {
+		Mysql mysql;
+		try {
+			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+			// receivers must not see the message before it is marked as a transfer
+			mysql.query("START TRANSACTION");
+			unsigned long long messageId;
+			if (receiver.empty()) {
+				messageId = BroadcastMessage{ loggedUser_, preview, users_ }.save(mysql);
 			}
-			else if (strncmp(message_, "/signin", 7) == 0) {
-				// authorization
-				signIn();
+			else {
+				messageId = PrivateMessage{ loggedUser_, receiver, preview }.save(mysql);
 			}
-			else if (strncmp(message_, "/logout", 7) == 0) {
-				// logout
-				signOut();
+			// known content is not uploaded again, the message just refers to it
+			bool stored = !hash.empty() && attachments_.contains(hash);
+			std::string path{ hash.empty() ? getSpoolPath(messageId) : attachments_.getTemporaryPath(messageId) };
+			int fd = -1;
+			if (!stored) {
+				fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+				if (fd == -1) {
+					mysql.query("ROLLBACK");
+					throw std::runtime_error{ std::string{ "can not create spool file: " } + strerror(errno) };
+				}
 			}
-			else if (strncmp(message_, "/remove", 7) == 0) {
-				// removing current user
-				if (!loggedUser_.empty()) {
-					removeUser();
+			std::stringstream ss;
+			ss << "INSERT INTO `transfers` (`message_id`, `kind`, `name`, `size`, `hash`) VALUES ("
+				<< messageId << ", '" << tokens[1] << "', '" << name << "', " << size << ", "
+				<< (hash.empty() ? std::string{ "NULL" } : "'" + hash + "'") << ")";
+			if (!mysql.query(ss.str())) {
+				if (fd != -1) {
+					close(fd);
 				}
+				std::string error{ mysql.getError() };
+				mysql.query("ROLLBACK");
+				throw std::runtime_error{ error };
 			}
-			else if (
-				strncmp(message_, "/exit", 5) == 0 ||
-				strncmp(message_, "/quit", 5) == 0) {
-				// closing the program
-				break;
+			mysql.query("COMMIT");
+			if (!stored) {
+				uploads_[tokens[0]] = Upload{ messageId, fd, size, 0, name, path, hash, SHA256{} };
+			}
+			if (!hash.empty()) {
+				connection_.send(stored ? "/response:transfer:have" : "/response:transfer:upload");
 			}
-			else if (!loggedUser_.empty()) {
-				// if there is an authorized user, we send a message
-				sendMessage();
-			}	
+			*logger_ << loggedUser_ + ": " + (receiver.empty() ? std::string{} : "@" + receiver + " ") + preview;
+		}
+		catch (const std::runtime_error &e) {
+			clearPrompt();
+			std::cout << "Error: can not start transfer (" << e.what() << ")" << std::endl;
+			printPrompt();
+			reject(name + " can not be stored");
 		}
-		catch (std::invalid_argument e) {
-			// exception handling
-			std::cout << "Error: " << e.what() << "\n" << std::endl;
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
+		printPrompt();
+	}
+}
+
+void ChatServer::abortUpload(const std::string &token) {
+	// unfinished upload can not be delivered, receivers see it disappear from the spool
+	auto it = uploads_.find(token);
+	if (it == uploads_.end()) {
+		return;
+	}
+	if (it->second.fd != -1) {
+		close(it->second.fd);
+	}
+	std::error_code error;
+	fs::remove(it->second.path, error);
+	try {
+		Mysql mysql;
+		mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
+		mysql.query("DELETE FROM `messages` WHERE `id` = " + std::to_string(it->second.messageId));
+	}
+	catch (const std::runtime_error &e) {
+		clearPrompt();
+		std::cout << "Error: can not remove aborted transfer (" << e.what() << ")" << std::endl;
+		printPrompt();
+	}
+	uploads_.erase(it);
+}
+
+void ChatServer::abortUploads() {
+	while (!uploads_.empty()) {
+		abortUpload(uploads_.begin()->first);
+	}
+}
+
+void ChatServer::startOutgoingTransfer(
+	const unsigned long long messageId,
+	const std::string &kind,
+	const std::string &sender,
+	const std::string &name,
+	const unsigned long long size,
+	const std::string &hash,
+	const std::string &conversation,
+	const std::string &position
+	) {
+	auto path = getTransferPath(messageId, hash);
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		return; // upload has not started yet or has been aborted
+	}
+	std::stringstream ss;
+	ss << "TRANSFER\n" << messageId << '\n' << kind << '\n' << sender << '\n' << name << '\n' << size << '\n';
+	// transfer takes a sequence number of the conversation, the client must not see it as a gap
+	if (!conversation.empty()) {
+		ss << conversation << '\n' << position << '\n';
+	}
+	connection_.send(ss.str());
+	outgoingTransfers_[messageId] = OutgoingTransfer{ fd, size, 0, path };
+}
+
+void ChatServer::pumpTransfers() {
+	if (connection_.hasOutput()) {
+		return; // chunks wait until the client reads what is queued
+	}
+	// every transfer gets one chunk per round, so a large file can not delay
+	// other transfers and normal messages for long
+	size_t budget = TRANSFER_CHUNKS_PER_ITERATION;
+	bool progress = true;
+	while (budget > 0 && progress && !outgoingTransfers_.empty()) {
+		progress = false;
+		for (auto it = outgoingTransfers_.begin(); it != outgoingTransfers_.end() && budget > 0; ) {
+			auto messageId = it->first;
+			auto &transfer = it->second;
+			// the file may still be growing while the sender uploads it
+			struct stat st;
+			unsigned long long available = fstat(transfer.fd, &st) == 0 ? st.st_size : 0;
+			auto length = std::min<unsigned long long>({
+				TRANSFER_CHUNK_LENGTH,
+				transfer.size - transfer.offset,
+				available > transfer.offset ? available - transfer.offset : 0 });
+			if (length > 0) {
+				std::string header{ "CHUNK\n" + std::to_string(messageId) + "\n" };
+				if (connection_.sendFileRange(header, transfer.fd, transfer.offset, length) == -1) {
+					throw std::runtime_error{ std::string{ "Error while sending file: " } + strerror(errno) };
+				}
+				transfer.offset += length;
+				--budget;
+				progress = true;
+			}
+			if (transfer.offset == transfer.size) {
+				++it;
+				finishOutgoingTransfer(messageId);
+				continue;
+			}
+			if (length == 0 && !fs::exists(transfer.path)) {
+				// sender has gone before the upload was complete
+				connection_.send("TRANSFER_ABORT\n" + std::to_string(messageId) + "\n");
+				close(transfer.fd);
+				it = outgoingTransfers_.erase(it);
+				continue;
+			}
+			++it;
 		}
 	}
-	cleanExit();
 }
 
-void ChatServer::checkUnreadMessages() {	
+void ChatServer::finishOutgoingTransfer(const unsigned long long messageId) {
+	auto it = outgoingTransfers_.find(messageId);
+	if (it == outgoingTransfers_.end()) {
+		return;
+	}
+	close(it->second.fd);
+	outgoingTransfers_.erase(it);
 	try {
 		Mysql mysql;
 		try {
 			std::stringstream ss;
 			mysql.open(config_["DBName"], config_["DBHost"], config_["DBUser"], config_["DBPassword"]);
-			ss << 
-				"SELECT "
-					"`receiver_users`.`login`, "
-					"`messages`.`text`, "
-					"`unread_users`.`id`, "
-					"`messages`.`id`, "
-					"`sender_users`.`login`"
-				"FROM "
-					"`unread_messages` "
-				"JOIN "
-					"`messages` ON `messages`.`id` = `unread_messages`.`message_id` "
-				"JOIN "
-					"`users` AS `unread_users` ON `unread_messages`.`user_id` = `unread_users`.`id` "
-				"JOIN "
-					"`users` AS `sender_users` ON `messages`.`sender` = `sender_users`.`id` "
-				"LEFT JOIN "
-					"`users` AS `receiver_users` ON `messages`.`receiver` = `receiver_users`.`id` "
-				"WHERE "
-					"`unread_users`.`login` = '" << loggedUser_ << "' "
-				"ORDER BY `messages`.`sent`";
+			decreaseUnreadCounters(mysql, users_.at(loggedUser_).getUserId(), std::to_string(messageId));
+			ss << "DELETE FROM `unread_messages` WHERE "
+				"`user_id` = " << users_.at(loggedUser_).getUserId() << " AND "
+				"`message_id` = " << messageId;
 			mysql.query(ss.str());
+			// the spool file is kept while somebody has not received it
+			mysql.query("SELECT COUNT(*) FROM `unread_messages` WHERE `message_id` = " + std::to_string(messageId));
 			auto rows = mysql.fetchAll();
-			for (const auto &row: rows) {
-				if (row[0].empty()) {
-					strcpy(message_, (std::string{ "BROADCAST\n" } + row[4] + "\n" + row[1] + "\n").c_str());
-				}
-				else {
-					strcpy(message_, (std::string{ "PRIVATE\n" } + row[4] + "\n" + row[1] + "\n").c_str());
-				}
-				write(connection_, message_, MESSAGE_LENGTH);
-				ss.str(std::string{});
-				ss << "DELETE FROM `unread_messages` WHERE "
-					"`user_id` = " << row[2] << " AND "
-					"`message_id` = " << row[3];
-				mysql.query(ss.str());
+			if (!rows.empty() && rows.front().at(0) == "0") {
+				fs::remove(getSpoolPath(messageId));
 			}
 		}
 		catch (const std::runtime_error &e) {
 			clearPrompt();
-			std::cout << "Error: can not load unread messages from database (" << e.what() << ")" << std::endl;
+			std::cout << "Error: can not finish transfer (" << e.what() << ")" << std::endl;
 			printPrompt();
 		}
 	}
@@ -885,7 +3525,6 @@ void ChatServer::checkUnreadMessages() {
 		std::cout << "Error: can not connect to database (" << e.what() << ")" << std::endl;
 		printPrompt();
 	}
-
 }
 
 void ChatServer::loadUsers() {
@@ -5,19 +5,35 @@
 #include "chat_message.h"
 #include "broadcast_message.h"
 #include "private_message.h"
+#include "message_store.h"
+#include "history_cache.h"
+#include "search_index.h"
+#include "attachment_store.h"
+#include "conversation.h"
+#include "presence_table.h"
+#include "timer_wheel.h"
+#include "uring_io.h"
+#include "session_loop.h"
+#include "SHA256.h"
 #include "config_file.h"
 #include "logger.h"
+#include "chat_connection.h"
 
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_set>
+#include <deque>
 #include <set>
 #include <memory>
 #include <cstring>
 #include <algorithm>
 #include <stdexcept>
 #include <atomic>
+#include <chrono>
+#include <csignal>
+#include <functional>
 
 #if defined(_WIN64) or defined(_WIN32)
 #include <Windows.h>
@@ -37,25 +53,59 @@ extern "C" {
 
 class ChatServer final {
 public:
-	ChatServer(); // constructor
+	explicit ChatServer(bool takeover = false); // constructor, with takeover gets the listening socket of the running server
 	~ChatServer(); // destructor
 	void work(); // main work
-	void childDeathHandler(int signum);
 	void sigIntHandler(int signum);
 	void sigTermHandler(int signum);
+	void wakeUpHandler(int signum);
+	void drainHandler(int signum, bool handedOver); // SIGUSR2
+	static constexpr int HANDOFF_SIGNAL_VALUE{ 1 }; // SIGUSR2 value: listening socket is taken by the new server
 
 private:	
 	bool isLoginAvailable(const std::string& login) const; // login availability
 	void signUp(); // registration
 	bool isValidLogin(const std::string& login) const; // login verification
 	void signIn(); // authorization
+	void resumeSession(); // authorization by session token after reconnect
+	std::string createSessionToken(Mysql &mysql, unsigned userId) const; // token for resuming the session
+	unsigned long long getLatestMessageId(Mysql &mysql) const;
+	void removeSessionTokens() const; // forget session tokens of logged user
 	void signOut(); // user logout
 	void removeUser(); // deleting a user
 	void removeUser(const std::string &cmd); // deleting a user
-	void sendMessage(); // sending a message
-	void sendPrivateMessage(ChatUser& sender, const std::string& receiverName, const std::string& messageText); // sending a private message
-	void sendBroadcastMessage(ChatUser& sender, const std::string& message); // sending a shared message
+	void sendMessage(const std::string& clientId); // sending a message, client id may be empty
+	void sendPrivateMessage(ChatUser& sender, const std::vector<std::string>& receiverNames, const std::string& messageText, const std::string& clientId); // sending a private message, stored once for all receivers
+	void sendBroadcastMessage(ChatUser& sender, const std::string& message, const std::string& clientId); // sending a shared message
+	void sendChannelMessage(ChatUser& sender, const std::string& channelName, const std::string& message, const std::string& clientId); // sending a message to channel members
+	static bool isValidClientId(const std::string &clientId);
+	bool isKnownClientId(const std::string &clientId) const; // message with this id was stored in this session
+	void rememberClientId(const std::string &clientId);
+	void joinChannel(); // subscribe logged user to channel, channel is created if it does not exist
+	void leaveChannel(); // unsubscribe logged user from channel
+	void listChannels(); // send list of channels of logged user
+	std::set<unsigned> getUserChannels(Mysql &mysql) const; // ids of channels of logged user
+	std::string previousSequenceColumn() const; // SQL expression: previous seq of the conversation not sent by logged user
 	void checkUnreadMessages(); // check unread messages
+	void receiveAcknowledgements(); // ids of messages delivered to the client
+	void applyAcknowledgements(); // mark acknowledged messages as read, one statement for the whole batch
+	void decreaseUnreadCounters(Mysql &mysql, unsigned userId, const std::string &ids) const; // ids: comma separated message ids
+	size_t sendUnreadSummary(); // unread counts per conversation, returns number of conversations
+	void sendUnread(); // page of the unread backlog of a conversation
+	void sendHistory(); // send a page of conversation history
+	std::list<std::vector<std::string>> fetchSince(Mysql &mysql, const std::string &conversation, unsigned long long seq) const; // id, sent, sender, text, seq, type, previous seq, sender id
+	void sendSince(); // send messages of conversation with sequence numbers greater than given one
+	void sendSync(); // delta sync after reconnect: missed messages of several conversations
+	std::vector<HistoryEntry> fetchHistory(
+		Mysql &mysql,
+		const std::string &peer,
+		unsigned long long before_id,
+		unsigned long long after_id,
+		size_t limit) const; // load history page from database, newest first
+	void updateSearchIndex(); // index messages added since the last update
+	std::vector<std::vector<std::string>> searchMessages(const std::string &query, unsigned user_id); // id, sent, sender, @receiver or #channel, text
+	void sendSearchResults(); // search messages visible to logged user
+	void printSearchResults(const std::string &cmd); // search all messages from console
 	void saveUsers() const;
 	void saveMessages() const; // save all messages to file
 	void loadUsers(); // load user list from file
@@ -66,18 +116,78 @@ private:
 	unsigned int getPromptLength() const;
 	void clearPrompt() const;
 	void processNewClient();
+	void startSession(); // connection_ and client_ are set: ring, output limits and timers of the session
+	std::chrono::milliseconds pollSession(bool wokenUp); // work of the session loop not bound to the connection, wokenUp: SIGUSR1 came
+	SessionLoop::Task serveClient(SessionLoop &loop); // handshake, then requests of the user until the client leaves
+	SessionLoop::Task readRequest(SessionLoop &loop, std::string &request, bool &connected); // next request of the client
+	SessionLoop::Task flushOutput(SessionLoop &loop); // writes the outbound queue when the socket is writable
+	void enforceOutputLimits(); // slow consumer policy and queue depth metrics
+	SessionLoop::Task watchHeartbeat(SessionLoop &loop); // pings silent client, closes the session after several missed pings
+	bool acceptFrame(const std::string &request); // common part of requests, false if the frame needs nothing more
+	bool handleHandshake(const std::string &request); // before login, false if the client closes the session
+	bool handleRequest(const std::string &request); // false if the client closes the session
 	void startConsole();
 	void checkLogin() const;
-	void terminateChild() const;
+	void negotiateCompression();
+	void printCompressionStatistics() const;
+	void printOutputStatistics() const;
+	void receiveTransfer(const std::string &request); // begin, chunk or end of a streamed message or file
+	void beginTransfer(const std::vector<std::string> &tokens, const std::string &hash);
+	void startOutgoingTransfer(unsigned long long messageId, const std::string &kind, const std::string &sender, const std::string &name, unsigned long long size, const std::string &hash, const std::string &conversation, const std::string &position);
+	void pumpTransfers(); // send next chunks of transfers to the client
+	void finishOutgoingTransfer(unsigned long long messageId);
+	void abortUpload(const std::string &token); // drop one unfinished upload with its message
+	void abortUploads();
+	void sendNotice(const std::string &text);
+	std::string getSpoolPath(unsigned long long messageId) const;
+	std::string getTransferPath(unsigned long long messageId, const std::string &hash) const; // file with content of the transfer
+	void terminateChild(); // signal handler of a child: a worker drains its sessions, a session loop closes its session
+	void releaseSession(); // acknowledgements are saved, files are closed, the session leaves the presence table
+	void leavePresence();
+	void closeSession(); // session is released, the client is told it is kicked
+	[[noreturn]] void endSession() const; // a session process exits, a worker throws SessionClosed
 	void cleanExit();
 	std::string getClientIpAndPort() const;
 	std::string getClientIp() const;
 	unsigned short getClientPort() const;
 	void removeUserFromDb(const std::string &) const;
 	void displayHelp() const;
-	void removeSessionByPid(pid_t pid) const;
-	void updateActiveUsers();
 	void listActiveUsers();
+	bool isSessionClosed() const; // session of logged user was kicked or taken over by another process
+	void startSessionTimers(); // unread check, idle timeout and last activity flush
+	void markActivity(); // request from the client
+	void checkUnread();
+	void onUnreadCheckTimer();
+	void onIdleTimer(std::chrono::seconds idleTimeout);
+	void onActivityFlushTimer(std::chrono::seconds flushInterval);
+	void closeDeadSession(const std::string &reason); // free resources of the session without writing to the connection
+	int createListener() const; // listening socket, shared with other acceptors by SO_REUSEPORT
+	void startAcceptors(); // processes accepting connections on their own listeners
+	void closeAcceptorListeners(); // in a child, listeners of the acceptors are kept open by the main process
+	void pinToCpu(size_t index) const; // affinity of the acceptor from AcceptorCpus
+	void acceptClients();
+	void stopAcceptor();
+	void blockSignals(); // signals of the main loop go to signalFd_
+	void restoreSignals(); // in a child which does not run the main loop
+	void handleSignals(); // reads signalFd_
+	void reapChildren(); // all exited children at once
+	void startWorkers(); // prefork pool of the accepting process, WorkerProcesses = 0 keeps a process per client
+	void spawnWorker(size_t index);
+	bool passToWorker(int fd); // connection goes to the least loaded worker, false if all are full
+	void closeWorkerChannels(); // in a child, channels of the pool belong to the accepting process
+	[[noreturn]] void runWorker(int channel);
+	bool receiveConnection(int channel); // false if the accepting process has closed the channel
+	void drain(bool handedOver); // main process: stop accepting, wait for sessions to leave and exit
+	void drainAcceptor();
+	void waitForChildren(); // up to DrainTimeout, then the rest is terminated
+	void drainSession(); // acknowledgements are saved, the client is asked to reconnect
+	void startHandoffServer(); // process giving all listening sockets and the presence table to a new server
+	// listener of the main process first, then those of the acceptors; presenceFd is -1 if the table was not handed over
+	std::vector<int> receiveListeners(int &presenceFd) const;
+	std::unique_ptr<UringIo> createUring() const; // nullptr if the kernel does not support io_uring
+	void releaseInheritedUring(); // in a forked child: the ring of the parent stays intact
+	void startPresenceReporter(); // process copying the presence table to `active_sessions`
+	void reportPresence(Mysql &mysql) const;
 	void printLineFromLog() const;
 	void kickClient(const std::string &cmd);
 
@@ -85,28 +195,170 @@ private:
 	const std::string TEMP_DIR { "/tmp/chat_server" };
 	const std::string CONFIG_FILE{ "server.cfg" };
 	const std::string PROMPT{ "server>" };
+	const std::string DEFAULT_SPOOL_DIR{ "/var/spool/chat_server" };
+	const std::string DEFAULT_MAX_TRANSFER_SIZE{ "104857600" };
+	const std::string DEFAULT_ATTACHMENT_DIR{ "/var/lib/chat_server/attachments" };
+	const std::string DEFAULT_SESSION_LIFETIME{ "3600" };
+	const std::string DEFAULT_PRESENCE_SLOTS{ "4096" };
+	const std::string DEFAULT_PRESENCE_REPORT_INTERVAL{ "5" };
+	const std::string DEFAULT_IDLE_TIMEOUT{ "3600" };
+	const std::string DEFAULT_ACTIVITY_FLUSH_INTERVAL{ "60" };
+	const std::string DEFAULT_HEARTBEAT_INTERVAL{ "30" };
+	const std::string DEFAULT_HEARTBEAT_MISSES{ "3" };
+	const std::string DEFAULT_DRAIN_TIMEOUT{ "30" };
+	const std::string DEFAULT_DRAIN_SPREAD{ "10" };
+	const std::string HANDOFF_SOCKET{ TEMP_DIR + "/handoff.sock" };
+	static constexpr size_t MAX_HANDOFF_LISTENERS{ 252 }; // descriptors in one SCM_RIGHTS message, one more is the presence table
+	static constexpr std::chrono::seconds DRAIN_FLUSH_TIMEOUT{ 2 };
+	const std::string DEFAULT_OUTBOUND_QUEUE_BYTES{ "1048576" };
+	const std::string DEFAULT_OUTBOUND_QUEUE_FRAMES{ "1024" };
 	//const std::string USERLIST_LOCK{ TEMP_DIR + "/userlist.lock" };
-	const int BACKLOG{ 5 };
+	const std::string DEFAULT_LISTEN_BACKLOG{ "128" };
+	const std::string DEFAULT_WORKER_PROCESSES{ "0" };
+	const std::string DEFAULT_WORKER_SESSIONS{ "256" };
+	const std::string DEFAULT_ACCEPTORS{ "1" };
+	static constexpr size_t HISTORY_PAGE_LENGTH{ 20 };
+	static constexpr size_t HISTORY_MAX_PAGE_LENGTH{ 100 };
+	static constexpr size_t SEARCH_RESULTS_LIMIT{ 20 };
+	static constexpr size_t TRANSFER_CHUNK_LENGTH{ 16 * 1024 };
+	static constexpr size_t TRANSFER_CHUNKS_PER_ITERATION{ 8 };
+	static constexpr std::chrono::milliseconds UNREAD_CHECK_INTERVAL{ 500 };
+	static constexpr std::chrono::milliseconds TIMER_TICK{ 10 };
+	static constexpr std::chrono::milliseconds MAX_SELECT_TIMEOUT{ 500 };
+	static constexpr std::chrono::milliseconds TRANSFER_SELECT_TIMEOUT{ 10 };
+	static constexpr size_t DEDUP_WINDOW{ 1024 };
+	static constexpr size_t MAX_CLIENT_ID_LENGTH{ 64 };
+	static constexpr size_t MAX_PENDING_ACKS{ 256 };
+
+	// what to do when the outbound queue of a client exceeds its limits
+	enum class SlowConsumerPolicy {
+		DROP_OLDEST, // drop oldest queued messages
+		COALESCE, // drop queued messages and send unread summary instead
+		DISCONNECT
+	};
+	static SlowConsumerPolicy slowConsumerPolicyFromString(const std::string &name);
 
 #if defined(_WIN64) or defined(_WIN32)
 	std::string getLiteralOSName(OSVERSIONINFOEX &osv) const; // Get literal version, i.e. 5.0 is Windows 2000
 #endif
 
 	std::map<std::string, ChatUser> users_;
-	std::vector<std::shared_ptr<ChatMessage>> messages_;
-	std::set<std::string> activeUsers_;
+	MessageStore messages_;
+	HistoryCache history_; // of the active session, a worker swaps it with the session
+	SearchIndex searchIndex_;
+
+	// transfer being received from this client
+	struct Upload {
+		unsigned long long messageId;
+		int fd;
+		unsigned long long size;
+		unsigned long long received;
+		std::string name;
+		std::string path;
+		std::string hash; // empty for content which is not stored in attachment store
+		SHA256 sha;
+	};
+	// transfer being streamed to this client from the spool or the attachment store
+	struct OutgoingTransfer {
+		int fd;
+		unsigned long long size;
+		unsigned long long offset;
+		std::string path;
+	};
+	// worker process: states of the sessions which are not active now are kept here
+	// and swapped with the members below, so the request handlers work with one session as before
+	struct SessionState {
+		ChatConnection connection;
+		sockaddr_in client{};
+		std::string loggedUser;
+		std::map<std::string, Upload> uploads;
+		std::map<unsigned long long, OutgoingTransfer> outgoingTransfers;
+		std::unique_ptr<TimerWheel> timers{ std::make_unique<TimerWheel>(TIMER_TICK) };
+		TimerWheel::Clock::time_point lastActivity;
+		TimerWheel::Clock::time_point lastHeard;
+		bool activityFlushed{ true };
+		std::unordered_set<std::string> recentClientIds;
+		std::deque<std::string> recentClientIdOrder;
+		std::set<unsigned long long> unacknowledged;
+		std::set<unsigned long long> undelivered;
+		HistoryCache history;
+		std::vector<unsigned long long> pendingAcks;
+		unsigned long long backlogLimit{ 0 };
+		bool summaryPending{ false };
+		size_t reportedOutputBytes{ 0 };
+	};
+	struct WorkerSession {
+		SessionState state;
+		std::unique_ptr<SessionLoop> loop;
+		std::vector<SessionLoop::Task> tasks; // heartbeat, outbound queue, requests of the client
+		std::chrono::steady_clock::time_point due{}; // the loop of the session has work to do
+	};
+	struct SessionClosed {}; // thrown in a worker when the active session is over
+	void swapSession(SessionState &state);
+	bool stepSession(WorkerSession &session, const std::function<void(WorkerSession &)> &step); // false if the session is over
+
+	// worker of the pool as seen by the accepting process
+	struct Worker {
+		pid_t pid;
+		int channel; // connections go to the worker, a byte comes back for every closed session
+		size_t sessions;
+	};
+	std::vector<Worker> workers_;
+	size_t workerSessions_{ 0 }; // limit of sessions of one worker
+	bool isWorker_{ false };
+	bool wokenUp_{ false }; // worker: SIGUSR1 came before this iteration, all sessions check unread messages
+	std::map<int, std::unique_ptr<WorkerSession>> sessions_; // worker process, by descriptor of the client
+	std::chrono::steady_clock::time_point drainDeadline_{}; // outbound queues are flushed until this time
+
+	std::map<std::string, Upload> uploads_;
+	std::map<unsigned long long, OutgoingTransfer> outgoingTransfers_;
+	std::unique_ptr<TimerWheel> timers_{ std::make_unique<TimerWheel>(TIMER_TICK) }; // timers of the active session
+	TimerWheel::Clock::time_point lastActivity_;
+	bool activityFlushed_{ true };
+	TimerWheel::Clock::time_point lastHeard_; // last frame of any kind from the client
+	std::chrono::seconds heartbeatInterval_{ 0 };
+	unsigned heartbeatMisses_{ 3 };
 	std::string loggedUser_;
 	ConfigFile config_{ CONFIG_FILE };
+	AttachmentStore attachments_{ config_.get("AttachmentDir", DEFAULT_ATTACHMENT_DIR) };
 	sockaddr_in server_;
 	sockaddr_in client_;
 	int sockFd_;
+	size_t acceptors_{ 1 };
+	// listeners of the additional acceptors: created by the main process, so they can be handed over
+	// with its own one and no connection waiting in their queues is reset on restart
+	std::vector<int> acceptorListeners_;
+	bool isAcceptor_{ false }; // additional acceptor process, not the main one
+	bool useUring_{ false }; // IoBackend = io_uring and the server is built with liburing
+	std::unique_ptr<UringIo> uring_; // ring of this process: accepting in acceptors, socket I/O in sessions
 	pid_t mainPid_;
 	pid_t consolePid_;
+	pid_t reporterPid_{ 0 };
+	pid_t handoffPid_{ 0 };
+	int signalFd_{ -1 };
+	static constexpr int LOOP_SIGNALS[]{ SIGCHLD, SIGINT, SIGTERM, SIGUSR2 };
+	bool draining_{ false };
+	std::unique_ptr<PresenceTable> presence_; // shared by all processes of the server
 	std::set<pid_t> children_;
 	mutable char message_[MESSAGE_LENGTH];
 	std::atomic_bool mainLoopActive_{ true };
+	// client ids of recently stored messages: set for lookup, queue for eviction
+	std::unordered_set<std::string> recentClientIds_;
+	std::deque<std::string> recentClientIdOrder_;
+	// messages sent to the client and not acknowledged yet are not sent again in this session
+	std::set<unsigned long long> unacknowledged_;
+	// dropped from the queue of a slow client: not pushed again, channel cursors stay below them
+	std::set<unsigned long long> undelivered_;
+	std::vector<unsigned long long> pendingAcks_; // acknowledged, not yet applied to database
+	unsigned long long backlogLimit_{ 0 }; // unread messages up to this id were left at login and are fetched by pages
+	bool summaryPending_{ false };
+	SlowConsumerPolicy slowConsumerPolicy_{ SlowConsumerPolicy::COALESCE };
+	size_t reportedOutputBytes_{ 0 }; // queue depth last written to the presence table
+	volatile std::sig_atomic_t wakeUp_{ 0 }; // new messages are waiting, set by SIGUSR1
+	volatile std::sig_atomic_t drainRequested_{ 0 }; // server is draining, set by SIGUSR2
+	volatile std::sig_atomic_t terminateRequested_{ 0 }; // session process got SIGTERM or SIGINT
 	std::unique_ptr<Logger> logger_;
-	int connection_;
+	mutable ChatConnection connection_;
 	Mysql mysql_;
 };
 
@@ -56,29 +56,11 @@ void ChatUser::login(Mysql &mysql, const std::string &ip, const unsigned short p
 		"WHERE "
 			"`id` = " << user_id_;
 	mysql.query(ss.str());
-	ss.str(std::string{});
-	ss << "DELETE FROM `active_sessions` WHERE `user_id` = " << user_id_;
-	mysql.query(ss.str());
-	ss.str(std::string{});
-	ss << "INSERT INTO `active_sessions` ( "
-			"`user_id`, "
-			"`ip`, "
-			"`pid`, "
-			"`port` "
-		") VALUES ("
-			<< user_id_ << ", "
-			"INET_ATON('" << ip << "'), "
-			<< pid << ", "
-			<< port
-		<< ")";
-	mysql.query(ss.str());
+	// the session itself is registered in the presence table
 	setLoggedIn();
 }
 
-void ChatUser::logout(Mysql &mysql) {
-	std::stringstream ss;
-	ss << "DELETE FROM `active_sessions` WHERE `user_id` = " << user_id_;
-	mysql.query(ss.str());
+void ChatUser::logout() {
 	setLoggedOut();
 }
 
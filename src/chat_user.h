@@ -22,7 +22,7 @@ public:
 	unsigned getUserId() const;
 	bool isLoggedIn() const;
 	void login(Mysql &mysql, const std::string &ip, unsigned short port, unsigned short pid);
-	void logout(Mysql &mysql);
+	void logout();
 	void save(Mysql &mysql) const;
 	void setLoggedIn();
 	void setLoggedOut();
@@ -5,6 +5,13 @@ int main() {
 		static ChatClient chat;
 		signal(SIGTERM, [](int signum){ chat.sigTermHandler(signum); });
 		signal(SIGINT, [](int signum){ chat.sigIntHandler(signum); });
+		// writing to a lost connection must fail instead of killing the process
+		signal(SIGPIPE, SIG_IGN);
+		// without SA_RESTART: reading of user input is interrupted to reconnect at once
+		struct sigaction action{};
+		action.sa_handler = [](int signum){ chat.connectionLostHandler(signum); };
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGUSR1, &action, nullptr);
 		chat.work();
 	}
 	catch (const std::runtime_error &e) {
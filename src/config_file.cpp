@@ -30,3 +30,10 @@ const std::string &ConfigFile::operator[](const std::string &index) const {
 	return options_.at(index);
 }
 
+std::string ConfigFile::get(const std::string &index, const std::string &defaultValue) const {
+	auto it = options_.find(index);
+	if (it == options_.end()) {
+		return defaultValue;
+	}
+	return it->second;
+}
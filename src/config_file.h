@@ -12,6 +12,8 @@ public:
 	ConfigFile(const std::string &);
 	ConfigFile() = delete;
 	const std::string &operator[](const std::string &) const;
+	// value of the option or default value if the option is not set
+	std::string get(const std::string &, const std::string &) const;
 
 private:
 	std::map<std::string, std::string> options_;
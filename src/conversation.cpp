@@ -0,0 +1,62 @@
+#include "conversation.h"
+#include "SHA256.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+std::string Conversation::broadcast() {
+	return "*";
+}
+
+std::string Conversation::channel(const std::string &name) {
+	return "#" + name;
+}
+
+std::string Conversation::participants(std::vector<std::string> logins) {
+	std::sort(logins.begin(), logins.end());
+	logins.erase(std::unique(logins.begin(), logins.end()), logins.end());
+	std::string key{ "@" };
+	for (size_t i = 0; i < logins.size(); ++i) {
+		key += (i == 0 ? "" : ",") + logins[i];
+	}
+	if (key.length() <= MAX_KEY_LENGTH) {
+		return key;
+	}
+	// long lists of participants are replaced with their hash
+	SHA256 sha;
+	sha.update(key);
+	uint8_t *digest = sha.digest();
+	key = "@" + SHA256::toString(digest);
+	delete[] digest;
+	return key;
+}
+
+unsigned long long Conversation::nextSequence(Mysql &mysql, const std::string &key) {
+	// LAST_INSERT_ID(expr) makes the counter value visible to this connection only
+	std::stringstream ss;
+	ss << "INSERT INTO `conversations` (`id`, `last_seq`) VALUES ('" << key << "', LAST_INSERT_ID(1)) "
+		"ON DUPLICATE KEY UPDATE `last_seq` = LAST_INSERT_ID(`last_seq` + 1)";
+	if (!mysql.query(ss.str())) {
+		throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+	}
+	mysql.query("SELECT LAST_INSERT_ID()");
+	auto rows = mysql.fetchAll();
+	return std::stoull(rows.front().at(0));
+}
+
+void Conversation::releaseSequence(Mysql &mysql, const std::string &key, const unsigned long long seq) {
+	std::stringstream ss;
+	ss << "UPDATE `conversations` SET `last_seq` = `last_seq` - 1 WHERE `id` = '" << key << "' AND `last_seq` = " << seq;
+	mysql.query(ss.str());
+}
+
+void Conversation::addUnread(Mysql &mysql, const std::string &key, const std::string &users_query) {
+	std::stringstream ss;
+	ss << "INSERT INTO `unread_counters` (`user_id`, `conversation`, `count`) "
+		"SELECT `recipients`.`user_id`, '" << key << "', 1 FROM (" << users_query << ") AS `recipients` "
+		"ON DUPLICATE KEY UPDATE `count` = `count` + 1";
+	if (!mysql.query(ss.str())) {
+		throw std::runtime_error{ std::string{ "MySQL error: " } + mysql.getError() };
+	}
+}
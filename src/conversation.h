@@ -0,0 +1,29 @@
+#pragma once
+#include "mysql.h"
+
+#include <string>
+#include <vector>
+
+// Conversation keys and per-conversation sequence numbers.
+// Keys: "*" for broadcast, "#name" for channel, "@login1,login2,..." with sorted
+// logins of all participants for private messages
+class Conversation final {
+public:
+	static const size_t MAX_KEY_LENGTH{ 255 };
+
+	static std::string broadcast();
+	static std::string channel(const std::string &name);
+	static std::string participants(std::vector<std::string> logins);
+
+	// next sequence number of the conversation, starting from 1;
+	// increment is atomic, so it is safe for concurrent server processes
+	static unsigned long long nextSequence(Mysql &mysql, const std::string &key);
+
+	// give back the number of a message which has not been stored,
+	// unless a later number of the conversation has been taken already
+	static void releaseSequence(Mysql &mysql, const std::string &key, unsigned long long seq);
+
+	// materialized unread counters: one more unread message of the conversation
+	// for every user selected by users_query (SELECT of user ids)
+	static void addUnread(Mysql &mysql, const std::string &key, const std::string &users_query);
+};
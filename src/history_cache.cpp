@@ -0,0 +1,66 @@
+#include "history_cache.h"
+
+#include <algorithm>
+
+unsigned long long HistoryCache::getNewestId(const std::string &conversation) const {
+	auto it = tails_.find(conversation);
+	if (it == tails_.end() || it->second.entries.empty()) {
+		return 0;
+	}
+	return it->second.entries.back().id;
+}
+
+void HistoryCache::appendNewer(const std::string &conversation, const std::vector<HistoryEntry> &newer, const bool reachedBeginning) {
+	auto &tail = tails_[conversation];
+	if (tail.entries.empty() || newer.size() >= TAIL_LENGTH) {
+		tail.entries.clear();
+		tail.reachedBeginning = reachedBeginning;
+	}
+	for (const auto &entry: newer) {
+		if (!tail.entries.empty() && entry.id <= tail.entries.back().id) {
+			continue;
+		}
+		tail.entries.push_back(entry);
+	}
+	while (tail.entries.size() > TAIL_LENGTH) {
+		tail.entries.pop_front();
+		tail.reachedBeginning = false;
+	}
+}
+
+bool HistoryCache::getPage(
+	const std::string &conversation,
+	const unsigned long long before_id,
+	const size_t limit,
+	std::vector<HistoryEntry> &page
+	) const {
+	auto it = tails_.find(conversation);
+	if (it == tails_.end() || it->second.entries.empty()) {
+		return false;
+	}
+	const auto &tail = it->second;
+	if (before_id != 0 && before_id <= tail.entries.front().id) {
+		return false; // page starts before the cached tail
+	}
+
+	// first entry with id >= before_id
+	auto end = before_id == 0 ?
+		tail.entries.end() :
+		std::lower_bound(tail.entries.begin(), tail.entries.end(), before_id,
+			[](const HistoryEntry &entry, unsigned long long id) { return entry.id < id; });
+	size_t available = end - tail.entries.begin();
+	if (available < limit && !tail.reachedBeginning) {
+		return false;
+	}
+
+	page.clear();
+	for (auto entry = end; entry != tail.entries.begin() && page.size() < limit; ) {
+		--entry;
+		page.push_back(*entry);
+	}
+	return true;
+}
+
+void HistoryCache::clear() {
+	tails_.clear();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+struct HistoryEntry {
+	unsigned long long id;
+	std::string sent;
+	std::string sender;
+	std::string text;
+};
+
+// Recent tail of every conversation the client has looked at, one cache per session.
+// Entries are kept in ascending id order without gaps
+class HistoryCache final {
+public:
+	// newest cached id of the conversation or 0 if nothing is cached
+	unsigned long long getNewestId(const std::string &conversation) const;
+
+	// add entries newer than the cached tail. When newer is not contiguous with the tail
+	// (it holds a full TAIL_LENGTH page) the old tail is dropped
+	void appendNewer(const std::string &conversation, const std::vector<HistoryEntry> &newer, bool reachedBeginning);
+
+	// fill page with at most limit entries older than before_id (newest first).
+	// Returns false if the cache can not answer the request completely
+	bool getPage(const std::string &conversation, unsigned long long before_id, size_t limit, std::vector<HistoryEntry> &page) const;
+
+	void clear(); // the user has logged out
+
+	static constexpr size_t TAIL_LENGTH{ 200 };
+
+private:
+	struct Tail {
+		std::deque<HistoryEntry> entries;
+		bool reachedBeginning{ false }; // there is nothing older than entries.front()
+	};
+
+	std::map<std::string, Tail> tails_;
+};
@@ -0,0 +1,230 @@
+#include "local_history.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+	const char MAGIC[8]{ 'C', 'H', 'A', 'T', 'H', 'I', 'S', '1' };
+
+	std::string toLower(std::string text) {
+		std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+		return text;
+	}
+
+	// exclusive lock of the file for the lifetime of the object
+	class FileLock final {
+	public:
+		explicit FileLock(int fd) : fd_{ fd } { flock(fd_, LOCK_EX); }
+		~FileLock() { flock(fd_, LOCK_UN); }
+	private:
+		int fd_;
+	};
+}
+
+LocalHistory::LocalHistory(const std::string &path) {
+	fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+	if (fd_ == -1) {
+		throw std::runtime_error{ "Can not open local history file " + path + ": " + strerror(errno) };
+	}
+	FileLock lock{ fd_ };
+	struct stat st;
+	fstat(fd_, &st);
+	if (static_cast<size_t>(st.st_size) < sizeof(FileHeader)) {
+		if (ftruncate(fd_, GROWTH) == -1) {
+			throw std::runtime_error{ std::string{ "Can not create local history file: " } + strerror(errno) };
+		}
+		remap(GROWTH);
+		memcpy(header()->magic, MAGIC, sizeof(MAGIC));
+		header()->used = sizeof(FileHeader);
+	}
+	else {
+		remap(st.st_size);
+		if (memcmp(header()->magic, MAGIC, sizeof(MAGIC)) != 0) {
+			throw std::runtime_error{ "File " + path + " is not a local history file" };
+		}
+	}
+	indexed_ = sizeof(FileHeader);
+	refresh();
+}
+
+LocalHistory::~LocalHistory() {
+	if (data_ != nullptr) {
+		munmap(data_, mapped_);
+	}
+	if (fd_ != -1) {
+		close(fd_);
+	}
+}
+
+LocalHistory::FileHeader *LocalHistory::header() const {
+	return reinterpret_cast<FileHeader *>(data_);
+}
+
+const LocalHistory::RecordHeader *LocalHistory::recordAt(const uint64_t offset) const {
+	return reinterpret_cast<const RecordHeader *>(data_ + offset);
+}
+
+void LocalHistory::remap(const size_t size) {
+	if (data_ != nullptr) {
+		munmap(data_, mapped_);
+	}
+	void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (data == MAP_FAILED) {
+		data_ = nullptr;
+		mapped_ = 0;
+		throw std::runtime_error{ std::string{ "Can not map local history file: " } + strerror(errno) };
+	}
+	data_ = static_cast<char *>(data);
+	mapped_ = size;
+}
+
+bool LocalHistory::isValidRecord(const uint64_t offset, const uint64_t used) const {
+	if (used - offset < sizeof(RecordHeader)) {
+		return false;
+	}
+	auto record = recordAt(offset);
+	// zero length would never advance the offset, oversize one would read past the records
+	if (record->length < sizeof(RecordHeader) || record->length % 8 != 0 || record->length > used - offset) {
+		return false;
+	}
+	uint64_t content = static_cast<uint64_t>(record->conversationLength) + record->senderLength + record->textLength;
+	return content <= record->length - sizeof(RecordHeader);
+}
+
+void LocalHistory::refresh() {
+	auto used = std::atomic_ref<uint64_t>{ header()->used }.load(std::memory_order_acquire);
+	if (used > mapped_) {
+		struct stat st;
+		fstat(fd_, &st);
+		remap(st.st_size);
+		if (used > mapped_) {
+			// records can not lie beyond the end of the file
+			used = mapped_;
+			std::atomic_ref<uint64_t>{ header()->used }.store(used, std::memory_order_release);
+		}
+	}
+	while (indexed_ < used) {
+		if (!isValidRecord(indexed_, used)) {
+			// the file is corrupted from here, the tail is dropped and overwritten by next records
+			std::atomic_ref<uint64_t>{ header()->used }.store(indexed_, std::memory_order_release);
+			break;
+		}
+		auto record = recordAt(indexed_);
+		std::string conversation{ data_ + indexed_ + sizeof(RecordHeader), record->conversationLength };
+		index_[conversation].push_back(indexed_);
+		records_.push_back(indexed_);
+		indexed_ += record->length;
+	}
+}
+
+void LocalHistory::append(const std::string &conversation, const std::string &sender, const std::string &text, const uint64_t seq) {
+	FileLock lock{ fd_ };
+	refresh();
+	size_t length = sizeof(RecordHeader) + conversation.length() + sender.length() + text.length();
+	length = (length + 7) & ~static_cast<size_t>(7);
+	auto used = header()->used;
+	if (used + length > mapped_) {
+		// the file grows by big steps, so remapping is rare
+		size_t size = mapped_ + std::max(GROWTH, length);
+		if (ftruncate(fd_, size) == -1) {
+			throw std::runtime_error{ std::string{ "Can not grow local history file: " } + strerror(errno) };
+		}
+		remap(size);
+	}
+
+	auto record = reinterpret_cast<RecordHeader *>(data_ + used);
+	record->length = length;
+	record->conversationLength = conversation.length();
+	record->senderLength = sender.length();
+	record->textLength = text.length();
+	record->seq = seq;
+	record->time = std::time(nullptr);
+	char *dst = data_ + used + sizeof(RecordHeader);
+	memcpy(dst, conversation.data(), conversation.length());
+	dst += conversation.length();
+	memcpy(dst, sender.data(), sender.length());
+	dst += sender.length();
+	memcpy(dst, text.data(), text.length());
+	// the record becomes visible to readers only when it is complete
+	std::atomic_ref<uint64_t>{ header()->used }.store(used + length, std::memory_order_release);
+	refresh();
+}
+
+LocalHistory::Entry LocalHistory::makeEntry(const uint64_t offset, const size_t position) const {
+	auto record = recordAt(offset);
+	const char *src = data_ + offset + sizeof(RecordHeader);
+	Entry entry;
+	entry.position = position;
+	entry.seq = record->seq;
+	entry.time = record->time;
+	entry.conversation.assign(src, record->conversationLength);
+	src += record->conversationLength;
+	entry.sender.assign(src, record->senderLength);
+	src += record->senderLength;
+	entry.text.assign(src, record->textLength);
+	return entry;
+}
+
+std::vector<LocalHistory::Entry> LocalHistory::getPage(const std::string &conversation, size_t before, const size_t limit) {
+	refresh();
+	std::vector<Entry> result;
+	auto it = index_.find(conversation);
+	if (it == index_.end()) {
+		return result;
+	}
+	const auto &offsets = it->second;
+	if (before == 0 || before > offsets.size()) {
+		before = offsets.size() + 1;
+	}
+	size_t first = before - 1 > limit ? before - 1 - limit : 0;
+	for (size_t i = first; i < before - 1; ++i) {
+		result.push_back(makeEntry(offsets[i], i + 1));
+	}
+	return result;
+}
+
+std::vector<LocalHistory::Entry> LocalHistory::search(const std::string &query, const size_t limit) {
+	refresh();
+	std::vector<std::string> words;
+	std::string word;
+	for (unsigned char c: query + ' ') {
+		if (std::isspace(c)) {
+			if (!word.empty()) {
+				words.push_back(toLower(word));
+			}
+			word.clear();
+		}
+		else {
+			word += static_cast<char>(c);
+		}
+	}
+	std::vector<Entry> result;
+	if (words.empty()) {
+		return result;
+	}
+	// the file is scanned in place, newest records first
+	for (auto it = records_.rbegin(); it != records_.rend() && result.size() < limit; ++it) {
+		auto record = recordAt(*it);
+		const char *src = data_ + *it + sizeof(RecordHeader);
+		auto text = toLower(std::string{ src + record->conversationLength + record->senderLength, record->textLength });
+		bool matches = std::all_of(words.begin(), words.end(),
+			[&text](const std::string &word) { return text.find(word) != std::string::npos; });
+		if (!matches) {
+			continue;
+		}
+		std::string conversation{ src, record->conversationLength };
+		const auto &offsets = index_.at(conversation);
+		size_t position = std::lower_bound(offsets.begin(), offsets.end(), *it) - offsets.begin() + 1;
+		result.push_back(makeEntry(*it, position));
+	}
+	return result;
+}
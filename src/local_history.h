@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Client-side message history in an append-only memory-mapped file.
+// Records are indexed by conversation key and ordered by arrival; the
+// poller and the main process share the file, appends are serialized with flock()
+class LocalHistory final {
+public:
+	struct Entry {
+		size_t position; // 1-based position in the conversation
+		uint64_t seq; // sequence number in the conversation, 0 for own messages
+		int64_t time;
+		std::string conversation;
+		std::string sender;
+		std::string text;
+	};
+
+	explicit LocalHistory(const std::string &path);
+	LocalHistory(const LocalHistory &) = delete;
+	LocalHistory &operator=(const LocalHistory &) = delete;
+	~LocalHistory();
+
+	void append(const std::string &conversation, const std::string &sender, const std::string &text, uint64_t seq);
+
+	// up to limit messages of the conversation before position (0 for the newest ones), oldest first
+	std::vector<Entry> getPage(const std::string &conversation, size_t before, size_t limit);
+
+	// newest messages containing all words of the query, case-insensitive
+	std::vector<Entry> search(const std::string &query, size_t limit);
+
+private:
+	struct FileHeader {
+		char magic[8];
+		uint64_t used; // bytes of the file taken by header and records
+	};
+	struct RecordHeader {
+		uint32_t length; // whole record, aligned to 8 bytes
+		uint32_t conversationLength;
+		uint32_t senderLength;
+		uint32_t textLength;
+		uint64_t seq;
+		int64_t time;
+	};
+
+	static constexpr size_t GROWTH{ 1024 * 1024 };
+
+	FileHeader *header() const;
+	const RecordHeader *recordAt(uint64_t offset) const;
+	Entry makeEntry(uint64_t offset, size_t position) const;
+	bool isValidRecord(uint64_t offset, uint64_t used) const;
+	void remap(size_t size);
+	void refresh(); // map the file grown by the other process and index new records
+
+	int fd_{ -1 };
+	char *data_{ nullptr };
+	size_t mapped_{ 0 };
+	uint64_t indexed_{ 0 };
+	std::unordered_map<std::string, std::vector<uint64_t>> index_; // conversation -> record offsets
+	std::vector<uint64_t> records_; // all record offsets in arrival order
+};
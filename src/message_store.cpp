@@ -0,0 +1,136 @@
+#include "message_store.h"
+
+#include <stdexcept>
+
+MessageStore::MessageStore() {
+	records_.reserve(256);
+	text_.reserve(ARENA_INITIAL_SIZE / 2);
+}
+
+uint32_t MessageStore::intern(const std::string &login) {
+	auto it = loginIds_.find(std::string_view{ login });
+	if (it != loginIds_.end()) {
+		return it->second;
+	}
+	uint32_t id = logins_.size();
+	auto inserted = loginIds_.emplace(std::pmr::string{ login, &arena_ }, id).first;
+	logins_.emplace_back(inserted->first);
+	return id;
+}
+
+uint32_t MessageStore::appendText(const std::string &text) {
+	uint32_t offset = text_.size();
+	text_.insert(text_.end(), text.begin(), text.end());
+	return offset;
+}
+
+size_t MessageStore::addPrivate(const std::string &sender, const std::string &receiver, const std::string &text, const bool read) {
+	PrivateRecord record;
+	record.sender = intern(sender);
+	record.receiver = intern(receiver);
+	record.text_offset = appendText(text);
+	record.text_length = text.length();
+	record.conversation = NO_CONVERSATION;
+	record.seq = 0;
+	record.previous_seq = 0;
+	record.id = 0;
+	record.read = read;
+	records_.emplace_back(record);
+	return records_.size() - 1;
+}
+
+size_t MessageStore::addBroadcast(const std::string &sender, const std::string &text, const RecipientSet &users_unread) {
+	// the set is created with the arena first, assignment copies the bitmap into it
+	BroadcastRecord record{
+		.sender = intern(sender),
+		.text_offset = appendText(text),
+		.text_length = static_cast<uint32_t>(text.length()),
+		.conversation = NO_CONVERSATION,
+		.seq = 0,
+		.previous_seq = 0,
+		.id = 0,
+		.users_unread = RecipientSet{ &arena_ }
+	};
+	record.users_unread = users_unread;
+	records_.emplace_back(std::move(record));
+	return records_.size() - 1;
+}
+
+void MessageStore::setSequence(
+	const size_t index,
+	const std::string &conversation,
+	const unsigned long long seq,
+	const unsigned long long previous_seq,
+	const unsigned long long id
+	) {
+	auto conversation_id = intern(conversation);
+	std::visit([&](auto &record) {
+		record.conversation = conversation_id;
+		record.seq = seq;
+		record.previous_seq = previous_seq;
+		record.id = id;
+	}, at(index));
+}
+
+const MessageRecord &MessageStore::at(const size_t index) const {
+	return records_.at(index);
+}
+
+MessageRecord &MessageStore::at(const size_t index) {
+	return records_.at(index);
+}
+
+std::string_view MessageStore::getLogin(const uint32_t login_id) const {
+	return logins_.at(login_id);
+}
+
+std::string_view MessageStore::getSender(const size_t index) const {
+	return std::visit([this](const auto &record) { return getLogin(record.sender); }, at(index));
+}
+
+std::string_view MessageStore::getText(const size_t index) const {
+	return std::visit([this](const auto &record) {
+		return std::string_view{ text_.data() + record.text_offset, record.text_length };
+	}, at(index));
+}
+
+std::string MessageStore::createTransferString(const size_t index) const {
+	std::string result{ std::holds_alternative<PrivateRecord>(at(index)) ? "PRIVATE\n" : "BROADCAST\n" };
+	// conversation and sequence numbers let the receiver drop duplicates and find gaps
+	std::visit([&](const auto &record) {
+		if (record.conversation != NO_CONVERSATION) {
+			result += getLogin(record.conversation);
+			result += '\n';
+			result += std::to_string(record.seq);
+			result += ':';
+			result += std::to_string(record.previous_seq);
+			result += ':';
+			result += std::to_string(record.id);
+			result += '\n';
+		}
+	}, at(index));
+	result += getSender(index);
+	result += '\n';
+	result += getText(index);
+	result += '\n';
+	return result;
+}
+
+size_t MessageStore::size() const {
+	return records_.size();
+}
+
+bool MessageStore::empty() const {
+	return records_.empty();
+}
+
+void MessageStore::clear() {
+	// containers must drop their buffers before the arena is released
+	records_ = std::pmr::vector<MessageRecord>{ &arena_ };
+	text_ = std::pmr::vector<char>{ &arena_ };
+	logins_ = std::pmr::vector<std::string_view>{ &arena_ };
+	loginIds_ = LoginMap{ &arena_ };
+	arena_.release();
+	records_.reserve(256);
+	text_.reserve(ARENA_INITIAL_SIZE / 2);
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "recipient_set.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+// Compact message records. Strings are kept in the store's text slab
+// and referenced by offset, logins and conversation keys are interned to small ids
+struct PrivateRecord {
+	uint32_t sender;
+	uint32_t receiver;
+	uint32_t text_offset;
+	uint32_t text_length;
+	uint32_t conversation;
+	uint64_t seq;
+	uint64_t previous_seq; // previous message of the conversation sent by somebody else
+	uint64_t id; // message id acknowledged by the receiver
+	bool read;
+};
+
+struct BroadcastRecord {
+	uint32_t sender;
+	uint32_t text_offset;
+	uint32_t text_length;
+	uint32_t conversation;
+	uint64_t seq;
+	uint64_t previous_seq; // previous message of the conversation sent by somebody else
+	uint64_t id; // message id acknowledged by the receiver
+	RecipientSet users_unread; // bitmap is in the arena of the store
+};
+
+using MessageRecord = std::variant<PrivateRecord, BroadcastRecord>;
+
+// Batch of messages allocated from one arena. Nothing is freed one by one:
+// clear() drops the whole batch and reuses the arena for the next one
+class MessageStore final {
+public:
+	MessageStore();
+	MessageStore(const MessageStore &) = delete;
+	MessageStore &operator=(const MessageStore &) = delete;
+
+	size_t addPrivate(const std::string &sender, const std::string &receiver, const std::string &text, bool read = false);
+	size_t addBroadcast(const std::string &sender, const std::string &text, const RecipientSet &users_unread);
+
+	// position of the message in its conversation and its id, carried in the transfer string
+	void setSequence(size_t index, const std::string &conversation, unsigned long long seq, unsigned long long previous_seq, unsigned long long id);
+
+	const MessageRecord &at(size_t index) const;
+	MessageRecord &at(size_t index);
+	std::string_view getSender(size_t index) const;
+	std::string_view getText(size_t index) const;
+	std::string_view getLogin(uint32_t login_id) const;
+
+	// pack string with message information for transferring it through a network
+	std::string createTransferString(size_t index) const;
+
+	size_t size() const;
+	bool empty() const;
+	void clear();
+
+private:
+	static const size_t ARENA_INITIAL_SIZE{ 64 * 1024 };
+
+	uint32_t intern(const std::string &login);
+	static const uint32_t NO_CONVERSATION{ 0xffffffff };
+	uint32_t appendText(const std::string &text);
+
+	std::pmr::monotonic_buffer_resource arena_{ ARENA_INITIAL_SIZE };
+	std::pmr::vector<MessageRecord> records_{ &arena_ };
+	std::pmr::vector<char> text_{ &arena_ };
+	struct LoginHash {
+		using is_transparent = void;
+		size_t operator()(std::string_view login) const { return std::hash<std::string_view>{}(login); }
+	};
+	using LoginMap = std::pmr::unordered_map<std::pmr::string, uint32_t, LoginHash, std::equal_to<>>;
+
+	// map nodes are stable, so logins_ may point to their keys
+	LoginMap loginIds_{ &arena_ };
+	std::pmr::vector<std::string_view> logins_{ &arena_ };
+};
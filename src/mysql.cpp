@@ -48,6 +48,10 @@ bool Mysql::query(const std::string &req) {
 const std::string &Mysql::getError() const {
 	return error_;
 }
+
+unsigned Mysql::getErrorNumber() {
+	return mysql_errno(&connfd_);
+}
 std::list<std::vector<std::string>> &Mysql::fetchAll() {
 	fields_.clear();
 	if (result_ == nullptr) {
@@ -6,6 +6,7 @@
 
 extern "C" {
 	#include <mysql.h>
+	#include <mysqld_error.h>
 }
 
 class Mysql {
@@ -18,6 +19,7 @@ public:
 		const std::string &dbpassword);
 	bool query(const std::string &req);
 	const std::string &getError() const;
+	unsigned getErrorNumber(); // MySQL error code of the last query, e.g. ER_DUP_ENTRY
 	std::list<std::vector<std::string>> &fetchAll();
 
 	~Mysql();
@@ -0,0 +1,313 @@
+#include "presence_table.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PresenceTable::PresenceTable(const size_t capacity) : capacity_{ capacity } {
+	if (capacity_ == 0) {
+		throw std::invalid_argument{ "Presence table can not be empty" };
+	}
+	static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int64_t>::is_always_lock_free,
+		"shared memory needs lock-free atomics");
+	// shared mapping of a memfd is inherited by fork(), can be handed over and is zero-filled
+	fd_ = memfd_create("chat_presence", MFD_CLOEXEC);
+	auto size = sizeof(Header) + capacity_ * sizeof(Slot);
+	if (fd_ == -1 || ftruncate(fd_, static_cast<off_t>(size)) == -1) {
+		auto error = errno;
+		if (fd_ != -1) {
+			close(fd_);
+		}
+		throw std::runtime_error{ std::string{ "Can not create presence table: " } + strerror(error) };
+	}
+	map(size);
+	header_ = new (data_) Header{};
+	header_->header_size = sizeof(Header);
+	header_->slot_size = sizeof(Slot);
+	header_->capacity = capacity_;
+	slots_ = reinterpret_cast<Slot *>(static_cast<char *>(data_) + sizeof(Header));
+	for (size_t i = 0; i < capacity_; ++i) {
+		new (&slots_[i]) Slot{};
+	}
+}
+
+std::unique_ptr<PresenceTable> PresenceTable::attach(const int fd) {
+	std::unique_ptr<PresenceTable> table{ new PresenceTable };
+	table->fd_ = fd;
+	struct stat status;
+	if (fstat(fd, &status) == -1 || static_cast<size_t>(status.st_size) < sizeof(Header)) {
+		throw std::runtime_error{ "Handed over presence table is invalid" };
+	}
+	table->map(static_cast<size_t>(status.st_size));
+	// the running server has created the objects, they are used in place
+	table->header_ = static_cast<Header *>(table->data_);
+	if (table->header_->header_size != sizeof(Header) || table->header_->slot_size != sizeof(Slot) ||
+		table->mapped_ != sizeof(Header) + table->header_->capacity * sizeof(Slot)) {
+		throw std::runtime_error{ "Handed over presence table has another layout" };
+	}
+	table->capacity_ = table->header_->capacity;
+	table->slots_ = reinterpret_cast<Slot *>(static_cast<char *>(table->data_) + sizeof(Header));
+	return table;
+}
+
+void PresenceTable::map(const size_t size) {
+	data_ = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (data_ == MAP_FAILED) {
+		data_ = nullptr;
+		throw std::runtime_error{ std::string{ "Can not map presence table: " } + strerror(errno) };
+	}
+	mapped_ = size;
+}
+
+PresenceTable::~PresenceTable() {
+	if (data_ != nullptr) {
+		munmap(data_, mapped_);
+	}
+	if (fd_ != -1) {
+		close(fd_);
+	}
+}
+
+PresenceTable::Slot *PresenceTable::find(const unsigned user_id, const bool insert) const {
+	const uint64_t key = static_cast<uint64_t>(user_id) + 1;
+	for (size_t i = 0; i < capacity_; ++i) {
+		auto &slot = slots_[(user_id + i) % capacity_];
+		auto current = slot.key.load(std::memory_order_acquire);
+		if (current == key) {
+			return &slot;
+		}
+		if (current == 0) {
+			break; // keys are never cleared, so the user has no slot
+		}
+	}
+	if (!insert) {
+		return nullptr;
+	}
+	auto &guard = header_->insert_lock;
+	uint32_t unlocked = 0;
+	while (!guard.compare_exchange_weak(unlocked, 1, std::memory_order_acquire)) {
+		unlocked = 0;
+	}
+	auto slot = claim(key);
+	guard.store(0, std::memory_order_release);
+	return slot;
+}
+
+PresenceTable::Slot *PresenceTable::claim(const uint64_t key) const {
+	// the user may have got a slot while the lock was taken
+	Slot *reusable = nullptr;
+	Slot *free = nullptr;
+	for (size_t i = 0; i < capacity_; ++i) {
+		auto &slot = slots_[(key - 1 + i) % capacity_];
+		auto current = slot.key.load(std::memory_order_acquire);
+		if (current == key) {
+			return &slot;
+		}
+		if (current == 0) {
+			free = &slot;
+			break;
+		}
+		if (reusable == nullptr && slot.state.load(std::memory_order_relaxed) == static_cast<uint32_t>(State::OFFLINE)) {
+			reusable = &slot;
+		}
+	}
+	if (reusable != nullptr) {
+		lock(*reusable);
+		// the old user may have logged in again since the check
+		if (reusable->state.load(std::memory_order_relaxed) == static_cast<uint32_t>(State::OFFLINE)) {
+			reusable->key.store(key, std::memory_order_relaxed);
+			reusable->pid.store(0, std::memory_order_relaxed);
+			unlock(*reusable);
+			return reusable;
+		}
+		unlock(*reusable);
+	}
+	if (free != nullptr) {
+		free->key.store(key, std::memory_order_release);
+	}
+	return free;
+}
+
+bool PresenceTable::owns(const Slot &slot, const unsigned user_id) {
+	// a writer holding the slot pointer checks under the slot lock that it was not given to another user
+	return slot.key.load(std::memory_order_relaxed) == static_cast<uint64_t>(user_id) + 1;
+}
+
+void PresenceTable::lock(Slot &slot) {
+	// writers of one slot are rare: the session process, the console and the main process
+	while (true) {
+		auto version = slot.version.load(std::memory_order_relaxed);
+		if ((version & 1) == 0 &&
+			slot.version.compare_exchange_weak(version, version + 1, std::memory_order_acquire)) {
+			return;
+		}
+	}
+}
+
+void PresenceTable::unlock(Slot &slot) {
+	slot.version.fetch_add(1, std::memory_order_release);
+}
+
+PresenceTable::Session PresenceTable::read(const Slot &slot) {
+	Session session;
+	uint32_t before, after;
+	do {
+		before = slot.version.load(std::memory_order_acquire);
+		session.user_id = static_cast<unsigned>(slot.key.load(std::memory_order_relaxed) - 1);
+		session.state = static_cast<State>(slot.state.load(std::memory_order_relaxed));
+		session.pid = slot.pid.load(std::memory_order_relaxed);
+		session.ip = slot.ip.load(std::memory_order_relaxed);
+		session.port = static_cast<uint16_t>(slot.port.load(std::memory_order_relaxed));
+		session.since = slot.since.load(std::memory_order_relaxed);
+		session.last_activity = slot.last_activity.load(std::memory_order_relaxed);
+		session.outbound_bytes = slot.outbound.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		after = slot.version.load(std::memory_order_relaxed);
+	} while ((before & 1) != 0 || before != after);
+	return session;
+}
+
+bool PresenceTable::setOnline(const unsigned user_id, const pid_t pid, const uint32_t ip, const uint16_t port, const bool replace) {
+	Slot *slot;
+	while (true) {
+		slot = find(user_id, true);
+		if (slot == nullptr) {
+			return false;
+		}
+		lock(*slot);
+		if (owns(*slot, user_id)) {
+			break;
+		}
+		unlock(*slot);
+	}
+	auto now = static_cast<int64_t>(time(nullptr));
+	// check and update are done under the slot lock, so two logins can not both succeed
+	if (!replace && slot->state.load(std::memory_order_relaxed) != static_cast<uint32_t>(State::OFFLINE) &&
+		(slot->pid.load(std::memory_order_relaxed) != pid || slot->port.load(std::memory_order_relaxed) != port)) {
+		unlock(*slot);
+		return false;
+	}
+	slot->pid.store(pid, std::memory_order_relaxed);
+	slot->ip.store(ip, std::memory_order_relaxed);
+	slot->port.store(port, std::memory_order_relaxed);
+	slot->since.store(now, std::memory_order_relaxed);
+	slot->last_activity.store(now, std::memory_order_relaxed);
+	slot->outbound.store(0, std::memory_order_relaxed);
+	slot->state.store(static_cast<uint32_t>(State::ONLINE), std::memory_order_relaxed);
+	unlock(*slot);
+	header_->generation.fetch_add(1, std::memory_order_release);
+	return true;
+}
+
+void PresenceTable::setOffline(const unsigned user_id, const pid_t pid, const uint16_t port) {
+	auto slot = find(user_id, false);
+	if (slot == nullptr) {
+		return;
+	}
+	lock(*slot);
+	// the session may have been taken over by another process or another session of the worker
+	bool owned = owns(*slot, user_id) && slot->pid.load(std::memory_order_relaxed) == pid &&
+		(port == 0 || slot->port.load(std::memory_order_relaxed) == port);
+	if (owned) {
+		slot->state.store(static_cast<uint32_t>(State::OFFLINE), std::memory_order_relaxed);
+		slot->pid.store(0, std::memory_order_relaxed);
+	}
+	unlock(*slot);
+	if (owned) {
+		header_->generation.fetch_add(1, std::memory_order_release);
+	}
+}
+
+pid_t PresenceTable::kick(const unsigned user_id) {
+	auto slot = find(user_id, false);
+	if (slot == nullptr) {
+		return 0;
+	}
+	pid_t pid = 0;
+	lock(*slot);
+	if (owns(*slot, user_id) && slot->state.load(std::memory_order_relaxed) == static_cast<uint32_t>(State::ONLINE)) {
+		slot->state.store(static_cast<uint32_t>(State::KICKED), std::memory_order_relaxed);
+		pid = slot->pid.load(std::memory_order_relaxed);
+	}
+	unlock(*slot);
+	return pid;
+}
+
+void PresenceTable::clearPid(const pid_t pid) {
+	for (size_t i = 0; i < capacity_; ++i) {
+		auto &slot = slots_[i];
+		if (slot.key.load(std::memory_order_acquire) == 0 || slot.pid.load(std::memory_order_relaxed) != pid) {
+			continue;
+		}
+		setOffline(static_cast<unsigned>(slot.key.load(std::memory_order_relaxed) - 1), pid);
+	}
+}
+
+void PresenceTable::clearPids(std::vector<pid_t> pids) {
+	std::sort(pids.begin(), pids.end());
+	for (size_t i = 0; i < capacity_; ++i) {
+		auto &slot = slots_[i];
+		auto pid = slot.pid.load(std::memory_order_relaxed);
+		if (slot.key.load(std::memory_order_acquire) == 0 || !std::binary_search(pids.begin(), pids.end(), pid)) {
+			continue;
+		}
+		setOffline(static_cast<unsigned>(slot.key.load(std::memory_order_relaxed) - 1), pid);
+	}
+}
+
+void PresenceTable::touch(const unsigned user_id) {
+	auto slot = find(user_id, false);
+	if (slot != nullptr) {
+		// a single field, readers may see it before or after the update
+		slot->last_activity.store(static_cast<int64_t>(time(nullptr)), std::memory_order_relaxed);
+	}
+}
+
+void PresenceTable::setOutbound(const unsigned user_id, const uint64_t bytes) {
+	auto slot = find(user_id, false);
+	if (slot != nullptr) {
+		slot->outbound.store(bytes, std::memory_order_relaxed);
+	}
+}
+
+std::optional<PresenceTable::Session> PresenceTable::get(const unsigned user_id) const {
+	auto slot = find(user_id, false);
+	if (slot == nullptr) {
+		return std::nullopt;
+	}
+	auto session = read(*slot);
+	// a slot given to another user is offline for this one
+	if (session.state == State::OFFLINE || session.user_id != user_id) {
+		return std::nullopt;
+	}
+	return session;
+}
+
+std::vector<PresenceTable::Session> PresenceTable::list() const {
+	std::vector<Session> result;
+	for (size_t i = 0; i < capacity_; ++i) {
+		if (slots_[i].key.load(std::memory_order_acquire) == 0) {
+			continue;
+		}
+		auto session = read(slots_[i]);
+		if (session.state == State::ONLINE) {
+			result.push_back(session);
+		}
+	}
+	return result;
+}
+
+uint64_t PresenceTable::getGeneration() const {
+	return header_->generation.load(std::memory_order_acquire);
+}
+
+int PresenceTable::getFd() const {
+	return fd_;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <sys/types.h>
+
+// Sessions of logged users in memory shared by all server processes.
+// The table is mapped before fork(), so the console and every child see the same slots.
+// The memory is a memfd, which is handed over with the listeners, so a server taking over shares the table.
+// Slots are keyed by user id with linear probing. A key is never cleared, so probe chains stay whole,
+// but a slot of an offline user is given to a new user when the table has no free slots on the way.
+// Readers do not lock: a writer makes the slot version odd for the time of update (seqlock)
+// and readers retry until they get the same even version before and after reading
+class PresenceTable final {
+public:
+	enum class State : uint32_t {
+		OFFLINE,
+		ONLINE,
+		KICKED // session process has to close the connection
+	};
+
+	struct Session {
+		unsigned user_id;
+		State state;
+		pid_t pid;
+		uint32_t ip; // network byte order
+		uint16_t port; // host byte order
+		int64_t since;
+		int64_t last_activity;
+		uint64_t outbound_bytes; // outbound queue of the session
+	};
+
+	explicit PresenceTable(size_t capacity);
+	static std::unique_ptr<PresenceTable> attach(int fd); // table of the running server, handed over to the new one
+	PresenceTable(const PresenceTable &) = delete;
+	PresenceTable &operator=(const PresenceTable &) = delete;
+	~PresenceTable();
+
+	// false when the table is full or, unless replace is set, the user is online in another session.
+	// A session is its process and the client port: a worker process serves several sessions
+	bool setOnline(unsigned user_id, pid_t pid, uint32_t ip, uint16_t port, bool replace);
+	// ends the session only if it belongs to pid and, unless port is 0, to this port
+	void setOffline(unsigned user_id, pid_t pid, uint16_t port = 0);
+	pid_t kick(unsigned user_id); // pid of the kicked session, 0 if user is not online
+	void clearPid(pid_t pid); // sessions of the process end; slots are locked, so not for a signal handler
+	void clearPids(std::vector<pid_t> pids); // processes reaped together, one pass over the table
+	void touch(unsigned user_id); // last activity of the session
+	void setOutbound(unsigned user_id, uint64_t bytes);
+
+	std::optional<Session> get(unsigned user_id) const; // session of online or kicked user
+	std::vector<Session> list() const; // sessions of all online users
+	uint64_t getGeneration() const; // changes with every login and logout
+	int getFd() const;
+
+private:
+	struct Slot {
+		std::atomic<uint64_t> key; // user id + 1, 0 for the slot never used, changed only under both locks
+		std::atomic<uint32_t> version; // odd while the slot is written
+		std::atomic<uint32_t> state;
+		std::atomic<int32_t> pid;
+		std::atomic<uint32_t> ip;
+		std::atomic<uint32_t> port;
+		std::atomic<int64_t> since;
+		std::atomic<int64_t> last_activity;
+		std::atomic<uint64_t> outbound;
+	};
+	struct Header {
+		uint32_t header_size; // both servers must have the same layout to share the table
+		uint32_t slot_size;
+		uint64_t capacity;
+		std::atomic<uint64_t> generation;
+		std::atomic<uint32_t> insert_lock; // one process at a time gives out slots
+	};
+
+	PresenceTable() = default;
+	void map(size_t size);
+	Slot *find(unsigned user_id, bool insert) const;
+	Slot *claim(uint64_t key) const; // slot of a new user, called under the insert lock
+	static bool owns(const Slot &slot, unsigned user_id);
+	static void lock(Slot &slot);
+	static void unlock(Slot &slot);
+	static Session read(const Slot &slot);
+
+	size_t capacity_{ 0 };
+	size_t mapped_{ 0 };
+	int fd_{ -1 };
+	void *data_{ nullptr };
+	Header *header_{ nullptr };
+	Slot *slots_{ nullptr };
+};
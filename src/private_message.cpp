@@ -1,6 +1,7 @@
 #include "private_message.h"
 #include "chat_message.h"
 #include "chat_user.h"
+#include "conversation.h"
 
 #include <memory>
 #include <iostream>
@@ -8,20 +9,29 @@
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#include <algorithm>
 
 PrivateMessage::PrivateMessage(const std::string &sender, const std::string &receiver, const std::string &text, const bool read) :
-	receiver_{ receiver },
+	PrivateMessage{ sender, std::vector<std::string>{ receiver }, text, read } {
+}
+
+PrivateMessage::PrivateMessage(const std::string &sender, const std::vector<std::string> &receivers, const std::string &text, const bool read) :
+	receivers_{ receivers },
 	read_ { read } {
 	sender_ = sender;
 	text_ = text;
 }
 
 void PrivateMessage::print() const {
-	std::cout << sender_ << ": @" << receiver_ << " " << text_ << std::endl;
+	std::cout << sender_ << ":";
+	for (const auto &receiver: receivers_) {
+		std::cout << " @" << receiver;
+	}
+	std::cout << " " << text_ << std::endl;
 }
 
-void PrivateMessage::printIfUnreadByUser(const std::string &user) {
-	if (!read_ && (receiver_ == user)) {
+void PrivateMessage::printIfUnreadByUser(const ChatUser &user) {
+	if (!read_ && std::find(receivers_.begin(), receivers_.end(), user.getLogin()) != receivers_.end()) {
 		print();
 		read_ = true;
 	}
@@ -37,33 +47,66 @@ void PrivateMessage::save(const std::string &filename) const {
 		throw std::runtime_error{ "Error: cannot open file" + filename + " for append" };
 	}
 	file << "PRIVATE\n"
-		<< sender_ << '\n'
-		<< receiver_ << '\n'
+		<< sender_ << '\n';
+	for (size_t i = 0; i < receivers_.size(); ++i) {
+		file << (i == 0 ? "" : " ") << receivers_[i];
+	}
+	file << '\n'
 		<< (read_ ? "READ" : "UNREAD") << '\n'
 		<< text_ << std::endl;
 	file.close();
 }
 
-void PrivateMessage::save(Mysql &mysql) const {
+unsigned long long PrivateMessage::save(Mysql &mysql) const {
+	std::vector<std::string> participants{ receivers_ };
+	participants.push_back(sender_);
+	auto conversation = Conversation::participants(participants);
+	auto new_id = insert(mysql, sender_, clientId_, conversation, [&](unsigned long long id, unsigned long long seq) {
+		// a message for several users has no single receiver, recipients are listed in `message_recipients`
+		std::stringstream ss;
+		ss << "INSERT INTO `messages` (`id`, `type`, `conversation`, `seq`, `client_id`, `sender`, `receiver`, `text`) VALUES (" <<
+			id << ", 'PRIVATE', '" << conversation << "', " << seq << ", " << getClientIdValue() << ", "
+			"(SELECT `id` FROM `users` WHERE `login` = '" << sender_ << "'), ";
+		if (receivers_.size() == 1) {
+			ss << "(SELECT `id` FROM `users` WHERE `login` = '" << receivers_.front() << "')";
+		}
+		else {
+			ss << "NULL";
+		}
+		ss << ", '" << text_ << "')";
+		return ss.str();
+	});
+	if (new_id == DUPLICATE) {
+		return DUPLICATE;
+	}
+
 	std::stringstream ss;
-	mysql.query("SELECT COALESCE(max(`id`), -1) FROM `messages`");
-	auto rows = mysql.fetchAll();
-	unsigned new_id = std::stoi(rows.front().at(0)) + 1;
-	ss << "INSERT INTO `messages` (`id`, `type`, `sender`, `receiver`, `text`) VALUES (" <<
-		new_id << ", 'PRIVATE', "
-		"(SELECT `id` FROM `users` WHERE `login` = '" << sender_ << "'), "
-		"(SELECT `id` FROM `users` WHERE `login` = '" << receiver_ << "')"
-		", '" << text_ << "')";
-	mysql.query(ss.str());
+
+	std::stringstream logins;
+	for (size_t i = 0; i < receivers_.size(); ++i) {
+		logins << (i == 0 ? "" : ", ") << "'" << receivers_[i] << "'";
+	}
+	if (receivers_.size() > 1) {
+		ss.str(std::string{});
+		ss << "INSERT INTO `message_recipients` (`message_id`, `user_id`) "
+			"SELECT " << new_id << ", `id` FROM `users` WHERE `login` IN (" << logins.str() << ")";
+		mysql.query(ss.str());
+	}
 	if (read_) {
-		return;
+		return new_id;
 	}
 
+	// all recipients are marked unread in one statement
 	ss.str(std::string{});
-	ss << "INSERT INTO `unread_messages` (`message_id`, `user_id`)"
-		"VALUES (" << new_id << ", "
-		"(SELECT `id` FROM `users` WHERE `login` = '" << receiver_ << "'))";
-	mysql.query(ss.str());
+	ss << "INSERT INTO `unread_messages` (`message_id`, `user_id`) "
+		"SELECT " << new_id << ", `id` FROM `users` WHERE `login` IN (" << logins.str() << ")";
+	if (!mysql.query(ss.str())) {
+		// counters are raised only for rows which have been stored
+		throw std::runtime_error{ mysql.getError() };
+	}
+	Conversation::addUnread(mysql, conversation,
+		"SELECT `user_id` FROM `unread_messages` WHERE `message_id` = " + std::to_string(new_id));
+	return new_id;
 }
 
 std::string PrivateMessage::createTransferString() const {
@@ -2,22 +2,25 @@
 #include "chat_message.h"
 
 #include <string>
+#include <vector>
 
 class PrivateMessage final : public ChatMessage {
 public:
 	PrivateMessage(const std::string &sender, const std::string &receiver, const std::string &text, bool read = false);
+	// message addressed to several users is stored once with a list of recipients
+	PrivateMessage(const std::string &sender, const std::vector<std::string> &receivers, const std::string &text, bool read = false);
 
 	// print the message
 	void print() const override;
 
 	// print the message if it is unread by user
-	void printIfUnreadByUser(const std::string &) override;
+	void printIfUnreadByUser(const ChatUser &) override;
 
 	// check if message is not read
 	bool isRead() const override;
 
-	// save message to database
-	void save(Mysql &mysql) const override;
+	// save message to database, returns id of the new message
+	unsigned long long save(Mysql &mysql) const override;
 	
 	// save message to file
 	void save(const std::string&) const override;
@@ -27,5 +30,5 @@ public:
 
 private:
 	bool read_{ false };
-	std::string receiver_;
+	std::vector<std::string> receivers_;
 };
@@ -0,0 +1,89 @@
+#include "recipient_set.h"
+
+#include <stdexcept>
+
+RecipientSet::RecipientSet(std::pmr::memory_resource *resource) : bits_{ resource } {}
+
+void RecipientSet::set(const unsigned user_id) {
+	size_t word = user_id / WORD_BITS;
+	if (word >= bits_.size()) {
+		bits_.resize(word + 1, 0);
+	}
+	uint64_t mask = uint64_t{ 1 } << (user_id % WORD_BITS);
+	if ((bits_[word] & mask) == 0) {
+		bits_[word] |= mask;
+		++count_;
+	}
+}
+
+bool RecipientSet::test(const unsigned user_id) const {
+	size_t word = user_id / WORD_BITS;
+	if (word >= bits_.size()) {
+		return false;
+	}
+	return (bits_[word] >> (user_id % WORD_BITS)) & 1;
+}
+
+bool RecipientSet::clear(const unsigned user_id) {
+	if (!test(user_id)) {
+		return false;
+	}
+	bits_[user_id / WORD_BITS] &= ~(uint64_t{ 1 } << (user_id % WORD_BITS));
+	--count_;
+	shrink();
+	return true;
+}
+
+bool RecipientSet::empty() const {
+	return count_ == 0;
+}
+
+size_t RecipientSet::count() const {
+	return count_;
+}
+
+void RecipientSet::shrink() {
+	while (!bits_.empty() && bits_.back() == 0) {
+		bits_.pop_back();
+	}
+}
+
+std::string RecipientSet::serialize() const {
+	static const char digits[]{ "0123456789abcdef" };
+	std::string result;
+	result.reserve(bits_.size() * WORD_BITS / 4);
+	for (auto word: bits_) {
+		// every word is written as 16 hex digits, least significant nibble first
+		for (unsigned i = 0; i < WORD_BITS / 4; ++i) {
+			result += digits[(word >> (i * 4)) & 0xf];
+		}
+	}
+	return result;
+}
+
+RecipientSet RecipientSet::deserialize(const std::string &src) {
+	RecipientSet result;
+	if (src.length() % (WORD_BITS / 4) != 0) {
+		throw std::invalid_argument{ "Error: malformed recipient set" };
+	}
+	result.bits_.resize(src.length() / (WORD_BITS / 4), 0);
+	for (size_t i = 0; i < src.length(); ++i) {
+		char c = src[i];
+		uint64_t nibble;
+		if (c >= '0' && c <= '9') {
+			nibble = c - '0';
+		}
+		else if (c >= 'a' && c <= 'f') {
+			nibble = c - 'a' + 10;
+		}
+		else {
+			throw std::invalid_argument{ "Error: malformed recipient set" };
+		}
+		result.bits_[i / (WORD_BITS / 4)] |= nibble << ((i % (WORD_BITS / 4)) * 4);
+	}
+	for (auto word: result.bits_) {
+		result.count_ += __builtin_popcountll(word);
+	}
+	result.shrink();
+	return result;
+}
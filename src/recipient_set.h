@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+// Dense bitmap of user ids. One bit per registered user instead of a copy of ChatUser
+class RecipientSet final {
+public:
+	RecipientSet() = default;
+	// bitmap words are allocated from resource, e.g. the arena of a message batch.
+	// Assignment keeps the resource of the target, copy construction uses the default one
+	explicit RecipientSet(std::pmr::memory_resource *resource);
+
+	// mark user as recipient
+	void set(unsigned user_id);
+
+	// check if user is still in the set
+	bool test(unsigned user_id) const;
+
+	// remove user from the set, returns true if the user was present
+	bool clear(unsigned user_id);
+
+	bool empty() const;
+	size_t count() const;
+
+	// pack bitmap to hex string (trailing zero words are omitted)
+	std::string serialize() const;
+	static RecipientSet deserialize(const std::string &);
+
+	// call f(user_id) for every recipient in ascending order
+	template <typename F>
+	void forEach(F f) const {
+		for (size_t word = 0; word < bits_.size(); ++word) {
+			uint64_t w = bits_[word];
+			while (w != 0) {
+				unsigned bit = __builtin_ctzll(w);
+				f(static_cast<unsigned>(word * WORD_BITS + bit));
+				w &= w - 1;
+			}
+		}
+	}
+
+private:
+	static const unsigned WORD_BITS{ 64 };
+	void shrink();
+
+	std::pmr::vector<uint64_t> bits_;
+	size_t count_{ 0 };
+};
@@ -0,0 +1,148 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+
+std::vector<std::string> SearchIndex::tokenize(const std::string &text) {
+	std::vector<std::string> result;
+	std::string word;
+	for (unsigned char c: text) {
+		// bytes of multibyte UTF-8 characters are kept as parts of the word
+		if (std::isalnum(c) || c >= 0x80) {
+			word += static_cast<char>(std::tolower(c));
+		}
+		else if (!word.empty()) {
+			result.push_back(std::move(word));
+			word.clear();
+		}
+	}
+	if (!word.empty()) {
+		result.push_back(std::move(word));
+	}
+	return result;
+}
+
+void SearchIndex::appendVarint(std::vector<uint8_t> &data, unsigned long long value) {
+	while (value >= 0x80) {
+		data.push_back(static_cast<uint8_t>(value | 0x80));
+		value >>= 7;
+	}
+	data.push_back(static_cast<uint8_t>(value));
+}
+
+std::vector<unsigned long long> SearchIndex::decode(const PostingList &list) {
+	std::vector<unsigned long long> result;
+	unsigned long long value{ 0 }, previous{ 0 };
+	unsigned shift{ 0 };
+	bool first{ true };
+	for (auto byte: list.data) {
+		value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+		if (byte & 0x80) {
+			shift += 7;
+			continue;
+		}
+		// the first entry is stored as is, the rest as differences
+		previous = first ? value : previous + value;
+		result.push_back(previous);
+		first = false;
+		value = 0;
+		shift = 0;
+	}
+	return result;
+}
+
+void SearchIndex::add(
+	const unsigned long long id,
+	const unsigned sender,
+	const unsigned receiver,
+	const std::string &text,
+	const unsigned channel
+	) {
+	if (!documents_.empty() && id <= documents_.back().id) {
+		return; // already indexed
+	}
+	documents_.push_back(Document{ id, sender, receiver, channel });
+
+	auto words = tokenize(text);
+	std::sort(words.begin(), words.end());
+	words.erase(std::unique(words.begin(), words.end()), words.end());
+	for (const auto &word: words) {
+		auto &list = terms_[word];
+		appendVarint(list.data, list.data.empty() ? id : id - list.last);
+		list.last = id;
+	}
+}
+
+void SearchIndex::addReceiver(const unsigned long long id, const unsigned receiver) {
+	std::pair<unsigned long long, unsigned> entry{ id, receiver };
+	if (!receivers_.empty() && entry <= receivers_.back()) {
+		return; // already indexed
+	}
+	receivers_.push_back(entry);
+}
+
+bool SearchIndex::isVisible(const unsigned long long id, const unsigned user_id, const std::set<unsigned> &channels) const {
+	if (user_id == ALL_USERS) {
+		return true;
+	}
+	auto it = std::lower_bound(documents_.begin(), documents_.end(), id,
+		[](const Document &doc, unsigned long long id) { return doc.id < id; });
+	if (it == documents_.end() || it->id != id) {
+		return false;
+	}
+	if (it->channel != NO_CHANNEL) {
+		return channels.count(it->channel) != 0;
+	}
+	if (it->receiver == SEVERAL_RECEIVERS) {
+		return it->sender == user_id ||
+			std::binary_search(receivers_.begin(), receivers_.end(), std::make_pair(id, user_id));
+	}
+	return it->receiver == BROADCAST || it->sender == user_id || it->receiver == user_id;
+}
+
+std::vector<unsigned long long> SearchIndex::search(
+	const std::string &query,
+	const unsigned user_id,
+	const size_t limit,
+	const std::set<unsigned> &channels
+	) const {
+	auto words = tokenize(query);
+	std::vector<const PostingList *> lists;
+	for (const auto &word: words) {
+		auto it = terms_.find(word);
+		if (it == terms_.end()) {
+			return {};
+		}
+		lists.push_back(&it->second);
+	}
+	if (lists.empty()) {
+		return {};
+	}
+	// intersect starting from the shortest list
+	std::sort(lists.begin(), lists.end(),
+		[](const PostingList *a, const PostingList *b) { return a->data.size() < b->data.size(); });
+	auto matches = decode(*lists.front());
+	for (size_t i = 1; i < lists.size() && !matches.empty(); ++i) {
+		auto ids = decode(*lists[i]);
+		std::vector<unsigned long long> intersection;
+		std::set_intersection(matches.begin(), matches.end(), ids.begin(), ids.end(), std::back_inserter(intersection));
+		matches = std::move(intersection);
+	}
+
+	std::vector<unsigned long long> result;
+	for (auto it = matches.rbegin(); it != matches.rend() && result.size() < limit; ++it) {
+		if (isVisible(*it, user_id, channels)) {
+			result.push_back(*it);
+		}
+	}
+	return result;
+}
+
+unsigned long long SearchIndex::getLastId() const {
+	return documents_.empty() ? 0 : documents_.back().id;
+}
+
+size_t SearchIndex::size() const {
+	return documents_.size();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Inverted index over message text. Posting lists hold ascending message ids
+// packed as varint-encoded deltas
+class SearchIndex final {
+public:
+	static constexpr unsigned ALL_USERS{ 0xffffffff };
+	static constexpr unsigned BROADCAST{ 0xffffffff };
+	static constexpr unsigned SEVERAL_RECEIVERS{ 0xfffffffe };
+	static constexpr unsigned NO_CHANNEL{ 0 };
+
+	// index message; ids must be added in ascending order
+	void add(unsigned long long id, unsigned sender, unsigned receiver, const std::string &text, unsigned channel = NO_CHANNEL);
+
+	// add receiver of message indexed with SEVERAL_RECEIVERS
+	void addReceiver(unsigned long long id, unsigned receiver);
+
+	// ids of messages containing all words of the query and visible to user, newest first;
+	// channel messages are visible to members of the channel only
+	std::vector<unsigned long long> search(
+		const std::string &query,
+		unsigned user_id,
+		size_t limit,
+		const std::set<unsigned> &channels = {}
+		) const;
+
+	// id of the newest indexed message or 0 if index is empty
+	unsigned long long getLastId() const;
+	size_t size() const;
+
+	// split text to lower-cased words
+	static std::vector<std::string> tokenize(const std::string &text);
+
+private:
+	struct PostingList {
+		std::vector<uint8_t> data;
+		unsigned long long last{ 0 };
+	};
+	struct Document {
+		unsigned long long id;
+		unsigned sender;
+		unsigned receiver; // BROADCAST for broadcast messages, SEVERAL_RECEIVERS if listed in receivers_
+		unsigned channel; // NO_CHANNEL for private and broadcast messages
+	};
+
+	static void appendVarint(std::vector<uint8_t> &data, unsigned long long value);
+	static std::vector<unsigned long long> decode(const PostingList &list);
+	bool isVisible(unsigned long long id, unsigned user_id, const std::set<unsigned> &channels) const;
+
+	std::unordered_map<std::string, PostingList> terms_;
+	std::vector<Document> documents_; // ascending by id
+	std::vector<std::pair<unsigned long long, unsigned>> receivers_; // (id, receiver), ascending
+};
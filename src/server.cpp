@@ -1,12 +1,15 @@
 #include "chat_server.h"
 
 
-int main() {
+int main(int argc, char *argv[]) {
 	try {
-		static ChatServer chat;
+		// --takeover: the running server gives its listening socket to this one and drains
+		static ChatServer chat{ argc > 1 && std::string{ argv[1] } == "--takeover" };
+		// handlers of the child processes, the main process and the acceptors read SIGINT, SIGTERM, SIGUSR2 and SIGCHLD from signalfd
 		signal(SIGTERM, [](int signum) { chat.sigTermHandler(signum); });
-		signal(SIGCHLD, [](int signum) { chat.childDeathHandler(signum); });
 		signal(SIGINT, [](int signum) { chat.sigIntHandler(signum); });
+		signal(SIGUSR1, [](int signum) { chat.wakeUpHandler(signum); });
+		signal(SIGUSR2, [](int signum) { chat.drainHandler(signum, false); });
 		chat.work();
 	}
 	catch (const std::runtime_error &e) {
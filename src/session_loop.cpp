@@ -0,0 +1,188 @@
+#include "session_loop.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+std::coroutine_handle<> SessionLoop::Task::promise_type::FinalAwaiter::await_suspend(
+	std::coroutine_handle<promise_type> handle
+	) noexcept {
+	auto continuation = handle.promise().continuation;
+	return continuation ? continuation : std::noop_coroutine();
+}
+
+SessionLoop::Task::Task(std::coroutine_handle<promise_type> handle) : handle_{ handle } {}
+
+SessionLoop::Task::Task(Task &&other) noexcept : handle_{ std::exchange(other.handle_, nullptr) } {}
+
+SessionLoop::Task &SessionLoop::Task::operator=(Task &&other) noexcept {
+	if (this != &other) {
+		if (handle_) {
+			handle_.destroy();
+		}
+		handle_ = std::exchange(other.handle_, nullptr);
+	}
+	return *this;
+}
+
+SessionLoop::Task::~Task() {
+	if (handle_) {
+		handle_.destroy();
+	}
+}
+
+bool SessionLoop::Task::done() const {
+	return !handle_ || handle_.done();
+}
+
+void SessionLoop::Task::rethrow() const {
+	if (handle_ && handle_.promise().exception) {
+		std::rethrow_exception(handle_.promise().exception);
+	}
+}
+
+void SessionLoop::Task::await_suspend(const std::coroutine_handle<> handle) noexcept {
+	handle_.promise().continuation = handle;
+}
+
+SessionLoop::DescriptorAwaiter::DescriptorAwaiter(SessionLoop &loop, const int fd, const bool write) :
+	loop_{ loop },
+	fd_{ fd },
+	write_{ write } {
+}
+
+SessionLoop::DescriptorAwaiter::~DescriptorAwaiter() {
+	// the coroutine is destroyed while waiting
+	if (handle_) {
+		loop_.removeWaiter(handle_);
+	}
+}
+
+void SessionLoop::DescriptorAwaiter::await_suspend(std::coroutine_handle<> handle) {
+	handle_ = handle;
+	loop_.waiters_.push_back({ fd_, write_, handle });
+}
+
+SessionLoop::NextAwaiter::NextAwaiter(SessionLoop &loop) : loop_{ loop } {}
+
+SessionLoop::NextAwaiter::~NextAwaiter() {
+	if (handle_) {
+		loop_.next_.erase(std::remove(loop_.next_.begin(), loop_.next_.end(), handle_), loop_.next_.end());
+	}
+}
+
+void SessionLoop::NextAwaiter::await_suspend(std::coroutine_handle<> handle) {
+	handle_ = handle;
+	loop_.next_.push_back(handle);
+}
+
+SessionLoop::SleepAwaiter::SleepAwaiter(SessionLoop &loop, const std::chrono::milliseconds delay) :
+	loop_{ loop },
+	delay_{ delay } {
+}
+
+SessionLoop::SleepAwaiter::~SleepAwaiter() {
+	if (timer_ != 0) {
+		loop_.timers_.cancel(timer_);
+	}
+}
+
+void SessionLoop::SleepAwaiter::await_suspend(std::coroutine_handle<> handle) {
+	timer_ = loop_.timers_.schedule(delay_, [this, handle] {
+		timer_ = 0;
+		handle.resume();
+	});
+}
+
+SessionLoop::SessionLoop(TimerWheel &timers, std::function<std::chrono::milliseconds()> poll) :
+	timers_{ timers },
+	poll_{ std::move(poll) } {
+}
+
+SessionLoop::DescriptorAwaiter SessionLoop::readable(const int fd) {
+	return DescriptorAwaiter{ *this, fd, false };
+}
+
+SessionLoop::DescriptorAwaiter SessionLoop::writable(const int fd) {
+	return DescriptorAwaiter{ *this, fd, true };
+}
+
+SessionLoop::SleepAwaiter SessionLoop::sleep(const std::chrono::milliseconds delay) {
+	return SleepAwaiter{ *this, delay };
+}
+
+SessionLoop::NextAwaiter SessionLoop::next() {
+	return NextAwaiter{ *this };
+}
+
+void SessionLoop::removeWaiter(std::coroutine_handle<> handle) {
+	waiters_.erase(std::remove_if(waiters_.begin(), waiters_.end(),
+		[handle](const Waiter &waiter) { return waiter.handle == handle; }), waiters_.end());
+}
+
+void SessionLoop::run(const Task &task) {
+	while (!task.done()) {
+		auto timeout = prepare();
+		if (task.done()) {
+			break; // finished by a timer
+		}
+		fd_set rfds, wfds;
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		int maxFd = -1;
+		addWaiters(rfds, wfds, maxFd);
+		struct timeval tv;
+		tv.tv_sec = timeout.count() / 1000;
+		tv.tv_usec = (timeout.count() % 1000) * 1000;
+		auto retval = select(maxFd + 1, &rfds, &wfds, nullptr, &tv);
+		if (retval == -1 && errno == EINTR) {
+			continue; // woken up by a signal
+		}
+		if (retval == -1) {
+			throw std::runtime_error{ std::string{ "An error occured while trying to call select(): " } + strerror(errno) };
+		}
+		if (retval == 0) {
+			continue;
+		}
+		dispatch(rfds, wfds);
+	}
+	task.rethrow();
+}
+
+std::chrono::milliseconds SessionLoop::prepare() {
+	auto limit = poll_();
+	timers_.advance();
+	std::vector<std::coroutine_handle<>> next;
+	next.swap(next_);
+	for (auto handle: next) {
+		handle.resume();
+	}
+	return timers_.getTimeout(limit);
+}
+
+void SessionLoop::addWaiters(fd_set &rfds, fd_set &wfds, int &maxFd) const {
+	for (const auto &waiter: waiters_) {
+		FD_SET(waiter.fd, waiter.write ? &wfds : &rfds);
+		maxFd = std::max(maxFd, waiter.fd);
+	}
+}
+
+void SessionLoop::dispatch(const fd_set &rfds, const fd_set &wfds) {
+	// resumed coroutines may wait for descriptors again, so the ready ones are taken out first
+	std::vector<Waiter> ready;
+	for (auto it = waiters_.begin(); it != waiters_.end(); ) {
+		if (FD_ISSET(it->fd, it->write ? &wfds : &rfds)) {
+			ready.push_back(*it);
+			it = waiters_.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	for (const auto &waiter: ready) {
+		waiter.handle.resume();
+	}
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "timer_wheel.h"
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <vector>
+
+extern "C" {
+	#include <sys/select.h>
+}
+
+// Event loop of a session process for C++20 coroutines.
+// A coroutine waits for a readable or writable descriptor or for a timer of the wheel with co_await
+// and is resumed by run(), so the flow of a session is written sequentially:
+// read a request, handle it, read the next one. Descriptors are polled with select()
+class SessionLoop final {
+public:
+	// coroutine which starts at once and runs until its first co_await.
+	// The frame is destroyed with the task, a waiting coroutine is cancelled then.
+	// Another coroutine may co_await the task: it is resumed when the task finishes
+	class Task final {
+	public:
+		struct promise_type {
+			// the frame stays until the task is destroyed, done() is checked by the loop
+			struct FinalAwaiter {
+				bool await_ready() const noexcept { return false; }
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+				void await_resume() const noexcept {}
+			};
+
+			Task get_return_object() { return Task{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			FinalAwaiter final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { exception = std::current_exception(); }
+
+			std::exception_ptr exception;
+			std::coroutine_handle<> continuation; // coroutine awaiting the task
+		};
+
+		Task(Task &&other) noexcept;
+		Task &operator=(Task &&other) noexcept;
+		Task(const Task &) = delete;
+		Task &operator=(const Task &) = delete;
+		~Task();
+
+		bool done() const;
+		void rethrow() const; // exception escaped from the coroutine
+
+		bool await_ready() const noexcept { return done(); }
+		void await_suspend(std::coroutine_handle<> handle) noexcept;
+		void await_resume() const { rethrow(); }
+
+	private:
+		explicit Task(std::coroutine_handle<promise_type> handle);
+
+		std::coroutine_handle<promise_type> handle_;
+	};
+
+	class DescriptorAwaiter final {
+	public:
+		DescriptorAwaiter(SessionLoop &loop, int fd, bool write);
+		DescriptorAwaiter(const DescriptorAwaiter &) = delete;
+		~DescriptorAwaiter();
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle);
+		void await_resume() const noexcept {}
+
+	private:
+		SessionLoop &loop_;
+		int fd_;
+		bool write_;
+		std::coroutine_handle<> handle_;
+	};
+
+	class NextAwaiter final {
+	public:
+		explicit NextAwaiter(SessionLoop &loop);
+		NextAwaiter(const NextAwaiter &) = delete;
+		~NextAwaiter();
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle);
+		void await_resume() const noexcept {}
+
+	private:
+		SessionLoop &loop_;
+		std::coroutine_handle<> handle_;
+	};
+
+	class SleepAwaiter final {
+	public:
+		SleepAwaiter(SessionLoop &loop, std::chrono::milliseconds delay);
+		SleepAwaiter(const SleepAwaiter &) = delete;
+		~SleepAwaiter();
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle);
+		void await_resume() const noexcept {}
+
+	private:
+		SessionLoop &loop_;
+		std::chrono::milliseconds delay_;
+		TimerWheel::TimerId timer_{ 0 };
+	};
+
+	// poll is called on every iteration before waiting: it does the work which is not bound
+	// to a descriptor and returns the longest time the loop may wait
+	SessionLoop(TimerWheel &timers, std::function<std::chrono::milliseconds()> poll);
+
+	DescriptorAwaiter readable(int fd);
+	DescriptorAwaiter writable(int fd);
+	SleepAwaiter sleep(std::chrono::milliseconds delay);
+	// resumes on the next iteration after poll, before waiting: for state changed by other coroutines
+	NextAwaiter next();
+
+	// runs until the task finishes, rethrows its exception
+	void run(const Task &task);
+
+	// one iteration split for a worker process waiting for the loops of all its sessions in one select():
+	// prepare() calls poll, runs expired timers and next() waiters and returns the longest time to wait,
+	// addWaiters() adds the awaited descriptors to the sets, dispatch() resumes coroutines of the ready ones
+	std::chrono::milliseconds prepare();
+	void addWaiters(fd_set &rfds, fd_set &wfds, int &maxFd) const;
+	void dispatch(const fd_set &rfds, const fd_set &wfds);
+
+private:
+	struct Waiter {
+		int fd;
+		bool write;
+		std::coroutine_handle<> handle;
+	};
+
+	void removeWaiter(std::coroutine_handle<> handle);
+
+	TimerWheel &timers_;
+	std::function<std::chrono::milliseconds()> poll_;
+	std::vector<Waiter> waiters_;
+	std::vector<std::coroutine_handle<>> next_;
+};
@@ -0,0 +1,101 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+TimerWheel::TimerWheel(const std::chrono::milliseconds tick, const Clock::time_point now) :
+	tick_{ std::max(tick, std::chrono::milliseconds{ 1 }) },
+	start_{ now } {
+}
+
+TimerWheel::TimerId TimerWheel::schedule(const std::chrono::milliseconds delay, Callback callback) {
+	// a timer never fires earlier than asked, so the delay is rounded up to whole ticks
+	uint64_t ticks = (std::max(delay, std::chrono::milliseconds{ 0 }) + tick_ - std::chrono::milliseconds{ 1 }) / tick_;
+	auto id = nextId_++;
+	auto &timer = timers_[id];
+	timer.expires = current_ + std::max<uint64_t>(ticks, 1);
+	timer.callback = std::move(callback);
+	place(id, timer);
+	return id;
+}
+
+bool TimerWheel::cancel(const TimerId id) {
+	auto it = timers_.find(id);
+	if (it == timers_.end()) {
+		return false;
+	}
+	wheel_[it->second.level][it->second.slot].erase(it->second.position);
+	timers_.erase(it);
+	return true;
+}
+
+void TimerWheel::place(const TimerId id, Timer &timer) {
+	uint64_t delta = timer.expires > current_ ? timer.expires - current_ : 0;
+	size_t level = 0;
+	while (level + 1 < LEVELS && delta >= (uint64_t{ 1 } << (SLOT_BITS * (level + 1)))) {
+		++level;
+	}
+	// timers beyond the last level wait in its farthest slot and are placed again on cascade
+	uint64_t expires = std::min(timer.expires, current_ + (uint64_t{ 1 } << (SLOT_BITS * LEVELS)) - 1);
+	timer.level = level;
+	timer.slot = (expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+	auto &slot = wheel_[timer.level][timer.slot];
+	timer.position = slot.insert(slot.end(), id);
+}
+
+void TimerWheel::cascade(const size_t level) {
+	auto &slot = wheel_[level][(current_ >> (SLOT_BITS * level)) & (SLOTS - 1)];
+	std::list<TimerId> timers;
+	timers.swap(slot);
+	for (auto id: timers) {
+		place(id, timers_.at(id));
+	}
+}
+
+void TimerWheel::advance(const Clock::time_point now) {
+	if (now < start_) {
+		return;
+	}
+	uint64_t target = (now - start_) / tick_;
+	while (current_ < target) {
+		++current_;
+		// when a level wraps around, the next slot of the level above comes down
+		for (size_t level = 1; level < LEVELS; ++level) {
+			if ((current_ & ((uint64_t{ 1 } << (SLOT_BITS * level)) - 1)) != 0) {
+				break;
+			}
+			cascade(level);
+		}
+		std::list<TimerId> expired;
+		expired.swap(wheel_[0][current_ & (SLOTS - 1)]);
+		for (auto id: expired) {
+			auto it = timers_.find(id);
+			if (it == timers_.end()) {
+				continue; // cancelled by a previous callback
+			}
+			auto callback = std::move(it->second.callback);
+			timers_.erase(it);
+			callback();
+		}
+	}
+}
+
+std::chrono::milliseconds TimerWheel::getTimeout(const std::chrono::milliseconds limit) const {
+	if (timers_.empty()) {
+		return limit;
+	}
+	// the nearest non-empty slot of level 0; timers of upper levels come down not earlier than level 0 wraps
+	uint64_t ticks = SLOTS - (current_ & (SLOTS - 1));
+	for (uint64_t i = 1; i <= SLOTS; ++i) {
+		if (!wheel_[0][(current_ + i) & (SLOTS - 1)].empty()) {
+			ticks = i;
+			break;
+		}
+	}
+	auto due = start_ + (current_ + ticks) * tick_;
+	auto timeout = std::chrono::ceil<std::chrono::milliseconds>(due - Clock::now());
+	return std::clamp(timeout, std::chrono::milliseconds{ 0 }, limit);
+}
+
+size_t TimerWheel::size() const {
+	return timers_.size();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+// Hierarchical timer wheel. Level 0 has one slot per tick, every next level has slots
+// 64 times longer; timers move down a level when their slot comes near (cascading).
+// Scheduling and cancelling are O(1), advancing costs O(1) per tick and expired timer
+class TimerWheel final {
+public:
+	using Clock = std::chrono::steady_clock;
+	using TimerId = uint64_t;
+	using Callback = std::function<void()>;
+
+	explicit TimerWheel(std::chrono::milliseconds tick, Clock::time_point now = Clock::now());
+
+	TimerId schedule(std::chrono::milliseconds delay, Callback callback);
+	bool cancel(TimerId id);
+
+	// runs callbacks of all timers expired by now; callbacks may schedule new timers
+	void advance(Clock::time_point now = Clock::now());
+
+	// time until the nearest timer may expire, limit if there are no timers closer than it
+	std::chrono::milliseconds getTimeout(std::chrono::milliseconds limit) const;
+	size_t size() const;
+
+private:
+	static constexpr size_t SLOT_BITS{ 6 };
+	static constexpr size_t SLOTS{ 1 << SLOT_BITS };
+	static constexpr size_t LEVELS{ 4 };
+
+	struct Timer {
+		uint64_t expires; // tick
+		Callback callback;
+		size_t level;
+		size_t slot;
+		std::list<TimerId>::iterator position;
+	};
+
+	void place(TimerId id, Timer &timer);
+	void cascade(size_t level);
+
+	std::chrono::milliseconds tick_;
+	Clock::time_point start_;
+	uint64_t current_{ 0 }; // last processed tick
+	TimerId nextId_{ 1 };
+	std::unordered_map<TimerId, Timer> timers_;
+	std::array<std::array<std::list<TimerId>, SLOTS>, LEVELS> wheel_;
+};
@@ -0,0 +1,276 @@
+#include "uring_io.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(CHAT_WITH_URING)
+extern "C" {
+	#include <liburing.h>
+	#include <poll.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+}
+
+namespace {
+	constexpr uint64_t ACCEPT_TAG{ ~0ULL };
+	constexpr uint64_t WAKE_TAG{ ~0ULL - 1 };
+	constexpr int BUFFER_GROUP{ 1 };
+
+	void throwError(const std::string &what, const int error) {
+		throw std::runtime_error{ what + ": " + strerror(error) };
+	}
+}
+
+struct UringIo::Ring {
+	io_uring ring;
+	io_uring_buf_ring *buffers{ nullptr };
+	std::vector<char> memory; // BUFFER_COUNT buffers of BUFFER_LENGTH bytes
+	int listenFd{ -1 };
+	bool accepting{ false };
+	int wakeFd{ -1 };
+	bool watching{ false };
+
+	io_uring_sqe *getSqe() {
+		auto sqe = io_uring_get_sqe(&ring);
+		if (sqe == nullptr) {
+			// submission queue is full, the kernel takes its entries and frees it
+			io_uring_submit(&ring);
+			sqe = io_uring_get_sqe(&ring);
+		}
+		if (sqe == nullptr) {
+			throw std::runtime_error{ "io_uring submission queue is full" };
+		}
+		return sqe;
+	}
+
+	void recycle(const unsigned short id) {
+		io_uring_buf_ring_add(buffers, memory.data() + id * BUFFER_LENGTH, BUFFER_LENGTH, id,
+			io_uring_buf_ring_mask(BUFFER_COUNT), 0);
+		io_uring_buf_ring_advance(buffers, 1);
+	}
+};
+
+bool UringIo::isAvailable() {
+	return true;
+}
+
+UringIo::UringIo(const unsigned entries) : ring_{ std::make_unique<Ring>() } {
+	auto status = io_uring_queue_init(entries, &ring_->ring, 0);
+	if (status < 0) {
+		throwError("Can not create io_uring", -status);
+	}
+	ring_->memory.resize(BUFFER_COUNT * BUFFER_LENGTH);
+	ring_->buffers = io_uring_setup_buf_ring(&ring_->ring, BUFFER_COUNT, BUFFER_GROUP, 0, &status);
+	if (ring_->buffers == nullptr) {
+		io_uring_queue_exit(&ring_->ring);
+		throwError("Can not register io_uring buffers", -status);
+	}
+	for (unsigned short id = 0; id < BUFFER_COUNT; ++id) {
+		io_uring_buf_ring_add(ring_->buffers, ring_->memory.data() + id * BUFFER_LENGTH, BUFFER_LENGTH, id,
+			io_uring_buf_ring_mask(BUFFER_COUNT), id);
+	}
+	io_uring_buf_ring_advance(ring_->buffers, BUFFER_COUNT);
+}
+
+UringIo::~UringIo() {
+	if (!ring_) {
+		return;
+	}
+	io_uring_free_buf_ring(&ring_->ring, ring_->buffers, BUFFER_COUNT, BUFFER_GROUP);
+	io_uring_queue_exit(&ring_->ring);
+}
+
+void UringIo::abandon() {
+	if (!ring_) {
+		return;
+	}
+	// unmapping and closing the copy of the ring fd do not change the ring of the parent,
+	// unregistering the buffer group would
+	munmap(ring_->buffers, BUFFER_COUNT * sizeof(io_uring_buf));
+	io_uring_queue_exit(&ring_->ring);
+	ring_.reset();
+}
+
+void UringIo::startAccept(const int listenFd) {
+	ring_->listenFd = listenFd;
+	// the address is taken by getpeername(), one buffer for all completions would be overwritten
+	auto sqe = ring_->getSqe();
+	io_uring_prep_multishot_accept(sqe, listenFd, nullptr, nullptr, 0);
+	io_uring_sqe_set_data64(sqe, ACCEPT_TAG);
+	io_uring_submit(&ring_->ring);
+	ring_->accepting = true;
+}
+
+void UringIo::setWakeFd(const int fd) {
+	ring_->wakeFd = fd;
+}
+
+int UringIo::accept() {
+	while (true) {
+		if (!ring_->accepting) {
+			startAccept(ring_->listenFd);
+		}
+		if (ring_->wakeFd != -1 && !ring_->watching) {
+			// one-shot poll, armed again after every wake-up
+			auto sqe = ring_->getSqe();
+			io_uring_prep_poll_add(sqe, ring_->wakeFd, POLLIN);
+			io_uring_sqe_set_data64(sqe, WAKE_TAG);
+			io_uring_submit(&ring_->ring);
+			ring_->watching = true;
+		}
+		io_uring_cqe *cqe;
+		auto status = io_uring_wait_cqe(&ring_->ring, &cqe);
+		if (status < 0) {
+			errno = -status;
+			return -1;
+		}
+		auto tag = io_uring_cqe_get_data64(cqe);
+		auto result = cqe->res;
+		if (tag == ACCEPT_TAG && !(cqe->flags & IORING_CQE_F_MORE)) {
+			ring_->accepting = false;
+		}
+		io_uring_cqe_seen(&ring_->ring, cqe);
+		if (tag == WAKE_TAG) {
+			ring_->watching = false;
+			errno = EINTR;
+			return -1;
+		}
+		if (tag != ACCEPT_TAG) {
+			continue;
+		}
+		if (result < 0) {
+			errno = -result;
+			return -1;
+		}
+		return result;
+	}
+}
+
+ssize_t UringIo::recv(const int fd, std::string &dst) {
+	auto sqe = ring_->getSqe();
+	io_uring_prep_recv(sqe, fd, nullptr, BUFFER_LENGTH, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUFFER_GROUP;
+	io_uring_sqe_set_data64(sqe, 0);
+	io_uring_submit(&ring_->ring);
+
+	io_uring_cqe *cqe;
+	int status;
+	while ((status = io_uring_wait_cqe(&ring_->ring, &cqe)) == -EINTR) {
+		// the request stays in the ring, only waiting is interrupted
+	}
+	if (status < 0) {
+		errno = -status;
+		return -1;
+	}
+	auto result = cqe->res;
+	auto flags = cqe->flags;
+	io_uring_cqe_seen(&ring_->ring, cqe);
+	if (result < 0) {
+		errno = -result;
+		return -1;
+	}
+	if (flags & IORING_CQE_F_BUFFER) {
+		auto id = static_cast<unsigned short>(flags >> IORING_CQE_BUFFER_SHIFT);
+		dst.append(ring_->memory.data() + id * BUFFER_LENGTH, result);
+		// the buffer is given back at once, so the group never runs out of buffers
+		ring_->recycle(id);
+	}
+	return result;
+}
+
+bool UringIo::send(const int fd, const std::vector<Buffer> &buffers) {
+	if (buffers.empty()) {
+		return true;
+	}
+	// a chain of sends keeps the order of buffers and costs one io_uring_enter()
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		auto sqe = ring_->getSqe();
+		io_uring_prep_send(sqe, fd, buffers[i].first, buffers[i].second, 0);
+		io_uring_sqe_set_data64(sqe, i);
+		if (i + 1 < buffers.size()) {
+			sqe->flags |= IOSQE_IO_LINK;
+		}
+	}
+	io_uring_submit_and_wait(&ring_->ring, buffers.size());
+
+	std::vector<int> results(buffers.size(), -ECANCELED);
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		io_uring_cqe *cqe;
+		int status;
+		while ((status = io_uring_wait_cqe(&ring_->ring, &cqe)) == -EINTR) {
+		}
+		if (status < 0) {
+			errno = -status;
+			return false;
+		}
+		auto index = io_uring_cqe_get_data64(cqe);
+		if (index < results.size()) {
+			results[index] = cqe->res;
+		}
+		io_uring_cqe_seen(&ring_->ring, cqe);
+	}
+	// a short send breaks the chain, the rest is written the usual way
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		if (results[i] < 0 && results[i] != -ECANCELED) {
+			errno = -results[i];
+			return false;
+		}
+		size_t sent = results[i] < 0 ? 0 : results[i];
+		auto buf = buffers[i].first + sent;
+		auto length = buffers[i].second - sent;
+		while (length > 0) {
+			auto bytes = write(fd, buf, length);
+			if (bytes == -1 && errno == EINTR) {
+				continue;
+			}
+			if (bytes <= 0) {
+				return false;
+			}
+			buf += bytes;
+			length -= bytes;
+		}
+	}
+	return true;
+}
+
+#else
+
+struct UringIo::Ring {};
+
+bool UringIo::isAvailable() {
+	return false;
+}
+
+UringIo::UringIo(unsigned) {
+	throw std::runtime_error{ "Server is built without io_uring support (liburing was not found)" };
+}
+
+UringIo::~UringIo() = default;
+
+void UringIo::abandon() {
+}
+
+void UringIo::startAccept(int) {
+}
+
+int UringIo::accept() {
+	errno = ENOSYS;
+	return -1;
+}
+
+void UringIo::setWakeFd(int) {
+}
+
+ssize_t UringIo::recv(int, std::string &) {
+	errno = ENOSYS;
+	return -1;
+}
+
+bool UringIo::send(int, const std::vector<Buffer> &) {
+	errno = ENOSYS;
+	return false;
+}
+
+#endif
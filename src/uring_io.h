@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/types.h>
+#endif
+
+// Socket I/O through io_uring: multishot accept on a listener, recv into buffers
+// provided to the kernel and several sends linked into one submission.
+// Every process creates its own ring, a ring must not be used after fork().
+// Available only when built with liburing (CHAT_WITH_URING), otherwise constructor throws
+class UringIo final {
+public:
+	using Buffer = std::pair<const char *, size_t>;
+
+	static bool isAvailable(); // built with liburing
+
+	explicit UringIo(unsigned entries = DEFAULT_ENTRIES);
+	UringIo(const UringIo &) = delete;
+	UringIo &operator=(const UringIo &) = delete;
+	~UringIo();
+
+	// in a child process after fork(): drop the copy of the ring without unregistering
+	// anything on the kernel ring, which the parent still uses. The object can only be destroyed then
+	void abandon();
+
+	// one request accepts all connections until it is cancelled by the kernel, then it is armed again
+	void startAccept(int listenFd);
+	// next accepted connection, -1 on error (errno is set)
+	int accept();
+	// accept() also returns -1 with errno EINTR when fd becomes readable (signalfd of the process)
+	void setWakeFd(int fd);
+
+	// appends received bytes to dst, returns their number, 0 if peer has closed the connection and -1 on error
+	ssize_t recv(int fd, std::string &dst);
+	// sends all buffers in order with one system call, returns false on error
+	bool send(int fd, const std::vector<Buffer> &buffers);
+
+	static constexpr unsigned DEFAULT_ENTRIES{ 64 };
+	static constexpr unsigned BUFFER_COUNT{ 16 };
+	static constexpr unsigned BUFFER_LENGTH{ 16 * 1024 };
+
+private:
+	struct Ring;
+	std::unique_ptr<Ring> ring_;
+};